@@ -0,0 +1,126 @@
+/*
+ * h-aot.c - H-VM Ahead-of-Time Module Runtime
+ *
+ * Loads shared objects built by h-vm-aot and runs them against a VM,
+ * handing control to the interpreter for anything they do not cover.
+ */
+
+#include "h-aot.h"
+#include <dlfcn.h>
+
+/*
+ * aotload - Load a compiled module
+ * @path: Shared object built by h-vm-aot
+ * Returns: Module handle, or NULL with a message on stderr
+ */
+Aot *aotload(const char *path) {
+    const int32 *size, *ndata;
+    const int16 *ip, *sp;
+    const int8 *enc;
+    int32 k;
+    Aot *a;
+
+    a = (Aot *)malloc(sizeof(Aot));
+    if (!a)
+        return (Aot *)0;
+    a->dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!a->dl) {
+        fprintf(stderr, "%s\n", dlerror());
+        free(a);
+        return (Aot *)0;
+    }
+
+    a->entry = (AotEntry)dlsym(a->dl, "aotentry");
+    a->image = (const int8 *)dlsym(a->dl, "aotimage");
+    size = (const int32 *)dlsym(a->dl, "aotsize");
+    if (!a->entry || !a->image || !size || !*size || *size > sizeof(Memory)) {
+        fprintf(stderr, "%s: not an h-vm-aot module\n", path);
+        aotfree(a);
+        return (Aot *)0;
+    }
+    a->size = *size;
+    enc = (const int8 *)dlsym(a->dl, "aotenc");
+    a->enc = enc ? *enc : EncVar;
+    ip = (const int16 *)dlsym(a->dl, "aotip");
+    sp = (const int16 *)dlsym(a->dl, "aotsp");
+    a->ip = ip ? *ip : 0;
+    a->sp = sp ? *sp : 0xffff;
+
+    /* Data, if any, sits above the code like a file's sections */
+    a->data = (const AotData *)dlsym(a->dl, "aotdata");
+    ndata = (const int32 *)dlsym(a->dl, "aotndata");
+    a->ndata = (a->data && ndata) ? *ndata : 0;
+    for (k = 0; k < a->ndata; k++)
+        if (a->data[k].addr < a->size
+                || $4 a->data[k].addr + a->data[k].len > sizeof(Memory)) {
+            fprintf(stderr, "%s: data outside memory\n", path);
+            aotfree(a);
+            return (Aot *)0;
+        }
+
+    return a;
+}
+
+/*
+ * aotfree - Unload a compiled module
+ */
+void aotfree(Aot *a) {
+    if (!a)
+        return;
+
+    dlclose(a->dl);
+    free(a);
+
+    return;
+}
+
+/*
+ * aotexec - Load a module's program into @vm and run it
+ * @vm: VM instance
+ * @a: Loaded module
+ *
+ * Same observable behaviour as execute() on the program the module was
+ * built from: code, data, entry point and stack pointer are set up as
+ * loadfile() would set them. Instructions the module does not cover
+ * run through execinstr() and compiled code resumes after them. Once
+ * code memory has been written the module no longer matches it and the
+ * interpreter takes over.
+ */
+void aotexec(VM *vm, Aot *a) {
+    int32 k;
+    int8 op, size;
+    int st;
+
+    copy(vm->m, $1 a->image, $i a->size);
+    for (k = 0; k < a->ndata; k++)
+        copy(vm->m + a->data[k].addr, $1 a->data[k].p, a->data[k].len);
+    vm->b = $2 a->size;
+    vm->enc = a->enc;
+    vm $ip = a->ip;
+    vm $sp = a->sp;
+
+    for (;;) {
+        st = a->entry(vm);
+        switch (st) {
+            case AotExit:
+                if (vm $ip > vm->b)
+                    segfault(vm);
+                op = vm->m[vm $ip];
+                size = execinstr(vm, vm->m + vm $ip);
+                vm $ip += size;
+                if ((op == push || op == call) && vm $sp <= vm->b) {
+                    execute(vm);
+                    return;
+                }
+                break;
+
+            case AotStored:
+                execute(vm);
+                return;
+
+            default:
+                error(vm, (Errorcode)st);
+                break;
+        }
+    }
+}
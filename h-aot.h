@@ -0,0 +1,64 @@
+/*
+ * h-aot.h - H-VM Ahead-of-Time Compiled Module Interface
+ *
+ * Shared by the h-vm-aot compiler, the C it generates and the runtime
+ * that loads the resulting shared object.
+ */
+
+#ifndef H_AOT_H
+#define H_AOT_H
+
+#include "h-vm.h"
+
+/*
+ * Symbols exported by a compiled module:
+ *   const int8 aotimage[]   - Bytecode the module was compiled from
+ *   const int32 aotsize     - Size of aotimage in bytes
+ *   const int8 aotenc       - Encoding of aotimage; EncVar if absent
+ *   const int16 aotip       - Entry point; 0 if absent
+ *   const int16 aotsp       - Initial stack pointer; 0xffff if absent
+ *   const AotData aotdata[] - Data placed above the code before running
+ *   const int32 aotndata    - Entries in aotdata; none if absent
+ *   int aotentry(VM*)       - Run from vm $ip until the module stops
+ *
+ * aotentry() returns an Errorcode (SysHlt included) with vm $ip at the
+ * instruction that raised it, or one of the codes below with vm $ip at
+ * the next instruction the interpreter has to run.
+ */
+#define AotExit     0x100   /* Instruction not compiled, interpret it */
+#define AotStored   0x101   /* Code memory was written, module is stale */
+
+typedef int (*AotEntry)(VM*);
+
+/* Bytes at a guest address, as a program file's data sections load them */
+struct s_aotdata {
+    int16 addr;
+    int16 len;
+    const int8 *p;
+};
+typedef struct s_aotdata AotData;
+
+/* Loaded module */
+struct s_aot {
+    void *dl;               /* dlopen() handle */
+    AotEntry entry;
+    const int8 *image;
+    int32 size;
+    int8 enc;
+    int16 ip, sp;
+    const AotData *data;
+    int32 ndata;
+};
+typedef struct s_aot Aot;
+
+Aot *aotload(const char*);
+void aotexec(VM*, Aot*);
+void aotfree(Aot*);
+
+/* Used by generated code: stop at @a with return code @e */
+#define aotstop(a, e) do { \
+        vm $ip = (a); \
+        return (e); \
+    } while (0)
+
+#endif /* H_AOT_H */
@@ -0,0 +1,640 @@
+/*
+ * h-asm.c - H-VM Assembler
+ *
+ * Assembles text in the syntax of the readme into a Builder:
+ *
+ *   start:  mov ax, 0x04    ; comment
+ *           add ax, 3       // comment
+ *           mov bx, start
+ *           mov [bx+2], ax
+ *           hlt
+ *
+ * One instruction per line, with an optional label in front. Operands
+ * are registers, numbers (decimal, or hex with 0x), label names and
+ * memory operands: [addr], [reg] and [reg+off] or [reg-off], where addr
+ * and off are numbers or, but for -off, label names. Jumps, call and
+ * loop take the address to go to, usually a label name. The
+ * source is read in large chunks and each line is encoded as soon as it
+ * has been scanned, so nothing is kept per line; labels used before they
+ * are defined are left to the builder's fixups. Memory use is the
+ * program plus one entry per label name.
+ *
+ * disasm() goes the other way, one instruction at a time.
+ */
+
+#include "h-vm.h"
+#include <pthread.h>
+
+#define CHUNK       (64 * 1024)     /* Bytes read at a time */
+#define LINEMAX     4096            /* Longest line accepted */
+
+/* Label name - hash table entry */
+struct s_sym {
+    int32 h;        /* Hash of the name, 0 for an empty slot */
+    int32 name;     /* Offset of the name in Src.names */
+    int32 len;
+    int l;          /* Builder label */
+    int32 line;     /* First line that used it */
+};
+typedef struct s_sym Sym;
+
+/* Assembler state */
+struct s_src {
+    Builder *b;
+    AErr *e;
+    int32 line;
+    Sym *sym;           /* Open-addressed, power-of-two size */
+    int32 nsym, capsym;
+    char *names;
+    int32 nnames, capnames;
+};
+typedef struct s_src Src;
+
+/* Operand kinds */
+enum e_operand { OpdReg, OpdImm, OpdLabel, OpdMem };
+
+struct s_opd {
+    enum e_operand k;
+    int32 v;        /* Register selector, value or label; offset of OpdMem */
+    int8 base;      /* OpdMem: base register, or BaseNone */
+    int l;          /* OpdMem: label of the offset, or -1 */
+};
+typedef struct s_opd Opd;
+
+#define SP  4       /* Register selector for sp; mov only */
+
+/*
+ * Mnemonics packed into an integer, one byte per character, so a
+ * lookup compares words instead of strings
+ */
+struct s_mnem {
+    int64 k;
+    int8 op;        /* Lowest opcode with this mnemonic */
+};
+
+static struct s_mnem mnems[64];
+static int nmnems;
+static pthread_once_t mnemsonce = PTHREAD_ONCE_INIT;
+
+/* pack - Key of the @n characters at @p, or 0 if too long */
+static int64 pack(const char *p, int32 n) {
+    int64 k;
+
+    if (n > 8)
+        return 0;
+    for (k = 0; n--; )
+        k = (k << 8) | (int8)(p[n] | 0x20);
+
+    return k;
+}
+
+/* mkmnems - Index the mnemonics of optable[], once */
+static void mkmnems(void) {
+    int64 k;
+    int op, j;
+
+    for (op = 0; op < 256; op++) {
+        if (!optable[op].n)
+            continue;
+        k = pack(optable[op].n, $i strlen(optable[op].n));
+        for (j = 0; j < nmnems && mnems[j].k != k; j++)
+            ;
+        if (j == nmnems && nmnems < $i (sizeof(mnems) / sizeof(*mnems))) {
+            mnems[nmnems].k = k;
+            mnems[nmnems++].op = (int8)op;
+        }
+    }
+
+    return;
+}
+
+/* fail - Record the first error; always returns false */
+static bool fail(Src *s, const char *why, const char *p, int32 n) {
+    if (s->e) {
+        s->e->line = s->line;
+        if (p)
+            snprintf(s->e->why, sizeof(s->e->why), "%s '%.*s'", why, $i n, p);
+        else
+            snprintf(s->e->why, sizeof(s->e->why), "%s", why);
+    }
+
+    return false;
+}
+
+/* ============================================================================
+ * Labels
+ * ========================================================================= */
+
+/* hash - FNV-1a of a name, never 0 */
+static int32 hash(const char *p, int32 n) {
+    int32 h;
+
+    for (h = 2166136261u; n--; p++)
+        h = (h ^ (int8)*p) * 16777619u;
+
+    return h ? h : 1;
+}
+
+/* grow - Double the symbol table */
+static bool grow(Src *s) {
+    int32 cap, k, j;
+    Sym *sym;
+
+    cap = s->capsym ? s->capsym * 2 : 1024;
+    if (!(sym = (Sym *)calloc(cap, sizeof(Sym))))
+        return false;
+    for (k = 0; k < s->capsym; k++) {
+        if (!s->sym[k].h)
+            continue;
+        for (j = s->sym[k].h & (cap - 1); sym[j].h; j = (j + 1) & (cap - 1))
+            ;
+        sym[j] = s->sym[k];
+    }
+    free(s->sym);
+    s->sym = sym;
+    s->capsym = cap;
+
+    return true;
+}
+
+/*
+ * lookup - The label named by the @n characters at @p, created unplaced
+ * on first use
+ * Returns: Entry, or NULL if out of memory
+ */
+static Sym *lookup(Src *s, const char *p, int32 n) {
+    int32 h, k, cap;
+    Sym *y;
+    char *names;
+
+    if (2 * (s->nsym + 1) > s->capsym && !grow(s))
+        return (Sym *)0;
+    h = hash(p, n);
+    for (k = h & (s->capsym - 1); (y = &s->sym[k])->h; k = (k + 1) & (s->capsym - 1))
+        if (y->h == h && y->len == n && !memcmp(s->names + y->name, p, n))
+            return y;
+
+    if (s->nnames + n > s->capnames) {
+        for (cap = s->capnames ? s->capnames : 16384; cap < s->nnames + n; cap *= 2)
+            ;
+        if (!(names = (char *)realloc(s->names, cap)))
+            return (Sym *)0;
+        s->names = names;
+        s->capnames = cap;
+    }
+    if ((y->l = label(s->b)) < 0)
+        return (Sym *)0;
+    memcpy(s->names + s->nnames, p, n);
+    y->h = h;
+    y->name = s->nnames;
+    y->len = n;
+    y->line = s->line;
+    s->nnames += n;
+    s->nsym++;
+
+    return y;
+}
+
+/* ============================================================================
+ * Lines
+ * ========================================================================= */
+
+#define isident(c)  ((((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'z') \
+                        || ((c) >= '0' && (c) <= '9') || (c) == '_' || (c) == '.')
+
+/* blank - Skip spaces and tabs */
+static const char *blank(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+
+    return p;
+}
+
+/* eol - Whether only a comment or nothing is left */
+static bool eol(const char *p, const char *end) {
+    return p == end || *p == ';' || *p == '#'
+        || (*p == '/' && p + 1 < end && p[1] == '/');
+}
+
+/* regnum - Register selector named by @p[0..n), or -1 */
+static int regnum(const char *p, int32 n) {
+    if (n != 2 || (p[1] | 0x20) != (((p[0] | 0x20) == 's') ? 'p' : 'x'))
+        return -1;
+    switch (p[0] | 0x20) {
+        case 'a': return 0;
+        case 'b': return 1;
+        case 'c': return 2;
+        case 'd': return 3;
+        case 's': return SP;
+        default: return -1;
+    }
+}
+
+static bool memory(Src*, const char**, const char*, Opd*);
+
+/*
+ * operand - Scan one operand at *@pp
+ * Returns: false on a malformed operand or out of memory
+ */
+static bool operand(Src *s, const char **pp, const char *end, Opd *o) {
+    const char *p, *q, *ds;
+    bool neg;
+    int64 v;
+    int d, r;
+    Sym *y;
+
+    p = blank(*pp, end);
+    if (p < end && *p == '[')
+        return memory(s, pp, end, o);
+    for (q = p; q < end && isident(*q); q++)
+        ;
+    if (p < end && (*p == '-' || (*p >= '0' && *p <= '9'))) {
+        neg = (*p == '-');
+        q = p + neg;
+        v = 0;
+        if (q + 1 < end && q[0] == '0' && (q[1] | 0x20) == 'x') {
+            for (ds = q += 2; q < end && isident(*q); q++) {
+                d = (*q >= '0' && *q <= '9') ? *q - '0' : (*q | 0x20) - 'a' + 10;
+                if (d < 0 || d > 15 || (v = v * 16 + d) > 0xffff)
+                    break;
+            }
+        } else
+            for (ds = q; q < end && *q >= '0' && *q <= '9'; q++)
+                if ((v = v * 10 + *q - '0') > 0xffff)
+                    break;
+        if (q == ds || (q < end && isident(*q)) || (neg && v > 0x8000)) {
+            for (q = p + neg; q < end && isident(*q); q++)
+                ;
+            return fail(s, "bad number", p, $4 (q - p));
+        }
+        o->k = OpdImm;
+        o->v = neg ? $4 (-(int)v) & 0xffff : $4 v;
+    } else if (q > p) {
+        if ((r = regnum(p, $4 (q - p))) >= 0) {
+            o->k = OpdReg;
+            o->v = $4 r;
+        } else {
+            if (!(y = lookup(s, p, $4 (q - p))))
+                return fail(s, "out of memory", (const char *)0, 0);
+            o->k = OpdLabel;
+            o->v = y->l;
+        }
+    } else
+        return fail(s, "expected operand", (const char *)0, 0);
+    *pp = blank(q, end);
+
+    return true;
+}
+
+/*
+ * memory - Scan the memory operand at *@pp, which starts with '['
+ * Returns: false on a malformed operand or out of memory
+ */
+static bool memory(Src *s, const char **pp, const char *end, Opd *o) {
+    const char *p;
+    Opd t;
+
+    p = blank(*pp, end) + 1;
+    o->k = OpdMem;
+    o->v = 0;
+    o->base = BaseNone;
+    o->l = -1;
+    if (!operand(s, &p, end, &t))
+        return false;
+    if (t.k == OpdReg) {
+        if (t.v == SP)
+            return fail(s, "expected ax, bx, cx or dx", (const char *)0, 0);
+        o->base = (int8)t.v;
+        if (p < end && (*p == '+' || *p == '-')) {
+            if (*p == '+')
+                p++;
+            if (!operand(s, &p, end, &t))
+                return false;
+        } else {
+            t.k = OpdImm;
+            t.v = 0;
+        }
+    }
+    if (t.k == OpdLabel)
+        o->l = $i t.v;
+    else if (t.k == OpdImm)
+        o->v = t.v;
+    else
+        return fail(s, "bad memory operand", (const char *)0, 0);
+    if (p == end || *p != ']')
+        return fail(s, "expected ']'", (const char *)0, 0);
+    *pp = blank(p + 1, end);
+
+    return true;
+}
+
+/*
+ * encode - Emit instruction @op with operands @o[0..n)
+ *
+ * The operands a mnemonic takes follow from its operand layout; mov
+ * also picks its opcode from its register, or is a load or store when
+ * one operand is memory.
+ */
+static bool encode(Src *s, int8 op, Opd *o, int n) {
+    Layout l;
+    Opd t;
+    int at;
+
+    if (op == mov && n == 2 && o[1].k == OpdMem)
+        op = ld;
+    else if (op == mov && n == 2 && o[0].k == OpdMem) {
+        op = st;
+        t = o[0];
+        o[0] = o[1];
+        o[1] = t;
+    }
+
+    l = optable[op].l;
+    switch (l) {
+        case LayNone:
+            if (n != 0)
+                return fail(s, "takes no operands", optable[op].n, 8);
+            at = emit(s->b, (Opcode)op, 0, 0);
+            break;
+
+        case LayByte:
+            if (n != 1 || o[0].k != OpdReg || o[0].v == SP)
+                return fail(s, "expected ax, bx, cx or dx", (const char *)0, 0);
+            at = emit(s->b, (Opcode)op, $2 o[0].v, 0);
+            break;
+
+        case LayWord:
+            if (optable[op].f & OpTarget) {
+                if (n != 1 || (o[0].k != OpdImm && o[0].k != OpdLabel))
+                    return fail(s, "expected address", (const char *)0, 0);
+                at = emit(s->b, (Opcode)op, $2 o[0].v, 0);
+                if (o[0].k == OpdLabel && at >= 0)
+                    ref(s->b, immof(s->b, at), $i o[0].v);
+                break;
+            }
+            if (optable[op].r != RegOp) {
+                if (n != 1 || o[0].k != OpdReg || o[0].v == SP)
+                    return fail(s, "expected ax, bx, cx or dx", (const char *)0, 0);
+                at = emit(s->b, (Opcode)op, $2 o[0].v, 0);
+                break;
+            }
+            if (n != 2 || o[0].k != OpdReg || o[1].k == OpdReg)
+                return fail(s, "expected register, value", (const char *)0, 0);
+            at = emit(s->b, (o[0].v == SP) ? movsp : (Opcode)(op + o[0].v),
+                $2 o[1].v, 0);
+            if (o[1].k == OpdLabel && at >= 0)
+                ref(s->b, immof(s->b, at), $i o[1].v);
+            break;
+
+        case LayRegImm:
+            if (n != 2 || o[0].k != OpdReg || o[0].v == SP || o[1].k != OpdImm)
+                return fail(s, "expected register, value", (const char *)0, 0);
+            if (o[1].v > 0xff && s->b->enc != EncWord)
+                return fail(s, "value does not fit in a byte", (const char *)0, 0);
+            at = emit(s->b, (Opcode)op, $2 o[0].v, $2 o[1].v);
+            break;
+
+        case LayWordWord:
+            if (s->b->enc == EncWord)
+                return fail(s, "no word encoding", optable[op].n, 8);
+            if (n != 2 || o[0].k == OpdReg || o[1].k == OpdReg
+                    || o[0].k == OpdMem || o[1].k == OpdMem)
+                return fail(s, "expected value, value", (const char *)0, 0);
+            at = emit(s->b, (Opcode)op, $2 o[0].v, $2 o[1].v);
+            if (o[0].k == OpdLabel && at >= 0)
+                ref(s->b, at + 1, $i o[0].v);
+            if (o[1].k == OpdLabel && at >= 0)
+                ref(s->b, at + 3, $i o[1].v);
+            break;
+
+        case LayMem:
+            if (n != 2 || o[0].k != OpdReg || o[0].v == SP || o[1].k != OpdMem)
+                return fail(s, "expected register, [address]", (const char *)0, 0);
+            at = emit(s->b, (Opcode)op, memregs(o[0].v, o[1].base), $2 o[1].v);
+            if (o[1].l >= 0 && at >= 0)
+                ref(s->b, immof(s->b, at), o[1].l);
+            break;
+
+        default:
+            return fail(s, "unknown instruction", (const char *)0, 0);
+    }
+    if (at < 0 || s->b->fail)
+        return fail(s, "program too large", (const char *)0, 0);
+
+    return true;
+}
+
+/* line - Assemble the line @p[0..end) */
+static bool line(Src *s, const char *p, const char *end) {
+    const char *q;
+    Opd o[2];
+    int64 k;
+    int n, j;
+    Sym *y;
+
+    p = blank(p, end);
+    if (eol(p, end))
+        return true;
+    for (q = p; q < end && isident(*q); q++)
+        ;
+    if (q == p)
+        return fail(s, "unexpected", p, 1);
+
+    /* label: */
+    if (q < end && *q == ':') {
+        if (regnum(p, $4 (q - p)) >= 0 || (*p >= '0' && *p <= '9'))
+            return fail(s, "bad label", p, $4 (q - p));
+        if (!(y = lookup(s, p, $4 (q - p))))
+            return fail(s, "out of memory", (const char *)0, 0);
+        if (s->b->lab[y->l] >= 0)
+            return fail(s, "label defined twice", p, $4 (q - p));
+        place(s->b, y->l);
+        p = blank(q + 1, end);
+        if (eol(p, end))
+            return true;
+        for (q = p; q < end && isident(*q); q++)
+            ;
+    }
+
+    k = pack(p, $4 (q - p));
+    for (j = 0; j < nmnems && mnems[j].k != k; j++)
+        ;
+    if (!k || j == nmnems)
+        return fail(s, "unknown instruction", p, $4 (q - p));
+
+    p = blank(q, end);
+    for (n = 0; !eol(p, end); n++) {
+        if (n == 2)
+            return fail(s, "too many operands", (const char *)0, 0);
+        if (n && *p++ != ',')
+            return fail(s, "expected ','", (const char *)0, 0);
+        if (!operand(s, &p, end, &o[n]))
+            return false;
+    }
+
+    return encode(s, mnems[j].op, o, n);
+}
+
+/*
+ * assemble - Assemble the source read from @in into @b
+ * @b: Builder to emit into
+ * @in: Source, read to the end
+ * @e: Filled in with the line and reason on failure; may be NULL
+ * Returns: false on a syntax error, an undefined label, or if the
+ *          program does not fit; the builder is then failed
+ *
+ * Labels are placed and referenced through @b and resolved by built(),
+ * which has been called on success.
+ */
+bool assemble(Builder *b, FILE *in, AErr *e) {
+    const char *p, *nl, *end;
+    size_t keep, n;
+    bool ok;
+    char *buf;
+    Src s;
+    int32 k;
+
+    pthread_once(&mnemsonce, mkmnems);
+    zero($1 &s, sizeof(Src));
+    s.b = b;
+    s.e = e;
+    if (!(buf = (char *)malloc(CHUNK + LINEMAX))) {
+        b->fail = true;
+        return fail(&s, "out of memory", (const char *)0, 0);
+    }
+
+    ok = true;
+    keep = 0;
+    do {
+        n = fread(buf + keep, 1, CHUNK, in);
+        end = buf + keep + n;
+        for (p = buf; ok && (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+            s.line++;
+            ok = line(&s, p, nl);
+        }
+        if (ok && !n && p < end) {
+            s.line++;
+            ok = line(&s, p, end);
+            p = end;
+        }
+        if (ok && (keep = end - p) > LINEMAX) {
+            s.line++;
+            ok = fail(&s, "line too long", (const char *)0, 0);
+        }
+        memmove(buf, p, keep);
+    } while (ok && n);
+    if (ok && ferror(in))
+        ok = fail(&s, "read error", (const char *)0, 0);
+
+    /* Labels used but never placed */
+    for (k = 0; ok && k < s.capsym; k++)
+        if (s.sym[k].h && b->lab[s.sym[k].l] < 0) {
+            s.line = s.sym[k].line;
+            ok = fail(&s, "undefined label", s.names + s.sym[k].name, s.sym[k].len);
+        }
+    if (ok && !built(b))
+        ok = fail(&s, "program too large", (const char *)0, 0);
+
+    if (!ok)
+        b->fail = true;
+    free(buf);
+    free(s.sym);
+    free(s.names);
+
+    return ok;
+}
+
+/* ============================================================================
+ * Disassembler
+ * ========================================================================= */
+
+static const char *regname[] = { "ax", "bx", "cx", "dx" };
+
+/*
+ * disasm - Write the instruction at @ip as a line of assembly
+ * @vm: VM holding the code in m[0..b)
+ * @ip: Address of the instruction
+ * @buf: Output, NUL-terminated
+ * @n: Size of @buf
+ * Returns: Size of the instruction, or 1 (a word in EncWord) if it is
+ *          undefined or runs past vm->b
+ *
+ * Driven by the descriptor table, so it covers every row of h-isa.h and
+ * its output assembles back to the same bytes. What the assembler has
+ * no syntax for is written as a comment.
+ */
+int disasm(VM *vm, int16 ip, char *buf, int n) {
+    char m[16];
+    Program *p;
+    int8 s;
+    OD *d;
+    Uop u;
+
+    p = vm->m + ip;
+    d = &optable[*p];
+    s = isize(vm, *p);
+    if (!s || $4 ip + s > vm->b) {
+        snprintf(buf, n, "; %s 0x%02x", s ? "truncated" : "undefined", *p);
+        return (vm->enc == EncWord) ? WORDSIZE : 1;
+    }
+    if (vm->enc == EncWord) {
+        decodeword(p, &u);
+        if (d->l == LayWordWord) {
+            snprintf(buf, n, "; %s has no word encoding", d->n);
+            return s;
+        }
+    } else
+        decodeop(p, &u);
+    if (d->r == RegArg && u.r > 3) {
+        snprintf(buf, n, "; %s with bad register selector", d->n);
+        return s;
+    }
+
+    switch (d->l) {
+        case LayByte:
+            snprintf(buf, n, "%s %s", d->n, regname[u.r]);
+            break;
+
+        case LayWord:
+            if (d->f & OpTarget)
+                snprintf(buf, n, "%s 0x%04x", d->n, u.imm);
+            else if (d->r == RegArg)
+                snprintf(buf, n, "%s %s", d->n, regname[u.r]);
+            else if (d->r < RegArg)
+                snprintf(buf, n, "%s %s, 0x%04x", d->n, regname[u.r], u.imm);
+            else
+                snprintf(buf, n, "%s sp, 0x%04x", d->n, u.imm);
+            break;
+
+        case LayRegImm:
+            snprintf(buf, n, "%s %s, 0x%02x", d->n, regname[u.r], u.imm);
+            break;
+
+        case LayWordWord:
+            snprintf(buf, n, "%s 0x%04x, 0x%04x", d->n, u.imm,
+                $i ((*(p+4) << 8) | *(p+3)));
+            break;
+
+        case LayMem:
+            if (u.base > 3)
+                snprintf(m, sizeof(m), "[0x%04x]", u.imm);
+            else if (u.imm >= 0x8000)
+                snprintf(m, sizeof(m), "[%s-0x%04x]", regname[u.base],
+                    $i (0x10000 - u.imm));
+            else if (u.imm)
+                snprintf(m, sizeof(m), "[%s+0x%04x]", regname[u.base], u.imm);
+            else
+                snprintf(m, sizeof(m), "[%s]", regname[u.base]);
+            if (*p == st)
+                snprintf(buf, n, "%s %s, %s", d->n, m, regname[u.r]);
+            else
+                snprintf(buf, n, "%s %s, %s", d->n, regname[u.r], m);
+            break;
+
+        default:
+            snprintf(buf, n, "%s", d->n);
+            break;
+    }
+
+    return s;
+}
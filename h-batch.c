@@ -0,0 +1,628 @@
+/*
+ * h-batch.c - H-VM Lockstep Batch Engine
+ *
+ * Runs one program for many register sets at once. Sixteen VMs form a
+ * group whose registers are kept one vector per register (all AX values
+ * together, and so on), and each instruction is applied to the whole
+ * group with 16-bit vector arithmetic, Z/C included: AVX2 on CPUs that
+ * have it, SSE2 otherwise. Lanes share the code and keep private copies
+ * of whatever memory they write.
+ *
+ * Lanes that branch apart wait where they are going while the group
+ * runs on at the lower address, and rejoin it when it gets there; when
+ * no lane is left running the group moves on to the lowest waiting one.
+ * A lane that faults or halts drops out of the group with its state as
+ * execute() would leave it. A lane whose push, call or store writes into
+ * code can no longer share the instruction stream and finishes alone on
+ * execute().
+ */
+
+#include "h-vm.h"
+
+#define LANES       16
+
+typedef int16 Vec __attribute__((vector_size(LANES * sizeof(int16))));
+typedef short Mask __attribute__((vector_size(LANES * sizeof(int16))));
+typedef int32 Wide __attribute__((vector_size(LANES * sizeof(int32))));
+typedef int64 Quad __attribute__((vector_size(LANES * sizeof(int16))));
+
+/* Sixteen VMs in lockstep */
+struct s_group {
+    Vec r[4];           /* AX, BX, CX, DX */
+    Vec sp;
+    Vec flags;          /* Z/C always evaluated */
+    Vec start;          /* Address each waiting lane goes on at */
+    Mask live;          /* Lanes running */
+    Mask wait;          /* Lanes waiting for the group at their start */
+    int16 ip[LANES];    /* Where each stopped lane stopped */
+    Errorcode st[LANES];
+};
+typedef struct s_group Group;
+
+struct s_batch {
+    VM *vm;             /* Program and initial memory */
+    VM *solo;           /* Runs lanes that leave the group, or NULL */
+    int8 (*mem)[0x10000];   /* Memory per lane */
+    int32 lo[LANES];    /* mem[k][lo, hi) is in use, the rest is vm->m */
+    int32 hi[LANES];
+};
+typedef struct s_batch Batch;
+
+/* ============================================================================
+ * Lane Helpers
+ * ========================================================================= */
+
+/* sel - Lanes of @a where @m is set, of @b elsewhere */
+#define sel(m, a, b)    ((Vec)(((Mask)(a) & (m)) | ((Mask)(b) & ~(m))))
+
+/* any - Whether any lane of @m is set */
+static inline bool any(const Mask *m) {
+    const Quad *q = (const Quad *)m;
+
+    return ((*q)[0] | (*q)[1] | (*q)[2] | (*q)[3]) != 0;
+}
+
+/* park - Have the running lanes in @m wait at @to */
+static inline void park(Group *g, const Mask *m, const Vec *to) {
+    g->start = sel(*m, *to, g->start);
+    g->wait |= *m;
+    g->live &= ~*m;
+}
+
+/* lowest - Lowest start address of the waiting lanes of @g */
+static int32 lowest(Group *g) {
+    int32 ip, k;
+
+    for (ip = 0xffff, k = 0; k < LANES; k++)
+        if (g->wait[k] && g->start[k] < ip)
+            ip = g->start[k];
+
+    return ip;
+}
+
+/* stop - Take lane @k out of the group with status @e at @ip */
+static void stop(Group *g, int k, Errorcode e, int16 ip) {
+    g->live[k] = 0;
+    g->st[k] = e;
+    g->ip[k] = ip;
+}
+
+/* stopall - stop() every lane in @m */
+static void stopall(Group *g, const Mask *m, Errorcode e, int16 ip) {
+    int k;
+
+    for (k = 0; k < LANES; k++)
+        if ((*m)[k])
+            stop(g, k, e, ip);
+}
+
+/* peek - Byte @a of lane @k's memory */
+static inline int8 peek(Batch *bt, int k, int32 a) {
+    return (a >= bt->lo[k] && a < bt->hi[k]) ? bt->mem[k][a] : bt->vm->m[a];
+}
+
+/* load - 16-bit word at @a of lane @k's memory, as oppop() reads it */
+static int16 load(Batch *bt, int k, int16 a) {
+    int8 b[2];
+    int16 v;
+
+    b[0] = peek(bt, k, a);
+    b[1] = peek(bt, k, a + 1);
+    copy($1 &v, b, 2);
+
+    return v;
+}
+
+/* store - 16-bit word at @a of lane @k's memory, as oppush() writes it */
+static void store(Batch *bt, int k, int16 a, int16 v) {
+    int8 *m, *base;
+    int32 lo, hi;
+
+    m = bt->mem[k];
+    base = bt->vm->m;
+    lo = bt->lo[k];
+    hi = bt->hi[k];
+    if (lo == hi)
+        lo = hi = a;
+    if (a < lo) {
+        copy(m + a, base + a, lo - a);
+        lo = a;
+    }
+    if ($4 a + 2 > hi) {
+        copy(m + hi, base + hi, $4 a + 2 - hi);
+        hi = $4 a + 2;
+    }
+    bt->lo[k] = lo;
+    bt->hi[k] = hi;
+    copy(m + a, $1 &v, 2);
+}
+
+/*
+ * solo - Finish lane @k on its own VM from @ip
+ *
+ * For lanes whose code no longer matches the group's; the result is
+ * whatever execute() makes of the lane's state.
+ */
+static void solo(Batch *bt, Group *g, int k, int16 ip) {
+    Errorcode e;
+    VM *s;
+    int n;
+
+    if (!bt->solo && !(bt->solo = virtualmachine())) {
+        stop(g, k, ErrMem, ip);
+        return;
+    }
+    s = bt->solo;
+    copy(s->m, bt->vm->m, sizeof(Memory));
+    if (bt->lo[k] < bt->hi[k])
+        copy(s->m + bt->lo[k], bt->mem[k] + bt->lo[k], bt->hi[k] - bt->lo[k]);
+    s->b = bt->vm->b;
+    s->enc = bt->vm->enc;
+    zero($1 &s->c, sizeof(CPU));
+    for (n = 0; n < 4; n++)
+        (&s $ax)[n] = g->r[n][k];
+    s $sp = g->sp[k];
+    s $ip = ip;
+    s $flags = g->flags[k];
+    s->fuel = FUELMAX;
+
+    e = tryexecute(s, &engines[0]);
+    for (n = 0; n < 4; n++)
+        g->r[n][k] = (&s $ax)[n];
+    g->sp[k] = s $sp;
+    g->flags[k] = evalflags(s);
+    stop(g, k, e, s $ip);
+    g->wait[k] = 0;
+}
+
+/* ============================================================================
+ * Group Execution
+ * ========================================================================= */
+
+static inline void setf(Group *g, int8 bit) {
+    g->flags = sel(g->live, g->flags | bit, g->flags);
+}
+
+static inline void clrf(Group *g, int8 mask) {
+    g->flags = sel(g->live, g->flags & mask, g->flags);
+}
+
+/*
+ * written - Lane @k stored into code from the instruction at @ip, and
+ * no longer runs the group's code
+ * @next: Where the lane goes on
+ */
+static void written(Batch *bt, Group *g, int k, int32 ip, int32 next) {
+    /* execute() ends quietly if the store overwrote itself with hlt,
+     * with vm $ip wherever the instruction left it */
+    if (peek(bt, k, ip) == hlt)
+        stop(g, k, NoErr, (optable[bt->vm->m[ip]].f & OpJump) ? next : ip);
+    else
+        solo(bt, g, k, next);
+}
+
+/*
+ * branch - Send the running lanes in @taken to @to and the others to @next
+ * Returns: Where the group goes on
+ *
+ * The group follows the lower address and the lanes going to the other
+ * wait there: a loop keeps the lanes still in it together, and the ones
+ * that left it early are picked up on the way out.
+ */
+static int32 branch(Group *g, const Mask *taken, int32 to, int32 next) {
+    Mask t, m;
+    Vec at;
+
+    t = g->live & *taken;
+    m = g->live & ~t;
+    if (!any(&t))
+        return next;
+    if (!any(&m))
+        return to;
+    if (to < next) {
+        at = (Vec){} + (int16)next;
+        park(g, &m, &at);
+        return to;
+    }
+    at = (Vec){} + (int16)to;
+    park(g, &t, &at);
+
+    return next;
+}
+
+/*
+ * push1 - push, lane by lane: stack checks differ, and a write into
+ * code ends sharing
+ * @r: Register, above 3 for a bad selector
+ * @next: Address of the following instruction
+ */
+static void push1(Batch *bt, Group *g, int32 ip, int8 r, int32 next) {
+    int16 sp;
+    int k;
+
+    for (k = 0; k < LANES; k++) {
+        if (!g->live[k])
+            continue;
+        sp = g->sp[k];
+        if (g->flags[k] & 0x03 || sp < 2)
+            stop(g, k, ErrInstr, ip);
+        else if ($i sp < ($i bt->vm->b - 2))
+            stop(g, k, ErrSegv, ip);
+        else if (r >= 4)
+            stop(g, k, ErrInstr, ip);
+        else {
+            sp -= 2;
+            store(bt, k, sp, g->r[r][k]);
+            g->sp[k] = sp;
+            if (sp <= bt->vm->b)
+                written(bt, g, k, ip, next);
+        }
+    }
+}
+
+/*
+ * call1 - call, lane by lane: push1() of the return address @next
+ * without the H/L check
+ * @to: Target
+ */
+static void call1(Batch *bt, Group *g, int32 ip, int32 to, int32 next) {
+    int16 sp;
+    int k;
+
+    for (k = 0; k < LANES; k++) {
+        if (!g->live[k])
+            continue;
+        sp = g->sp[k];
+        if (sp < 2)
+            stop(g, k, ErrInstr, ip);
+        else if ($i sp < ($i bt->vm->b - 2))
+            stop(g, k, ErrSegv, ip);
+        else {
+            sp -= 2;
+            store(bt, k, sp, next);
+            g->sp[k] = sp;
+            if (sp <= bt->vm->b)
+                written(bt, g, k, ip, to);
+        }
+    }
+}
+
+/*
+ * ret1 - ret, lane by lane: each lane may return somewhere else
+ * Returns: Where the group goes on; the lowest return address, the
+ * other lanes wait at theirs
+ */
+static int32 ret1(Batch *bt, Group *g, int32 ip) {
+    int32 lo;
+    int16 sp;
+    Mask m;
+    Vec to;
+    int k;
+
+    to = (Vec){};
+    lo = 0x10000;
+    for (k = 0; k < LANES; k++) {
+        if (!g->live[k])
+            continue;
+        sp = g->sp[k];
+        if (sp > 0xfffd) {
+            stop(g, k, ErrInstr, ip);
+            continue;
+        }
+        to[k] = load(bt, k, sp);
+        g->sp[k] = sp + 2;
+        if (to[k] < lo)
+            lo = to[k];
+    }
+    if (lo > 0xffff)
+        return ip;
+    m = g->live & (to != (int16)lo);
+    park(g, &m, &to);
+
+    return lo;
+}
+
+/* pop1 - pop, lane by lane */
+static void pop1(Batch *bt, Group *g, int32 ip, int8 r) {
+    int16 sp;
+    int k;
+
+    for (k = 0; k < LANES; k++) {
+        if (!g->live[k])
+            continue;
+        sp = g->sp[k];
+        if (g->flags[k] & 0x03 || sp > 0xfffd || r >= 4)
+            stop(g, k, ErrInstr, ip);
+        else {
+            g->r[r][k] = load(bt, k, sp);
+            g->sp[k] = sp + 2;
+        }
+    }
+}
+
+/*
+ * mem1 - ld or st, lane by lane: addresses differ, and a store into
+ * code ends sharing
+ * @u: The instruction; its register byte is good
+ */
+static void mem1(Batch *bt, Group *g, int32 ip, Uop *u) {
+    int16 a, x, v;
+    int k;
+
+    for (k = 0; k < LANES; k++) {
+        if (!g->live[k])
+            continue;
+        a = (u->base < 4) ? $2 (g->r[u->base][k] + u->imm) : u->imm;
+        x = g->r[u->r][k];
+        /* Lane memory has no guard page; this is the access that hits it */
+        if (a == 0xffff)
+            stop(g, k, ErrSegv, ip);
+        else if (u->o == st) {
+            store(bt, k, a, x);
+            if (a <= bt->vm->b)
+                written(bt, g, k, ip, u->next);
+        } else {
+            v = load(bt, k, a);
+            if (g->flags[k] & 0x02)
+                g->r[u->r][k] = (v << 8) | (x & 0xff);
+            else if (g->flags[k] & 0x01)
+                g->r[u->r][k] = (x & 0xff00) | v;
+            else
+                g->r[u->r][k] = v;
+        }
+    }
+}
+
+/*
+ * rungroup - Run @g from its lowest start address until every lane stops
+ *
+ * Mirrors execute() and the handlers instruction by instruction; any
+ * change there has to be made here too.
+ */
+#if defined(__x86_64__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void rungroup(Batch *bt, Group *g) {
+    static const int16 bits[] = { 0x08, 0x04, 0x10, 0x20 };     /* E G Z C */
+    Vec x, y, f, full, hi, lo;
+    Mask hl, bad, c, t;
+    int32 ip, nip;
+    int8 o, n;
+    Args a, v;
+    Wide w;
+    Uop u;
+    VM *vm;
+
+    vm = bt->vm;
+    for (ip = 0;;) {
+        /* Nothing left running: go on with the lowest waiting lane */
+        if (!any(&g->live)) {
+            if (!any(&g->wait))
+                break;
+            ip = lowest(g);
+        }
+        if (any(&g->wait)) {
+            t = g->wait & (g->start == (int16)ip);
+            g->live |= t;
+            g->wait &= ~t;
+        }
+
+        if (ip > vm->b || ip + isize(vm, vm->m[ip]) > sizeof(Memory)) {
+            stopall(g, &g->live, ErrSegv, ip);
+            continue;
+        }
+        decode(vm, $2 ip, &u);
+        o = u.o;
+        if (!o) {
+            stopall(g, &g->live, ErrSegv, ip);
+            continue;
+        }
+
+        nip = u.next;
+        switch (o) {
+            case nop:
+                break;
+
+            case hlt:
+                stopall(g, &g->live, SysHlt, ip);
+                break;
+
+            case mov ... movsp:
+                a = u.imm;
+                bad = g->live & ((g->flags & 0x03) == 0x03);
+                if (any(&bad))
+                    stopall(g, &bad, ErrInstr, ip);
+                if (o <= mov_last) {
+                    n = o - mov;
+                    x = g->r[n];
+                    full = (x & 0) + a;
+                    hi = (x & 0xff) | (Reg)(a << 8);
+                    lo = (x & 0xff00) | a;
+                    hl = (g->flags & 0x02) != 0;
+                    y = sel(hl, hi, sel((g->flags & 0x01) != 0, lo, full));
+                    g->r[n] = sel(g->live, y, x);
+                } else
+                    g->sp = sel(g->live, (g->sp & 0) + a, g->sp);
+                break;
+
+            case ld:
+            case st:
+                bad = g->live & ((g->flags & 0x03) == 0x03);
+                if (any(&bad))
+                    stopall(g, &bad, ErrInstr, ip);
+                if (u.r > 3)
+                    stopall(g, &g->live, ErrInstr, ip);
+                else
+                    mem1(bt, g, ip, &u);
+                break;
+
+            case lea:
+                if (u.r > 3) {
+                    stopall(g, &g->live, ErrInstr, ip);
+                    break;
+                }
+                x = g->r[u.r];
+                y = ((u.base < 4) ? g->r[u.base] : (x & 0)) + u.imm;
+                g->r[u.r] = sel(g->live, y, x);
+                break;
+
+            case ste: setf(g, 0x08); break;
+            case cle: clrf(g, 0x07); break;
+            case stg: setf(g, 0x04); break;
+            case clg: clrf(g, 0x0c); break;
+            case sth: setf(g, 0x02); break;
+            case clh: clrf(g, 0x0d); break;
+            case stl: setf(g, 0x01); break;
+            case cll: clrf(g, 0x0e); break;
+
+            case push:
+                push1(bt, g, ip, u.r, u.next);
+                break;
+
+            case pop:
+                pop1(bt, g, ip, u.r);
+                break;
+
+            case add ... dec:
+                n = u.r;
+                v = (o == inc || o == dec) ? 1 : u.imm;
+                if (n >= 4 || (o == div_op && !v)) {
+                    stopall(g, &g->live, ErrInstr, ip);
+                    break;
+                }
+                x = g->r[n];
+                switch (o) {
+                    case add:
+                    case inc:
+                        y = x + v;
+                        c = y < x;
+                        break;
+
+                    case sub:
+                    case dec:
+                        y = x - v;
+                        c = x < v;
+                        break;
+
+                    case mul:
+                        w = __builtin_convertvector(x, Wide) * v;
+                        y = __builtin_convertvector(w, Vec);
+                        c = __builtin_convertvector(w > 0xffff, Mask);
+                        break;
+
+                    default:
+                        y = x / v;
+                        c = (Mask){};
+                        break;
+                }
+
+                /* Z/C as evalflags() would leave them */
+                f = (g->flags & 0x0f) | ((Vec)(y == 0) & 0x10) | ((Vec)c & 0x20);
+                g->r[n] = sel(g->live, y, x);
+                g->flags = sel(g->live, f, g->flags);
+                break;
+
+            case cmp:
+                if (u.r > 3) {
+                    stopall(g, &g->live, ErrInstr, ip);
+                    break;
+                }
+                x = g->r[u.r];
+                v = u.imm;
+                f = (g->flags & 0x03) | ((Vec)(x == v) & 0x18)
+                    | ((Vec)(x > v) & 0x04) | ((Vec)(x < v) & 0x20);
+                g->flags = sel(g->live, f, g->flags);
+                break;
+
+            case jmp:
+                nip = u.imm;
+                break;
+
+            /* In pairs, the second one jumping if the flag is clear */
+            case je ... jnc:
+                t = (g->flags & bits[(o - je) / 2]) != 0;
+                if ((o - je) & 1)
+                    t = ~t;
+                nip = branch(g, &t, u.imm, u.next);
+                break;
+
+            case call:
+                call1(bt, g, ip, u.imm, u.next);
+                nip = u.imm;
+                break;
+
+            case ret:
+                nip = ret1(bt, g, ip);
+                break;
+
+            case loop:
+                x = g->r[2] - 1;
+                g->r[2] = sel(g->live, x, g->r[2]);
+                t = x != 0;
+                nip = branch(g, &t, u.imm, u.next);
+                break;
+
+            default:
+                stopall(g, &g->live, ErrSegv, ip);
+                break;
+        }
+        ip = nip;
+    }
+
+    return;
+}
+
+/* ============================================================================
+ * Batch API
+ * ========================================================================= */
+
+/*
+ * executebatch - Run @vm's program once for each of @n lanes
+ * @vm: Program in vm->m[0..b]; its memory is every lane's initial memory
+ * @l: Registers in; final registers and status out
+ * @n: Number of lanes
+ * Returns: false if out of memory
+ *
+ * Each lane ends exactly as tryexecute() of execute() on a copy of @vm
+ * with the lane's registers would; @vm itself is not changed.
+ */
+bool executebatch(VM *vm, Lane *l, int32 n) {
+    int32 base, k, j;
+    Batch bt;
+    Group g;
+
+    zero($1 &bt, sizeof(Batch));
+    bt.vm = vm;
+    if (!(bt.mem = malloc(LANES * sizeof(*bt.mem))))
+        return false;
+
+    for (base = 0; base < n; base += LANES) {
+        zero($1 &g, sizeof(Group));
+        for (k = 0; k < LANES && base + k < n; k++) {
+            for (j = 0; j < 4; j++)
+                g.r[j][k] = l[base + k].r[j];
+            g.sp[k] = l[base + k].sp;
+            g.flags[k] = l[base + k].flags;
+            g.start[k] = l[base + k].ip;
+            g.wait[k] = -1;
+            bt.lo[k] = bt.hi[k] = 0;
+        }
+
+        rungroup(&bt, &g);
+
+        for (k = 0; k < LANES && base + k < n; k++) {
+            for (j = 0; j < 4; j++)
+                l[base + k].r[j] = g.r[j][k];
+            l[base + k].sp = g.sp[k];
+            l[base + k].ip = g.ip[k];
+            l[base + k].flags = g.flags[k];
+            l[base + k].status = g.st[k];
+        }
+    }
+
+    if (bt.solo)
+        freevm(bt.solo);
+    free(bt.mem);
+
+    return true;
+}
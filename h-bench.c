@@ -0,0 +1,346 @@
+/*
+ * h-bench.c - H-VM Interpreter Microbenchmarks
+ *
+ * Generates one long program per opcode class, straight-line except for
+ * the branch class, which is a counted loop. Runs each through an
+ * engine (execute() by default) with warmup and repetitions, and
+ * reports ns/instruction and instructions/second with their spread.
+ * Results can be saved as JSON and compared against a saved baseline.
+ *
+ * Usage: h-bench [-e engine] [-n reps] [-w warmup] [-o out.json] [-b baseline.json]
+ */
+
+#include "h-vm.h"
+#include <math.h>
+#include <time.h>
+
+#define CODESIZE    0xe000  /* Code per program; the stack stays above it */
+
+/* Benchmark program - one opcode class */
+struct s_bench {
+    const char *name;
+    int32 (*gen)(int8*, int32*);   /* Returns the code size */
+};
+typedef struct s_bench Bench;
+
+/* Result of one class over all repetitions */
+struct s_result {
+    int32 n;        /* Instructions per run */
+    double mean;    /* ns/instruction */
+    double sd;      /* Standard deviation of ns/instruction */
+    double min;
+};
+typedef struct s_result Result;
+
+/* ============================================================================
+ * Program Generators
+ * ========================================================================= */
+
+/*
+ * put - Encode one instruction at @p + *@at and advance *@at
+ * @a1: Register selector, or the immediate of a mov or jump
+ * @a2: Immediate of an arithmetic instruction
+ */
+static void put(int8 *p, int32 *at, Opcode o, Args a1, Args a2) {
+    *at += encodeop(p + *at, o, a1, a2);
+}
+
+/* Room left for one more group of at most 32 bytes and the hlt */
+#define room(at)    ((at) + 33 <= CODESIZE)
+
+/* add/sub/mul/div/inc/dec over all four registers */
+static int32 genarith(int8 *p, int32 *n) {
+    int32 at, k;
+    int8 r;
+
+    for (at = k = 0; room(at); k++, *n += 6) {
+        r = k & 3;
+        put(p, &at, add, r, (k & 0x7f) | 1);
+        put(p, &at, sub, r, 3);
+        put(p, &at, mul, r, 3);
+        put(p, &at, div_op, r, 2);
+        put(p, &at, inc, r, 0);
+        put(p, &at, dec, r, 0);
+    }
+    put(p, &at, hlt, 0, 0);
+    ++*n;
+
+    return at;
+}
+
+/* Balanced push/pop traffic */
+static int32 genstack(int8 *p, int32 *n) {
+    int32 at, k;
+
+    for (at = k = 0; room(at); k++, *n += 4) {
+        put(p, &at, push, k & 3, 0);
+        put(p, &at, push, (k + 1) & 3, 0);
+        put(p, &at, pop, (k + 2) & 3, 0);
+        put(p, &at, pop, (k + 3) & 3, 0);
+    }
+    put(p, &at, hlt, 0, 0);
+    ++*n;
+
+    return at;
+}
+
+/* Full, high-byte and low-byte register moves */
+static int32 genmov(int8 *p, int32 *n) {
+    int32 at, k;
+
+    for (at = k = 0; room(at); k++, *n += 8) {
+        put(p, &at, mov, k, 0);
+        put(p, &at, sth, 0, 0);
+        put(p, &at, mov + 1, k, 0);
+        put(p, &at, clh, 0, 0);
+        put(p, &at, stl, 0, 0);
+        put(p, &at, mov + 2, k, 0);
+        put(p, &at, cll, 0, 0);
+        put(p, &at, mov + 3, k, 0);
+    }
+    put(p, &at, hlt, 0, 0);
+    ++*n;
+
+    return at;
+}
+
+/* Flag set/clear */
+static int32 genflags(int8 *p, int32 *n) {
+    int32 at;
+
+    for (at = 0; room(at); *n += 8) {
+        put(p, &at, ste, 0, 0);
+        put(p, &at, cle, 0, 0);
+        put(p, &at, stg, 0, 0);
+        put(p, &at, clg, 0, 0);
+        put(p, &at, sth, 0, 0);
+        put(p, &at, clh, 0, 0);
+        put(p, &at, stl, 0, 0);
+        put(p, &at, cll, 0, 0);
+    }
+    put(p, &at, hlt, 0, 0);
+    ++*n;
+
+    return at;
+}
+
+/*
+ * genbranch - Counted loop over cmp, a conditional jump, call/ret and
+ * loop; the jump is taken on all but every 64th round
+ */
+static int32 genbranch(int8 *p, int32 *n) {
+    int32 at, top, skip, site;
+    int32 rounds;
+
+    rounds = 0xf000;
+    at = 0;
+    put(p, &at, mov + 2, rounds, 0);
+    top = at;
+    put(p, &at, add, 0, 1);
+    put(p, &at, cmp, 0, 0x40);
+    skip = at;
+    put(p, &at, jne, 0, 0);
+    put(p, &at, mov, 0, 0);
+    encodeop(p + skip, jne, at, 0);
+    site = at;
+    put(p, &at, call, 0, 0);
+    put(p, &at, loop, top, 0);
+    put(p, &at, hlt, 0, 0);
+    encodeop(p + site, call, at, 0);
+    put(p, &at, inc, 1, 0);
+    put(p, &at, ret, 0, 0);
+    *n = 1 + rounds * 7 + rounds / 64 + 1;
+
+    return at;
+}
+
+static Bench benches[] = {
+    { "arith", genarith },
+    { "stack", genstack },
+    { "mov",   genmov },
+    { "flags", genflags },
+    { "branch", genbranch },
+    { 0, 0 }
+};
+
+/* ============================================================================
+ * Measurement
+ * ========================================================================= */
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* reset - Put @vm back in its load state, keeping code and caches */
+static void reset(VM *vm) {
+    zero($1 &vm->c, sizeof(CPU));
+    vm $sp = 0xffff;
+}
+
+/*
+ * measure - Run @b on @eng @warm + @reps times
+ * Returns: false if the program did not halt cleanly
+ */
+static bool measure(Bench *b, Engine *eng, int warm, int reps, Result *r) {
+    double t, sum, sq, x;
+    VErr err;
+    VM *vm;
+    int k;
+
+    vm = virtualmachine();
+    if (!vm)
+        return false;
+    r->n = 0;
+    vm->b = $2 b->gen(vm->m, &r->n);
+    if (!verify(vm, &err)) {
+        fprintf(stderr, "%s: rejected at 0x%04x: %s\n", b->name, err.ip, err.why);
+        freevm(vm);
+        return false;
+    }
+    predecode(vm);
+
+    sum = sq = 0;
+    r->min = HUGE_VAL;
+    for (k = -warm; k < reps; k++) {
+        reset(vm);
+        t = now();
+        if (tryexecute(vm, eng) != SysHlt) {
+            fprintf(stderr, "%s: stopped with error 0x%02x\n", b->name, vm->status);
+            freevm(vm);
+            return false;
+        }
+        x = (now() - t) / r->n;
+        if (k < 0)
+            continue;
+        sum += x;
+        sq += x * x;
+        if (x < r->min)
+            r->min = x;
+    }
+    r->mean = sum / reps;
+    r->sd = (reps > 1) ? sqrt(fmax(0, (sq - sum * r->mean) / (reps - 1))) : 0;
+    freevm(vm);
+
+    return true;
+}
+
+/*
+ * baseline - Look up the ns/instruction of class @name in a saved report
+ * Returns: The value, or 0 if it is not there
+ */
+static double baseline(const char *json, const char *name) {
+    char key[64];
+    const char *p;
+    double x;
+
+    if (!json)
+        return 0;
+    snprintf(key, sizeof(key), "\"class\": \"%s\"", name);
+    if (!(p = strstr(json, key)) || !(p = strstr(p, "\"ns_per_instr\":")))
+        return 0;
+    if (sscanf(p, "\"ns_per_instr\": %lf", &x) != 1)
+        return 0;
+
+    return x;
+}
+
+/* slurp - Read a whole file; NULL on failure */
+static char *slurp(const char *path) {
+    char *buf;
+    long len;
+    FILE *f;
+
+    if (!(f = fopen(path, "rb")))
+        return (char *)0;
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    buf = (char *)malloc(len + 1);
+    if (buf && fread(buf, 1, len, f) == (size_t)len)
+        buf[len] = 0;
+    else {
+        free(buf);
+        buf = (char *)0;
+    }
+    fclose(f);
+
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    const char *out, *base;
+    Result res[8];
+    char *json;
+    Engine *eng;
+    double old;
+    int warm, reps, opt, fail;
+    FILE *f;
+    Bench *b;
+
+    eng = engine("switch");
+    warm = 2;
+    reps = 10;
+    out = base = (char *)0;
+    while ((opt = getopt(argc, argv, "e:n:w:o:b:")) != -1)
+        switch (opt) {
+            case 'e':
+                if ((eng = engine(optarg)))
+                    break;
+                fprintf(stderr, "unknown engine '%s'\n", optarg);
+                return 1;
+            case 'n': reps = atoi(optarg); break;
+            case 'w': warm = atoi(optarg); break;
+            case 'o': out = optarg; break;
+            case 'b': base = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-e engine] [-n reps] [-w warmup] "
+                    "[-o out.json] [-b baseline.json]\n", argv[0]);
+                return 1;
+        }
+    if (reps < 1)
+        reps = 1;
+    guardpage();    /* As h-vm does */
+
+    json = base ? slurp(base) : (char *)0;
+    if (base && !json)
+        perror(base);
+
+    printf("engine %s, %d runs after %d warmup\n", eng->name, reps, warm);
+    printf("%-6s %8s %9s %8s %9s %11s %9s\n", "class", "instrs",
+        "ns/instr", "stddev", "min", "instr/s", "baseline");
+    fail = 0;
+    for (b = benches; b->name; b++) {
+        if (!measure(b, eng, warm, reps, &res[b - benches])) {
+            fail = 1;
+            continue;
+        }
+        printf("%-6s %8u %9.3f %8.3f %9.3f %11.4g", b->name,
+            res[b - benches].n, res[b - benches].mean, res[b - benches].sd,
+            res[b - benches].min, 1e9 / res[b - benches].mean);
+        if ((old = baseline(json, b->name)))
+            printf(" %+8.1f%%", 100.0 * (res[b - benches].mean - old) / old);
+        printf("\n");
+    }
+    free(json);
+    if (fail || !out)
+        return fail;
+
+    if (!(f = fopen(out, "w"))) {
+        perror(out);
+        return 1;
+    }
+    fprintf(f, "{\n  \"engine\": \"%s\",\n  \"reps\": %d,\n  \"warmup\": %d,\n"
+        "  \"results\": [", eng->name, reps, warm);
+    for (b = benches; b->name; b++)
+        fprintf(f, "%s\n    {\"class\": \"%s\", \"instructions\": %u, "
+            "\"ns_per_instr\": %.4f, \"stddev\": %.4f, \"min\": %.4f, "
+            "\"instr_per_sec\": %.0f}", (b == benches) ? "" : ",", b->name,
+            res[b - benches].n, res[b - benches].mean, res[b - benches].sd,
+            res[b - benches].min, 1e9 / res[b - benches].mean);
+    fprintf(f, "\n  ]\n}\n");
+
+    return fclose(f) ? 1 : 0;
+}
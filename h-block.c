@@ -0,0 +1,416 @@
+/*
+ * h-block.c - H-VM Basic Block Translation Cache
+ *
+ * Translates straight-line runs of guest code into blocks of micro-ops,
+ * caches them by guest address and chains each block to its successors
+ * so hot code runs without returning to the central lookup.
+ *
+ * Common instruction sequences are fused into superinstructions while
+ * translating (HVM_NOFUSE=1 turns this off). HVM_NGRAMS=1 reports the
+ * hottest opcode sequences at exit, which is how the list in fuse() is
+ * chosen.
+ */
+
+#include "h-vm.h"
+
+#define bucket(ip) (((ip) ^ ((ip) >> 8)) & (BLOCKHASH - 1))
+
+/* ============================================================================
+ * Opcode N-gram Profile
+ * ========================================================================= */
+
+#define NGRAMMAX    3   /* Longest sequence counted */
+#define NGRAMTOP    20  /* Lines in the report */
+
+struct s_ngram {
+    int8 o[NGRAMMAX];
+    int8 n;         /* Length */
+    bool same;      /* Every instruction names the same register */
+    int64 count;    /* Dynamic executions */
+};
+typedef struct s_ngram Ngram;
+
+struct s_ngrams {
+    int32 n, cap;
+    Ngram *g;
+};
+typedef struct s_ngrams Ngrams;
+
+/* hasreg - Whether opcode @o takes a general purpose register operand */
+static bool hasreg(int8 o) {
+    return optable[o].r != RegNone;
+}
+
+/* ngramadd - Add @count executions of the sequence at @u to @ng */
+static void ngramadd(Ngrams *ng, Uop *u, int8 n, int64 count) {
+    Ngram key, *g;
+    int32 k;
+    int8 j;
+
+    zero($1 &key, sizeof(key));
+    key.n = n;
+    key.same = true;
+    for (j = 0; j < n; j++) {
+        key.o[j] = unfused(&u[j]);
+        if (!hasreg(key.o[j]) || u[j].r != u[0].r)
+            key.same = false;
+    }
+
+    for (k = 0, g = ng->g; k < ng->n; k++, g++)
+        if (g->n == n && g->same == key.same &&
+                !memcmp(g->o, key.o, NGRAMMAX)) {
+            g->count += count;
+            return;
+        }
+
+    if (ng->n == ng->cap) {
+        ng->cap = ng->cap ? ng->cap * 2 : 256;
+        g = (Ngram *)realloc(ng->g, ng->cap * sizeof(Ngram));
+        if (!g)
+            return;
+        ng->g = g;
+    }
+    key.count = count;
+    ng->g[ng->n++] = key;
+
+    return;
+}
+
+/* ngramblock - Fold the executions of @blk into the profile */
+static void ngramblock(Ngrams *ng, Block *blk) {
+    int16 k;
+    int8 n;
+
+    if (!blk->hits)
+        return;
+    for (k = 0; k < blk->n; k++)
+        for (n = 2; n <= NGRAMMAX && k + n <= blk->n; n++)
+            ngramadd(ng, &blk->u[k], n, blk->hits);
+
+    return;
+}
+
+static int ngramcmp(const void *a, const void *b) {
+    const Ngram *x = a, *y = b;
+
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+/* ngramreport - Print the hottest sequences to stderr */
+static void ngramreport(Ngrams *ng) {
+    const char *name;
+    int32 k;
+    int8 j;
+
+    qsort(ng->g, ng->n, sizeof(Ngram), ngramcmp);
+    fprintf(stderr, "Opcode n-grams (dynamic count, top %d):\n", NGRAMTOP);
+    for (k = 0; k < ng->n && k < NGRAMTOP; k++) {
+        fprintf(stderr, "%12llu ", ng->g[k].count);
+        for (j = 0; j < ng->g[k].n; j++) {
+            name = optable[ng->g[k].o[j]].n;
+            fprintf(stderr, " %s/%02x", name ? name : "???", ng->g[k].o[j]);
+        }
+        fprintf(stderr, "%s\n", ng->g[k].same ? "  (same register)" : "");
+    }
+
+    return;
+}
+
+/* ============================================================================
+ * Translation
+ * ========================================================================= */
+
+/*
+ * fuse - Rewrite common sequences in @u[0..n) as superinstructions
+ *
+ * The sequences are the hottest n-grams of our workloads that fuse
+ * without changing what the guest can observe. The covered micro-ops
+ * are left in place; the fused one runs them without dispatching.
+ */
+static void fuse(Uop *u, int16 n) {
+    int16 k, j;
+    Uop *p;
+
+    for (k = 0; k + 1 < n; k++) {
+        p = &u[k];
+        if (p->o >= mov && p->o <= mov_last && u[k + 1].r == p->r) {
+            switch (u[k + 1].o) {
+                case add: p->o = FMovAdd; k++; break;
+                case sub: p->o = FMovSub; k++; break;
+                case mul: p->o = FMovMul; k++; break;
+                default: break;
+            }
+        } else if ((p->o == inc || p->o == dec) && p->r < 4) {
+            for (j = k + 1; j < n && u[j].o == p->o && u[j].r == p->r; j++)
+                ;
+            if (j - k < 2)
+                continue;
+            p->imm = j - k;
+            p->o = (p->o == inc) ? FIncN : FDecN;
+            k = j - 1;
+        }
+    }
+
+    return;
+}
+
+/*
+ * translate - Translate the basic block starting at @ip
+ * @vm: VM instance
+ * @ip: Guest address of the first instruction (ip <= vm->b)
+ * Returns: New block, not yet linked into the cache
+ *
+ * The block ends after an OpEnd instruction, an undefined opcode,
+ * the last instruction starting at or below vm->b, or BLOCKMAX
+ * instructions, whichever comes first; also before an instruction that
+ * would run off the end of memory, which faults when it is executed.
+ */
+static Block *translate(VM *vm, int16 ip) {
+    Uop u[BLOCKMAX];
+    Block *blk;
+    int32 pc;
+    int16 n;
+    OD *d;
+
+    pc = ip;
+    n = 0;
+    do {
+        d = &optable[vm->m[pc]];
+        decode(vm, $2 pc, &u[n++]);
+        pc += isize(vm, vm->m[pc]);
+    } while (n < BLOCKMAX && d->s && !(d->f & OpEnd) && pc <= vm->b
+        && pc + isize(vm, vm->m[pc]) <= sizeof(Memory));
+    if (vm->bc->fuse)
+        fuse(u, n);
+
+    blk = (Block *)malloc(sizeof(Block) + n * sizeof(Uop));
+    if (!blk)
+        error(vm, ErrMem);
+    blk->ip = ip;
+    blk->end = $2 pc;
+    blk->n = n;
+    blk->chain = (Block *)0;
+    blk->jump = (Block *)0;
+    blk->hnext = (Block *)0;
+    blk->native = 0;
+    blk->jitted = false;
+    blk->hits = 0;
+    copy($1 blk->u, $1 u, $i (n * sizeof(Uop)));
+
+    return blk;
+}
+
+/*
+ * cached - The block starting at @ip if there is one
+ */
+Block *cached(VM *vm, int16 ip) {
+    Block *blk;
+
+    for (blk = vm->bc->h[bucket(ip)]; blk; blk = blk->hnext)
+        if (blk->ip == ip)
+            return blk;
+
+    return (Block *)0;
+}
+
+/*
+ * block - Find or translate the block starting at @ip
+ * @vm: VM instance
+ * @ip: Guest address
+ * Returns: Cached block
+ *
+ * Faults like execute() when @ip is past the end of the program. A VM
+ * using an image's blocks gets its own cache before translating.
+ */
+Block *block(VM *vm, int16 ip) {
+    Block *blk, **h;
+    BC *bc;
+
+    if (ip > vm->b)
+        segfault(vm);
+    if ((blk = cached(vm, ip)))
+        return blk;
+
+    own(vm);
+    bc = vm->bc;
+    h = &bc->h[bucket(ip)];
+    blk = translate(vm, ip);
+    blk->hnext = *h;
+    *h = blk;
+    if (bc->lo > blk->ip)
+        bc->lo = blk->ip;
+    if (bc->hi < blk->end)
+        bc->hi = blk->end;
+
+    return blk;
+}
+
+/* envflag - Whether environment variable @name is set and not "0" */
+static bool envflag(const char *name) {
+    const char *env;
+
+    env = getenv(name);
+    return env && *env && *env != '0';
+}
+
+/*
+ * blockcache - Attach an empty block cache to @vm if it has none
+ */
+void blockcache(VM *vm) {
+    if (vm->bc)
+        return;
+
+    vm->bc = (BC *)malloc(sizeof(BC));
+    if (!vm->bc)
+        error(vm, ErrMem);
+    zero($1 vm->bc, sizeof(BC));
+    vm->bc->fuse = !envflag("HVM_NOFUSE");
+    if (envflag("HVM_NGRAMS"))
+        vm->bc->ng = (Ngrams *)calloc(1, sizeof(Ngrams));
+    flushblocks(vm);
+
+    return;
+}
+
+/*
+ * flushblocks - Discard every translated block
+ * @vm: VM instance
+ *
+ * Chain pointers may refer to any block, so a code write that hits
+ * translated code drops the whole cache rather than single blocks.
+ */
+void flushblocks(VM *vm) {
+    Block *blk, *nxt;
+    BC *bc;
+    int n;
+
+    bc = vm->bc;
+    for (n = 0; n < BLOCKHASH; n++) {
+        for (blk = bc->h[n]; blk; blk = nxt) {
+            nxt = blk->hnext;
+            if (bc->ng)
+                ngramblock(bc->ng, blk);
+            free(blk);
+        }
+        bc->h[n] = (Block *)0;
+    }
+    bc->lo = 0xffff;
+    bc->hi = 0;
+    bc->gen++;
+
+    return;
+}
+
+/*
+ * freeblocks - Release the block cache of @vm, reporting the n-gram
+ * profile if one was taken
+ */
+void freeblocks(VM *vm) {
+    BC *bc;
+
+    if (!(bc = vm->bc))
+        return;
+
+    flushblocks(vm);
+    if (bc->ng) {
+        ngramreport(bc->ng);
+        free(bc->ng->g);
+        free(bc->ng);
+    }
+    free(bc);
+    vm->bc = (BC *)0;
+
+    return;
+}
+
+/*
+ * executeblocks - Execution loop over chained basic blocks
+ * @vm: VM instance
+ *
+ * Same semantics as execute(). Micro-ops inside a block are threaded
+ * directly into each other; at a block exit the successor is taken
+ * from the block's links, see chained(), and only looked up in the
+ * hash table when they miss. A loop that is one block links to itself.
+ * A store that flushes the cache restarts the lookup.
+ */
+void executeblocks(VM *vm) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"    /* l_bad, then each row */
+    static void *checked[256] = UOPLABELS, *unchecked[256] = UOPFASTLABELS;
+#pragma GCC diagnostic pop
+    Block *blk, *to;
+    void **labels;
+    Uop *u, *end;
+    int32 gen;
+    int16 nip;
+    int8 size;
+    Reg *reg;
+    bool prof;
+
+#define next() do { \
+        vm $ip = nip; \
+        if (++u == end) \
+            goto exit; \
+        nip = u->next; \
+        goto *labels[u->o]; \
+    } while (0)
+#define stored() do { \
+        if (vm->bc->gen != gen) { \
+            vm->fuel += end - u - 1; \
+            vm $ip = nip; \
+            goto lookup; \
+        } \
+    } while (0)
+#define skip(k) do { \
+        u += (k); \
+        vm $ip = (u - 1)->next; \
+        nip = u->next; \
+    } while (0)
+
+    assert(vm && *vm->m);
+    blockcache(vm);
+    prof = !!vm->bc->ng;
+    labels = guarded ? unchecked : checked;
+
+lookup:
+    /* Shared blocks start where others end; step to the next one */
+    if (vm->img && vm $ip <= vm->b && !cached(vm, vm $ip)) {
+        burn(vm);
+        size = execinstr(vm, vm->m + vm $ip);
+        vm $ip += size;
+        goto lookup;
+    }
+    blk = block(vm, vm $ip);
+    gen = vm->bc->gen;
+
+enter:
+    /* Charged up front; the last partial block runs one by one */
+    if (vm->fuel < blk->n) {
+        execute(vm);
+        return;
+    }
+    vm->fuel -= blk->n;
+    if (prof)
+        blk->hits++;
+    u = blk->u;
+    end = u + blk->n;
+    nip = u->next;
+    goto *labels[u->o];
+
+exit:
+    if (!(to = chained(blk, vm $ip))) {
+        if (vm->img && vm $ip <= vm->b && !cached(vm, vm $ip))
+            goto lookup;
+        to = block(vm, vm $ip);
+        if (!vm->img)
+            linkblock(blk, to);
+    }
+    blk = to;
+    goto enter;
+
+#include "h-uops.inc"
+
+#undef skip
+#undef stored
+#undef next
+}
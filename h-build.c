@@ -0,0 +1,244 @@
+/*
+ * h-build.c - H-VM Program Builder
+ *
+ * Encodes instructions straight into a byte buffer, for hosts that
+ * generate programs at run time. The buffer is either the caller's -
+ * a VM's own memory, so a program is loaded without being copied - or
+ * grown here by doubling. Labels name addresses that are not known
+ * yet; fields referring to them are patched once the program is built.
+ *
+ *   builder(&b, vm->m, sizeof(Memory));
+ *   emit(&b, mov + 2, 10, 0);                       // mov cx, 10
+ *   top = label(&b);
+ *   place(&b, top);
+ *   emit(&b, inc, 0, 0);                            // inc ax
+ *   ref(&b, immof(&b, emit(&b, loop, 0, 0)), top);  // loop top
+ *   emit(&b, hlt, 0, 0);
+ *   program(vm, &b);
+ *
+ * Code is EncVar; setting b.enc = EncWord after builder() emits EncWord
+ * instead.
+ *
+ * Failures are sticky: after one, emits are ignored and built() and
+ * program() return false, so a generator checks once at the end.
+ */
+
+#include "h-vm.h"
+
+/*
+ * fit - Make room for @n more bytes of code
+ * Returns: false, and fails @b, if the program would not fit
+ */
+static bool fit(Builder *b, int n) {
+    int max, cap;
+    int8 *p;
+
+    if (b->fail)
+        return false;
+    max = (b->grow || b->cap > $i sizeof(Memory) - 1)
+        ? $i sizeof(Memory) - 1 : b->cap;
+    if (b->n + n > max) {
+        b->fail = true;
+        return false;
+    }
+    if (b->n + n <= b->cap)
+        return true;
+
+    for (cap = b->cap ? b->cap * 2 : 256; cap < b->n + n; cap *= 2)
+        ;
+    if (!(p = (int8 *)realloc(b->p, cap))) {
+        b->fail = true;
+        return false;
+    }
+    b->p = p;
+    b->cap = cap;
+
+    return true;
+}
+
+/*
+ * builder - Start an empty program
+ * @b: Builder
+ * @buf: Buffer to build in, or NULL to have one grown as needed
+ * @cap: Size of @buf
+ */
+void builder(Builder *b, int8 *buf, int cap) {
+    zero($1 b, sizeof(Builder));
+    b->p = buf;
+    b->cap = buf ? cap : 0;
+    b->grow = !buf;
+
+    return;
+}
+
+/*
+ * emit - Append one instruction
+ * @b: Builder
+ * @op: Opcode
+ * @a1: Register selector, memregs() of a memory instruction, or the
+ *      immediate of a mov
+ * @a2: Immediate of an arithmetic instruction, or a memory offset
+ * Returns: Offset of the instruction, or -1 if it did not fit
+ *
+ * Encoded by encodeop(): inc r is [inc][r], mov is [op][imm lo][imm hi],
+ * add r, imm is [add][r][0][imm]. In EncWord, by encodeword().
+ */
+int emit(Builder *b, Opcode op, Args a1, Args a2) {
+    int8 size;
+    int at;
+
+    size = (b->enc == EncWord) ? WORDSIZE : map(op);
+    if (!map(op) || (b->enc == EncWord && optable[(int8)op].l == LayWordWord)) {
+        b->fail = true;
+        return -1;
+    }
+    if (!fit(b, size))
+        return -1;
+
+    at = b->n;
+    if (b->enc == EncWord)
+        b->n += encodeword(b->p + at, op, a1, a2);
+    else
+        b->n += encodeop(b->p + at, op, a1, a2);
+
+    return at;
+}
+
+/*
+ * immof - Offset of the 16-bit immediate of the instruction at @at
+ *
+ * Where a label reference to it goes: [at + 1] in EncVar, for layouts
+ * whose first argument is the immediate, [at + 3] for a memory offset,
+ * and [at + 2] in EncWord.
+ */
+int immof(Builder *b, int at) {
+    if (at < 0)
+        return -1;
+    if (b->enc == EncWord)
+        return at + 2;
+
+    return at + ((optable[b->p[at]].l == LayMem) ? 3 : 1);
+}
+
+/*
+ * label - Create a label, not placed yet
+ * Returns: Label, or -1 if out of memory
+ */
+int label(Builder *b) {
+    int *lab;
+    int cap;
+
+    if (b->fail)
+        return -1;
+    if (b->nlab == b->caplab) {
+        cap = b->caplab ? b->caplab * 2 : 16;
+        if (!(lab = (int *)realloc(b->lab, cap * sizeof(int)))) {
+            b->fail = true;
+            return -1;
+        }
+        b->lab = lab;
+        b->caplab = cap;
+    }
+    b->lab[b->nlab] = -1;
+
+    return b->nlab++;
+}
+
+/*
+ * place - Give label @l the address of the next instruction
+ */
+void place(Builder *b, int l) {
+    if (b->fail || l < 0 || l >= b->nlab) {
+        b->fail = true;
+        return;
+    }
+    b->lab[l] = b->n;
+
+    return;
+}
+
+/*
+ * ref - Have the 16-bit field at offset @at receive the address of @l
+ *
+ * The field is written by built(), so @l may be placed before or after.
+ * For an instruction emitted at k, its immediate is at immof(b, k).
+ */
+void ref(Builder *b, int at, int l) {
+    Fixup *fix;
+    int cap;
+
+    if (b->fail)
+        return;
+    if (b->nfix == b->capfix) {
+        cap = b->capfix ? b->capfix * 2 : 16;
+        if (!(fix = (Fixup *)realloc(b->fix, cap * sizeof(Fixup)))) {
+            b->fail = true;
+            return;
+        }
+        b->fix = fix;
+        b->capfix = cap;
+    }
+    b->fix[b->nfix].at = at;
+    b->fix[b->nfix].l = l;
+    b->nfix++;
+
+    return;
+}
+
+/*
+ * built - Patch every label reference
+ * Returns: false if anything failed or a reference is to a label never
+ *          placed; the code is then incomplete
+ */
+bool built(Builder *b) {
+    int k, at, addr;
+
+    for (k = 0; k < b->nfix && !b->fail; k++) {
+        at = b->fix[k].at;
+        if (b->fix[k].l < 0 || b->fix[k].l >= b->nlab
+                || (addr = b->lab[b->fix[k].l]) < 0
+                || at < 0 || at + 2 > b->n) {
+            b->fail = true;
+            break;
+        }
+        b->p[at] = (int8)addr;
+        b->p[at + 1] = (int8)(addr >> 8);
+    }
+    b->nfix = 0;
+
+    return !b->fail;
+}
+
+/*
+ * program - Build @b and make it @vm's program, run from address 0
+ * Returns: false if @b failed, and the program is not loaded
+ *
+ * Code built in vm->m is used in place; otherwise it is copied in.
+ * The rest of memory and the registers are left alone.
+ */
+bool program(VM *vm, Builder *b) {
+    if (!built(b) || !b->n)
+        return false;
+
+    if (b->p != vm->m)
+        copy(vm->m, b->p, b->n);
+    dropcaches(vm);
+    vm->b = $2 b->n;
+    vm->enc = b->enc;
+    vm->verified = false;
+
+    return true;
+}
+
+/*
+ * freebuilder - Release what @b allocated; a caller's buffer is kept
+ */
+void freebuilder(Builder *b) {
+    if (b->grow)
+        free(b->p);
+    free(b->lab);
+    free(b->fix);
+    zero($1 b, sizeof(Builder));
+
+    return;
+}
@@ -0,0 +1,254 @@
+/*
+ * h-file.c - H-VM Program Files
+ *
+ * A program file holds what a VM starts from: code loaded at address 0,
+ * the entry point and stack pointer, and data sections placed anywhere
+ * else in memory. Nothing in it is parsed per instruction. The file is
+ * mapped, the header checked, and each section that starts on a page in
+ * both the file and guest memory is mapped privately over the VM's
+ * memory; the rest are copied. Starting a large program therefore costs
+ * page mappings, and pages the guest never touches are never read.
+ *
+ *   FileHdr     magic, version, entry, sp, code size, encoding, offset
+ *   Section[]   nsect data sections
+ *   ...         code and data, each at a multiple of FILEALIGN
+ *
+ * Files without the magic are loaded as raw code, as written by
+ * earlier versions of h-vm -o. Version 1 files, which predate EncWord,
+ * are EncVar; files of EncVar code are still written as version 1.
+ */
+
+#include "h-vm.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+_Static_assert(sizeof(FileHdr) == 20 && sizeof(Section) == 8, "file layout");
+
+/* blank - Whether @n bytes at @p are all zero */
+static bool blank(const int8 *p, size_t n) {
+    return !n || (!*p && !memcmp(p, p + 1, n - 1));
+}
+
+/* alignup - Round @n up to a multiple of FILEALIGN */
+static int32 alignup(int32 n) {
+    return (n + FILEALIGN - 1) & ~(int32)(FILEALIGN - 1);
+}
+
+/* encoding - Code encoding of a valid file */
+static int8 encoding(const FileHdr *h) {
+    return (h->version == 1) ? EncVar : (int8)h->enc;
+}
+
+/*
+ * valid - Whether the file at @f holds a program we can load
+ *
+ * Sections must lie inside the file and inside memory, and must not
+ * overlap the code or each other. EncWord code and its entry point
+ * must be whole words.
+ */
+static bool valid(const int8 *f, size_t size) {
+    const Section *s, *t;
+    const FileHdr *h;
+    int32 k, j;
+
+    h = (const FileHdr *)f;
+    s = (const Section *)(h + 1);
+    if ((h->version != 1 && h->version != FILEVERSION)
+            || !h->code
+            || h->entry >= h->code
+            || sizeof(FileHdr) + h->nsect * sizeof(Section) > size
+            || $8 h->codeoff + h->code > size)
+        return false;
+    if (encoding(h) == EncWord ? (h->code | h->entry) % WORDSIZE
+            : encoding(h) != EncVar)
+        return false;
+
+    for (k = 0; k < h->nsect; k++) {
+        if (!s[k].len || $4 s[k].addr + s[k].len > sizeof(Memory)
+                || $8 s[k].off + s[k].len > size || s[k].addr < h->code)
+            return false;
+        for (j = 0, t = s; j < k; j++, t++)
+            if (s[k].addr < $4 t->addr + t->len
+                    && t->addr < $4 s[k].addr + s[k].len)
+                return false;
+    }
+
+    return true;
+}
+
+/*
+ * mappable - Whether @s can be mapped from the file instead of copied
+ *
+ * Its pages must start on a page in both places, and the file must hold
+ * zeros past its end up to the end of its last page.
+ */
+static bool mappable(const int8 *f, size_t size, const Section *s) {
+    size_t pg, n;
+
+    pg = pageup(1);
+    n = pageup(s->len);
+    return !(s->addr % pg) && !(s->off % pg) && s->off + n <= size
+        && blank(f + s->off + s->len, n - s->len);
+}
+
+/*
+ * loadsect - Load @s into @vm, mapping or copying
+ * @map: true to load @s only if it can be mapped, false only if it can't
+ *
+ * Mapping replaces whole pages, so every mapping is made before copies
+ * that may share a page with it.
+ */
+static bool loadsect(VM *vm, int fd, const int8 *f, size_t size,
+        const Section *s, bool map) {
+    if (mappable(f, size, s) != map)
+        return true;
+
+    if (map)
+        return mmap(vm->m + s->addr, pageup(s->len), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, fd, s->off) != MAP_FAILED;
+    copy(vm->m + s->addr, $1 (f + s->off), s->len);
+
+    return true;
+}
+
+/*
+ * loadfile - Load the program file at @path into @vm
+ * Returns: false with errno set if it could not be read or is not a
+ *          program (ENOEXEC); if memory could not be mapped, @vm is
+ *          then unusable
+ *
+ * Memory is cleared and the registers set as the file says; caches of
+ * the previous program are dropped. The code is not verified.
+ */
+bool loadfile(VM *vm, const char *path) {
+    const Section *sect;
+    const FileHdr *h;
+    struct stat st;
+    Section code;
+    size_t size;
+    int fd, k, pass;
+    bool ok;
+    int8 *f;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return false;
+    f = (int8 *)MAP_FAILED;
+    ok = false;
+    if (fstat(fd, &st))
+        goto out;
+    size = st.st_size;
+    errno = ENOEXEC;
+    if (!size || (f = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        goto out;
+
+    h = (const FileHdr *)f;
+    if (size >= sizeof(FileHdr) && !memcmp(h->magic, FILEMAGIC, 4)) {
+        if (!valid(f, size))
+            goto out;
+        code.addr = 0;
+        code.len = h->code;
+        code.off = h->codeoff;
+        sect = (const Section *)(h + 1);
+        if (!wipe(vm))
+            goto out;
+        for (pass = 0; pass < 2; pass++) {
+            if (!loadsect(vm, fd, f, size, &code, !pass))
+                goto out;
+            for (k = 0; k < h->nsect; k++)
+                if (!loadsect(vm, fd, f, size, &sect[k], !pass))
+                    goto out;
+        }
+        zero($1 &vm->c, sizeof(CPU));
+        vm $ip = h->entry;
+        vm $sp = h->sp;
+        vm->b = h->code;
+        vm->enc = encoding(h);
+    } else {
+        if (size >= sizeof(Memory) || !wipe(vm))
+            goto out;
+        copy(vm->m, f, $i size);
+        zero($1 &vm->c, sizeof(CPU));
+        vm $sp = 0xffff;
+        vm->b = $2 size;
+        vm->enc = EncVar;
+    }
+    dropcaches(vm);
+    vm->verified = false;
+    ok = true;
+
+out:
+    k = errno;
+    if (f != (int8 *)MAP_FAILED)
+        munmap(f, size);
+    close(fd);
+    errno = k;
+
+    return ok;
+}
+
+/*
+ * savefile - Write @vm's program as a program file
+ * @vm: Code in m[0..b), entry point in $ip and stack pointer in $sp
+ * @path: Output file
+ * @data: Data sections to take from @vm's memory, or NULL
+ * @n: Number of data sections
+ * Returns: false with errno set on failure, EINVAL if the sections
+ *          overlap the code or each other
+ *
+ * The off fields of @data are ignored; sections are laid out here.
+ */
+bool savefile(VM *vm, const char *path, const Section *data, int n) {
+    int32 size, at;
+    Section *sect;
+    FileHdr *h;
+    FILE *out;
+    int8 *f;
+    bool ok;
+    int k;
+
+    if (!vm->b || vm $ip >= vm->b || n < 0 || n > 0xffff) {
+        errno = EINVAL;
+        return false;
+    }
+    at = alignup(sizeof(FileHdr) + n * sizeof(Section));
+    size = at + alignup(vm->b);
+    for (k = 0; k < n; k++) {
+        if ($4 data[k].addr + data[k].len > sizeof(Memory)) {
+            errno = EINVAL;
+            return false;
+        }
+        size += alignup(data[k].len);
+    }
+    if (!(f = (int8 *)calloc(1, size)))
+        return false;
+
+    h = (FileHdr *)f;
+    sect = (Section *)(h + 1);
+    copy($1 h->magic, $1 FILEMAGIC, 4);
+    h->version = (vm->enc == EncVar) ? 1 : FILEVERSION;
+    h->enc = vm->enc;
+    h->nsect = $2 n;
+    h->entry = vm $ip;
+    h->sp = vm $sp;
+    h->code = vm->b;
+    h->codeoff = at;
+    copy(f + at, vm->m, vm->b);
+    at += alignup(vm->b);
+    for (k = 0; k < n; k++) {
+        sect[k] = data[k];
+        sect[k].off = at;
+        copy(f + at, vm->m + data[k].addr, data[k].len);
+        at += alignup(data[k].len);
+    }
+
+    out = (FILE *)0;
+    errno = EINVAL;
+    ok = valid(f, size) && (out = fopen(path, "wb"))
+        && fwrite(f, 1, size, out) == size;
+    if (out && fclose(out))
+        ok = false;
+    free(f);
+
+    return ok;
+}
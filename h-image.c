@@ -0,0 +1,216 @@
+/*
+ * h-image.c - H-VM Shared Program Images
+ *
+ * An image is a program prepared once for any number of VMs. Its code
+ * lives in an anonymous file that each attached VM maps privately at
+ * address 0, so all of them read the same physical pages. Its micro-op
+ * cache, block cache and compiled code are built up front and only read
+ * after that, so attaching a VM costs a mapping: nothing is copied,
+ * verified, decoded or compiled per VM.
+ *
+ * Caches are shared only while nothing needs to change them. A VM that
+ * writes into its code, or needs a translation the image lacks, gets
+ * private caches from own() and carries on alone.
+ */
+
+#include "h-vm.h"
+#include <sys/mman.h>
+
+/*
+ * successors - Translate and link the successors of @blk the engines
+ * would link it to
+ * Returns: Whether a link was missing
+ */
+static bool successors(VM *vm, Block *blk) {
+    bool more;
+    Uop *u;
+
+    more = false;
+    u = &blk->u[blk->n - 1];
+    if (!blk->chain && blk->end <= vm->b && !(optable[u->o].f & OpStop)) {
+        blk->chain = block(vm, blk->end);
+        more = true;
+    }
+    if (!blk->jump && (optable[u->o].f & OpTarget) && u->imm <= vm->b) {
+        blk->jump = block(vm, u->imm);
+        more = true;
+    }
+
+    return more;
+}
+
+/*
+ * warm - Build every cache an attached VM can use
+ *
+ * Blocks are translated along the whole program and from every jump
+ * target, and linked as the engines would link them; execution only
+ * ever starts at address 0, where an earlier block ended, at a jump
+ * target or after a call.
+ */
+static void warm(VM *vm) {
+    Block *blk, *prev;
+    bool more;
+    int32 ip;
+    int n;
+
+    predecode(vm);
+    blockcache(vm);
+    free(vm->bc->ng);   /* Hit counts would be written by every VM */
+    vm->bc->ng = 0;
+
+    prev = (Block *)0;
+    for (ip = 0; ip <= vm->b; ip = blk->end) {
+        blk = block(vm, $2 ip);
+        if (prev)
+            prev->chain = blk;
+        prev = blk;
+        if (blk->end <= ip)
+            break;
+    }
+
+    /* Blocks translated here may need others in turn */
+    do {
+        more = false;
+        for (n = 0; n < BLOCKHASH; n++)
+            for (blk = vm->bc->h[n]; blk; blk = blk->hnext)
+                more |= successors(vm, blk);
+    } while (more);
+    jitall(vm);
+
+    return;
+}
+
+static Engine warmer = { "warm", warm };
+
+/*
+ * mkimage - Make an image of the program in @vm
+ * @vm: Program in m[0..b]; the image takes it over
+ * Returns: Image, or NULL if out of memory; @vm is then still the caller's
+ */
+Image *mkimage(VM *vm) {
+    Image *img;
+    size_t len;
+
+    len = pageup($4 vm->b + 1);
+    if (!(img = (Image *)malloc(sizeof(Image))))
+        return (Image *)0;
+    if (tryexecute(vm, &warmer) != NoErr
+            || (img->fd = memfd_create("hvm-image", MFD_CLOEXEC)) < 0) {
+        free(img);
+        return (Image *)0;
+    }
+    if (ftruncate(img->fd, len)
+            || pwrite(img->fd, vm->m, $4 vm->b + 1, 0) != $i vm->b + 1) {
+        close(img->fd);
+        free(img);
+        return (Image *)0;
+    }
+    img->vm = vm;
+    img->refs = 1;
+
+    return img;
+}
+
+/*
+ * holdimage - Take a reference to @img
+ * Returns: @img
+ */
+Image *holdimage(Image *img) {
+    __atomic_add_fetch(&img->refs, 1, __ATOMIC_RELAXED);
+
+    return img;
+}
+
+/*
+ * dropimage - Drop a reference to @img, freeing it with the last one
+ */
+void dropimage(Image *img) {
+    if (!img || __atomic_sub_fetch(&img->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    freevm(img->vm);
+    close(img->fd);
+    free(img);
+
+    return;
+}
+
+/*
+ * attach - Load @img into @vm
+ * Returns: false if the code could not be mapped
+ *
+ * Maps the code over @vm's first pages and points @vm's caches at the
+ * image's; the rest of memory and the registers are left alone.
+ */
+bool attach(VM *vm, Image *img) {
+    VM *src;
+
+    dropcaches(vm);
+    freeblocks(vm);
+    freejit(vm);
+    src = img->vm;
+    if (mmap(vm->m, pageup($4 src->b + 1), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, img->fd, 0) == MAP_FAILED)
+        return false;
+
+    vm->b = src->b;
+    vm->enc = src->enc;
+    vm->verified = src->verified;
+    if (vm->verified) {
+        dropstarts(vm->starts);
+        vm->starts = holdstarts(src->starts);
+    }
+    vm->uc = src->uc;
+    vm->bc = src->bc;
+    vm->jit = src->jit;
+    vm->img = holdimage(img);
+
+    return true;
+}
+
+/*
+ * detach - Stop using the caches of @vm's image, if any
+ *
+ * @vm is left with none; its memory is not changed.
+ */
+void detach(VM *vm) {
+    Image *img;
+
+    if (!(img = vm->img))
+        return;
+    vm->uc = (UC *)0;
+    vm->bc = (BC *)0;
+    vm->jit = (struct s_jit *)0;
+    vm->img = (Image *)0;
+    dropimage(img);
+
+    return;
+}
+
+/*
+ * own - Give @vm caches of its own before anything changes them
+ *
+ * Micro-ops are copied; blocks are translated again as they run. The
+ * new block cache starts at a later generation than the image's, so
+ * an engine holding an image block sees it as flushed.
+ */
+void own(VM *vm) {
+    Image *img;
+    int32 gen;
+    size_t n;
+    UC *uc;
+
+    if (!(img = vm->img))
+        return;
+    gen = img->vm->bc->gen;
+    n = sizeof(UC) + img->vm->uc->n * sizeof(Uop);
+    if ((uc = (UC *)malloc(n)))
+        copy($1 uc, $1 img->vm->uc, $i n);
+    detach(vm);
+    if (!(vm->uc = uc))
+        error(vm, ErrMem);
+    blockcache(vm);
+    vm->bc->gen = gen + 1;
+
+    return;
+}
@@ -0,0 +1,66 @@
+/*
+ * h-isa.h - H-VM Instruction Set
+ *
+ * Every fact about an opcode is written once, in the table below. Each
+ * row is expanded by the X-macro passed to ISA() into the opcode
+ * constants, the descriptor and handler tables, the label tables of the
+ * threaded engines and the assembler's mnemonics, so a new instruction
+ * or a changed encoding reaches all of them at once.
+ *
+ *   name   Opcode constant. The handler is __name, the engine label
+ *          l_name, and name_size / name_last are its size and last
+ *          opcode
+ *   op     Opcode byte
+ *   n      Consecutive opcodes the row covers
+ *   lay    Operand layout, which fixes the EncVar size
+ *   reg    Where the register comes from: RegOp rows have one opcode
+ *          per register (ax, bx, cx, dx), RegArg rows take a selector
+ *          operand checked at run time, RegNone rows have none
+ *   f      Opcode flags
+ *   mnem   Mnemonic
+ *
+ * Included by h-vm.h; rows refer to names it defines.
+ */
+
+#ifndef H_ISA_H
+#define H_ISA_H
+
+#define ISA(X) \
+    X(nop,    0x01, 1, LayNone,   RegNone, 0,        "nop")                            \
+    X(hlt,    0x02, 1, LayNone,   RegNone, OpHalt,   "hlt")                            \
+    X(mov,    0x08, 4, LayWord,   RegOp,   0,        "mov")  /* mov r, imm */          \
+    X(movsp,  0x0c, 1, LayWord,   RegNone, 0,        "mov")  /* mov sp, imm */         \
+    X(ld,     0x0d, 1, LayMem,    RegArg,  0,        "mov")  /* mov r, [base+off] */   \
+    X(st,     0x0e, 1, LayMem,    RegArg,  0,        "mov")  /* mov [base+off], r */   \
+    X(lea,    0x0f, 1, LayMem,    RegArg,  0,        "lea")  /* r = base+off */        \
+    X(ste,    0x10, 1, LayNone,   RegNone, 0,        "ste")  /* Set equal flag */      \
+    X(cle,    0x11, 1, LayNone,   RegNone, 0,        "cle")  /* Clear equal flag */    \
+    X(stg,    0x12, 1, LayNone,   RegNone, 0,        "stg")  /* Set greater-than */    \
+    X(clg,    0x13, 1, LayNone,   RegNone, 0,        "clg")  /* Clear greater-than */  \
+    X(sth,    0x14, 1, LayNone,   RegNone, 0,        "sth")  /* Set higher flag */     \
+    X(clh,    0x15, 1, LayNone,   RegNone, 0,        "clh")  /* Clear higher flag */   \
+    X(stl,    0x16, 1, LayNone,   RegNone, 0,        "stl")  /* Set lower flag */      \
+    X(cll,    0x17, 1, LayNone,   RegNone, 0,        "cll")  /* Clear lower flag */    \
+    X(push,   0x1a, 1, LayWord,   RegArg,  0,        "push")                           \
+    X(pop,    0x1b, 1, LayWord,   RegArg,  0,        "pop")                            \
+    X(add,    0x20, 1, LayRegImm, RegArg,  0,        "add")                            \
+    X(sub,    0x21, 1, LayRegImm, RegArg,  0,        "sub")                            \
+    X(mul,    0x22, 1, LayRegImm, RegArg,  0,        "mul")                            \
+    X(div_op, 0x23, 1, LayRegImm, RegArg,  0,        "div")  /* div is reserved */     \
+    X(inc,    0x24, 1, LayByte,   RegArg,  0,        "inc")                            \
+    X(dec,    0x25, 1, LayByte,   RegArg,  0,        "dec")                            \
+    X(cmp,    0x26, 1, LayRegImm, RegArg,  0,        "cmp")  /* Flags of r - imm */    \
+    X(jmp,    0x30, 1, LayWord,   RegNone, OpGoto,   "jmp")  /* jmp target */          \
+    X(je,     0x31, 1, LayWord,   RegNone, OpBranch, "je")   /* Jump if equal */       \
+    X(jne,    0x32, 1, LayWord,   RegNone, OpBranch, "jne")                            \
+    X(jg,     0x33, 1, LayWord,   RegNone, OpBranch, "jg")   /* Jump if greater */     \
+    X(jng,    0x34, 1, LayWord,   RegNone, OpBranch, "jng")                            \
+    X(jz,     0x35, 1, LayWord,   RegNone, OpBranch, "jz")   /* Jump if zero */        \
+    X(jnz,    0x36, 1, LayWord,   RegNone, OpBranch, "jnz")                            \
+    X(jc,     0x37, 1, LayWord,   RegNone, OpBranch, "jc")   /* Jump if carry */       \
+    X(jnc,    0x38, 1, LayWord,   RegNone, OpBranch, "jnc")                            \
+    X(call,   0x39, 1, LayWord,   RegNone, OpBranch, "call") /* Push return address */ \
+    X(ret,    0x3a, 1, LayNone,   RegNone, OpRet,    "ret")                            \
+    X(loop,   0x3b, 1, LayWord,   RegNone, OpBranch, "loop") /* Jump if --cx != 0 */
+
+#endif /* H_ISA_H */
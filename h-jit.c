@@ -0,0 +1,819 @@
+/*
+ * h-jit.c - H-VM x86-64 JIT Compiler
+ *
+ * Compiles the longest supported prefix of each translated basic block
+ * into native code. Guest AX/BX/CX/DX live in r8d-r11d for the whole
+ * block, and the pending Z/C record is only stored when the block exits.
+ * Anything the compiler does not handle, and every guard that fails at
+ * run time, returns to the interpreter at the instruction concerned, so
+ * faults are always raised by the reference handlers. A block ending in
+ * a jump back to its own start loops in native code, charging the
+ * budget for each round as the interpreter would.
+ *
+ * Set HVM_NOJIT=1 to run the jit engine without compiling anything.
+ */
+
+#include "h-vm.h"
+#include <stddef.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#define JITSIZE     (256 * 1024)    /* Code arena per VM */
+#define JITBLOCK    (16 * 1024)     /* Upper bound for one compiled block */
+#define MEMOPSIZE   9   /* Bytes of the movzx or mov of a compiled ld or st */
+
+/* Native block return codes */
+#define JitDone     0   /* Stopped at vm $ip */
+#define JitStored   1   /* Stopped after a push or store into code memory */
+#define JitJumped   2   /* Stopped at the target of the block's last jump */
+
+struct s_jit {
+    int8 *code;     /* Arena base */
+    int32 used;     /* Bytes handed out */
+    bool off;       /* Interpreter-only mode */
+};
+typedef struct s_jit JIT;
+
+#if defined(__x86_64__)
+
+/*
+ * Pending Z/C state: which rule derives them from the result in esi.
+ * Values match enum e_lazy so exits store them as they are.
+ */
+enum e_pending {
+    PendNone = LazyNone,    /* Lazy record in memory is current */
+    PendAdd = LazyAdd,      /* C = esi > 0xffff (add, mul, inc) */
+    PendSub = LazySub,      /* C = (int)esi < 0 (sub, dec) */
+    PendDiv = LazyDiv       /* C = 0 (div) */
+};
+typedef enum e_pending Pending;
+
+/* Known state of the H/L flags at a point in the block */
+enum e_hl {
+    HLUnknown = 0,
+    HLClear,
+    HLSet
+};
+typedef enum e_hl HL;
+
+/* Side exit recorded while emitting, materialized after the block body */
+struct s_exit {
+    int32 at;       /* Offset of the rel32 to patch */
+    int32 tail;     /* Offset of the stub's rel32 to the shared tail */
+    int16 ip;       /* Guest IP to resume at */
+    Pending p;      /* Z/C state at the exit */
+    int8 st;        /* Return code */
+};
+typedef struct s_exit Exit;
+
+/* Emitter state */
+struct s_asm {
+    int8 *p;        /* Start of the block's code */
+    int32 n;        /* Bytes emitted */
+    Exit x[BLOCKMAX * 4 + 2];
+    int16 nx;
+    int32 top;      /* Offset of the code for the first instruction */
+    int32 loop;     /* Offset of the rel32 jumping back to top, or 0 */
+    Pending lp;     /* Z/C state at that jump */
+};
+typedef struct s_asm Asm;
+
+#define StubMax     64  /* Upper bound for one exit stub */
+
+#define off(f)      ($4 offsetof(VM, f))
+#define OffAX       off(c.r.ax)
+#define OffSP       off(c.r.sp)
+#define OffIP       off(c.r.ip)
+#define OffFlags    off(c.r.flags)
+#define OffLazyRes  off(c.lf.res)
+#define OffLazyOp   off(c.lf.op)
+#define OffM        off(m)
+#define OffB        off(b)
+#define OffFuel     off(fuel)
+
+static void e1(Asm *a, int8 x) {
+    a->p[a->n++] = x;
+}
+
+static void e4(Asm *a, int32 x) {
+    copy(a->p + a->n, $1 &x, 4);
+    a->n += 4;
+}
+
+static void e2(Asm *a, int16 x) {
+    copy(a->p + a->n, $1 &x, 2);
+    a->n += 2;
+}
+
+/* Guest register n lives in r(8+n)d; "d" means the [rdi+disp32] form */
+#define rex_r       0x44
+#define rex_b       0x41
+#define modrm_d(r)  (0x80 | (((r) & 7) << 3) | 7)
+
+#define JB  0x82
+#define JE  0x84
+#define JNE 0x85
+#define JBE 0x86
+#define JA  0x87
+#define JS  0x88
+#define JNS 0x89
+#define JL  0x8c
+#define JMP 0x00    /* Pseudo condition: unconditional */
+
+/* Opcode of jcc rel32 (or jmp rel32); the rel32 is left to the caller */
+static void jcc(Asm *a, int8 cc) {
+    if (cc == JMP)
+        e1(a, 0xe9);
+    else {
+        e1(a, 0x0f);
+        e1(a, cc);
+    }
+}
+
+/* rel32 of a side exit resuming at @ip, patched in after the body */
+static void exitrel(Asm *a, int16 ip, Pending p, int8 st) {
+    Exit *x;
+
+    x = &a->x[a->nx++];
+    x->at = a->n;
+    x->ip = ip;
+    x->p = p;
+    x->st = st;
+    e4(a, 0);
+}
+
+/* jcc rel32 (or jmp rel32) to a side exit resuming at @ip */
+static void jexit(Asm *a, int8 cc, int16 ip, Pending p, int8 st) {
+    jcc(a, cc);
+    exitrel(a, ip, p, st);
+}
+
+/*
+ * faultexit - Side exit for a guard page fault of the access just
+ * emitted, which must be MEMOPSIZE bytes: nopl [rax+rel32], whose
+ * displacement jitfault() follows to the stub
+ */
+static void faultexit(Asm *a, int16 ip, Pending p) {
+    e1(a, 0x0f); e1(a, 0x1f); e1(a, 0x80);
+    exitrel(a, ip, p, JitDone);
+}
+
+/* test byte [flags], 3 ; jnz exit */
+static void guardhl(Asm *a, int16 ip, Pending p) {
+    e1(a, 0xf6); e1(a, 0x87); e4(a, OffFlags); e1(a, 0x03);
+    jexit(a, JNE, ip, p, JitDone);
+}
+
+/* or/and word [flags], imm8 */
+static void flagop(Asm *a, int8 ext, int8 imm) {
+    e1(a, 0x66); e1(a, 0x83); e1(a, 0x80 | (ext << 3) | 7);
+    e4(a, OffFlags); e1(a, imm);
+}
+#define orflags(a, x)   flagop((a), 1, (x))
+#define andflags(a, x)  flagop((a), 4, (x))
+
+/* movzx r(8+n)d, si - store a result and keep esi for the flags */
+static void result(Asm *a, int8 n) {
+    e1(a, rex_r); e1(a, 0x0f); e1(a, 0xb7); e1(a, 0xc0 | (n << 3) | 6);
+}
+
+/* mov eax, effective address of LayMem micro-op @u */
+static void memaddr(Asm *a, Uop *u) {
+    if (u->base > 3) {
+        e1(a, 0xb8); e4(a, u->imm);
+        return;
+    }
+
+    /* lea eax, [r(8+base) + disp32] ; movzx eax, ax */
+    e1(a, rex_b); e1(a, 0x8d); e1(a, 0x80 | u->base); e4(a, u->imm);
+    e1(a, 0x0f); e1(a, 0xb7); e1(a, 0xc0);
+}
+
+/* mov byte [lazy op], imm8 */
+static void setlazy(Asm *a, Pending p) {
+    e1(a, 0xc6); e1(a, 0x87); e4(a, OffLazyOp); e1(a, p);
+}
+
+/* Store pending Z/C as the lazy record, as setarith() would have */
+static void materialize(Asm *a, Pending p) {
+    if (p == PendNone)
+        return;
+
+    /* mov [lazy res], esi */
+    e1(a, 0x89); e1(a, 0xb7); e4(a, OffLazyRes);
+    setlazy(a, p);
+}
+
+/*
+ * jumpto - jcc (or jmp) for the taken side of a jump to @to with Z/C
+ * state @p: back to the top for the start of @blk, out otherwise
+ */
+static void jumpto(Asm *a, Block *blk, int8 cc, int16 to, Pending p) {
+    if (to != blk->ip) {
+        jexit(a, cc, to, p, JitJumped);
+        return;
+    }
+
+    jcc(a, cc);
+    a->loop = a->n;
+    a->lp = p;
+    e4(a, 0);
+}
+
+/*
+ * compile - Emit native code for a prefix of @blk
+ * Returns: Number of micro-ops compiled
+ */
+static int16 compile(Block *blk, Asm *a) {
+    int16 ip, k, n;
+    Pending p;
+    int32 at;
+    int8 o, cc;
+    Uop *u;
+    HL hl;
+
+    p = PendNone;
+    hl = HLUnknown;
+    ip = blk->ip;
+
+    /* movzx r8d..r11d, word [rdi+ax..dx] */
+    for (n = 0; n < 4; n++) {
+        e1(a, rex_r); e1(a, 0x0f); e1(a, 0xb7); e1(a, modrm_d(n));
+        e4(a, OffAX + 2 * n);
+    }
+    a->top = a->n;
+
+    for (k = 0; k < blk->n; ip = u->next, k++) {
+        u = &blk->u[k];
+        n = u->r;
+        o = unfused(u);     /* Fused parts are compiled one by one */
+        switch (o) {
+            case nop:
+                break;
+
+            case ste: orflags(a, 0x08); break;
+            case stg: orflags(a, 0x04); break;
+            case sth: orflags(a, 0x02); hl = HLSet; break;
+            case stl: orflags(a, 0x01); hl = HLSet; break;
+
+            /* The clear masks also drop Z/C, pending or not */
+            case cle:
+                andflags(a, 0x07);
+                setlazy(a, PendNone);
+                p = PendNone;
+                break;
+            case clg:
+                andflags(a, 0x0c);
+                setlazy(a, PendNone);
+                p = PendNone;
+                hl = HLClear;
+                break;
+            case clh:
+                andflags(a, 0x0d);
+                setlazy(a, PendNone);
+                p = PendNone;
+                if (hl == HLSet)
+                    hl = HLUnknown;
+                break;
+            case cll:
+                andflags(a, 0x0e);
+                setlazy(a, PendNone);
+                p = PendNone;
+                if (hl == HLSet)
+                    hl = HLUnknown;
+                break;
+
+            case mov ... mov_last:
+                if (hl == HLSet)
+                    goto stop;
+                if (hl == HLUnknown)
+                    guardhl(a, ip, p);
+                hl = HLClear;
+                /* mov r(8+n)d, imm32 */
+                e1(a, rex_b); e1(a, 0xb8 | n); e4(a, u->imm);
+                break;
+
+            /*
+             * A word at 0xffff is left to the interpreter, which faults.
+             * Without guardpage() the address is tested for; with it,
+             * the access faults in the guard page and jitfault() sends
+             * it to the side exit, which stores r8d-r11d first.
+             */
+            case ld:
+            case st:
+                if (n > 3 || hl == HLSet || (u->base > 3 && u->imm == 0xffff))
+                    goto stop;
+                if (hl == HLUnknown)
+                    guardhl(a, ip, p);
+                hl = HLClear;
+                memaddr(a, u);
+                if (u->base < 4 && !guarded) {
+                    /* cmp eax, 0xffff ; je exit */
+                    e1(a, 0x3d); e4(a, 0xffff);
+                    jexit(a, JE, ip, p, JitDone);
+                }
+                if (o == ld) {
+                    /* movzx r(8+n)d, word [rdi+rax+m] */
+                    e1(a, rex_r); e1(a, 0x0f); e1(a, 0xb7);
+                    e1(a, 0x84 | (n << 3)); e1(a, 0x07); e4(a, OffM);
+                    if (u->base < 4 && guarded)
+                        faultexit(a, ip, p);
+                    break;
+                }
+                /* mov [rdi+rax+m], r(8+n)w */
+                e1(a, 0x66); e1(a, rex_r); e1(a, 0x89);
+                e1(a, 0x84 | (n << 3)); e1(a, 0x07); e4(a, OffM);
+                if (u->base < 4 && guarded)
+                    faultexit(a, ip, p);
+                /* movzx ecx, word [b] ; cmp eax, ecx ; jbe stored-exit */
+                e1(a, 0x0f); e1(a, 0xb7); e1(a, 0x8f); e4(a, OffB);
+                e1(a, 0x39); e1(a, 0xc8);
+                jexit(a, JBE, u->next, p, JitStored);
+                break;
+
+            case lea:
+                if (n > 3)
+                    goto stop;
+                if (u->base > 3) {
+                    /* mov r(8+n)d, imm32 */
+                    e1(a, rex_b); e1(a, 0xb8 | n); e4(a, u->imm);
+                    break;
+                }
+                /* movzx r(8+n)d, ax */
+                memaddr(a, u);
+                e1(a, rex_r); e1(a, 0x0f); e1(a, 0xb7); e1(a, 0xc0 | (n << 3));
+                break;
+
+            case movsp:
+                if (hl == HLSet)
+                    goto stop;
+                if (hl == HLUnknown) {
+                    /* movzx eax, byte [flags] ; and eax, 3 ; cmp eax, 3 */
+                    e1(a, 0x0f); e1(a, 0xb6); e1(a, 0x87); e4(a, OffFlags);
+                    e1(a, 0x83); e1(a, 0xe0); e1(a, 0x03);
+                    e1(a, 0x83); e1(a, 0xf8); e1(a, 0x03);
+                    jexit(a, JE, ip, p, JitDone);
+                }
+                /* mov word [sp], imm16 */
+                e1(a, 0x66); e1(a, 0xc7); e1(a, 0x87); e4(a, OffSP);
+                e2(a, u->imm);
+                break;
+
+            case push:
+                if (n > 3 || hl == HLSet)
+                    goto stop;
+                if (hl == HLUnknown)
+                    guardhl(a, ip, p);
+                hl = HLClear;
+                /* movzx eax, word [sp] ; cmp eax, 2 ; jb exit */
+                e1(a, 0x0f); e1(a, 0xb7); e1(a, 0x87); e4(a, OffSP);
+                e1(a, 0x83); e1(a, 0xf8); e1(a, 0x02);
+                jexit(a, JB, ip, p, JitDone);
+                /* movzx ecx, word [b] ; sub ecx, 2 ; cmp eax, ecx ; jl exit */
+                e1(a, 0x0f); e1(a, 0xb7); e1(a, 0x8f); e4(a, OffB);
+                e1(a, 0x83); e1(a, 0xe9); e1(a, 0x02);
+                e1(a, 0x39); e1(a, 0xc8);
+                jexit(a, JL, ip, p, JitDone);
+                /* sub eax, 2 ; mov [sp], ax ; mov [rdi+rax+m], r(8+n)w */
+                e1(a, 0x83); e1(a, 0xe8); e1(a, 0x02);
+                e1(a, 0x66); e1(a, 0x89); e1(a, 0x87); e4(a, OffSP);
+                e1(a, 0x66); e1(a, rex_r); e1(a, 0x89);
+                e1(a, 0x84 | (n << 3)); e1(a, 0x07); e4(a, OffM);
+                /* add ecx, 2 ; cmp eax, ecx ; jbe stored-exit */
+                e1(a, 0x83); e1(a, 0xc1); e1(a, 0x02);
+                e1(a, 0x39); e1(a, 0xc8);
+                jexit(a, JBE, u->next, p, JitStored);
+                break;
+
+            case pop:
+                if (n > 3 || hl == HLSet)
+                    goto stop;
+                if (hl == HLUnknown)
+                    guardhl(a, ip, p);
+                hl = HLClear;
+                /* movzx eax, word [sp] ; cmp eax, 0xfffd ; ja exit */
+                e1(a, 0x0f); e1(a, 0xb7); e1(a, 0x87); e4(a, OffSP);
+                e1(a, 0x3d); e4(a, 0xfffd);
+                jexit(a, JA, ip, p, JitDone);
+                /* movzx r(8+n)d, word [rdi+rax+m] ; add eax, 2 ; mov [sp], ax */
+                e1(a, rex_r); e1(a, 0x0f); e1(a, 0xb7);
+                e1(a, 0x84 | (n << 3)); e1(a, 0x07); e4(a, OffM);
+                e1(a, 0x83); e1(a, 0xc0); e1(a, 0x02);
+                e1(a, 0x66); e1(a, 0x89); e1(a, 0x87); e4(a, OffSP);
+                break;
+
+            case add:
+            case sub:
+            case inc:
+            case dec:
+                if (n > 3)
+                    goto stop;
+                /* lea esi, [r(8+n) + disp32] */
+                e1(a, rex_b); e1(a, 0x8d); e1(a, 0xb0 | n);
+                switch (o) {
+                    case add: e4(a, u->imm); p = PendAdd; break;
+                    case sub: e4(a, -$4 u->imm); p = PendSub; break;
+                    case inc: e4(a, 1); p = PendAdd; break;
+                    default:  e4(a, -1); p = PendSub; break;
+                }
+                result(a, n);
+                break;
+
+            case mul:
+                if (n > 3)
+                    goto stop;
+                /* imul esi, r(8+n)d, imm32 */
+                e1(a, rex_b); e1(a, 0x69); e1(a, 0xf0 | n); e4(a, u->imm);
+                result(a, n);
+                p = PendAdd;
+                break;
+
+            case div_op:
+                if (n > 3 || !u->imm)
+                    goto stop;
+                /* mov eax, r(8+n)d ; xor edx, edx ; mov ecx, imm32 ;
+                 * div ecx ; mov esi, eax */
+                e1(a, rex_r); e1(a, 0x89); e1(a, 0xc0 | (n << 3));
+                e1(a, 0x31); e1(a, 0xd2);
+                e1(a, 0xb9); e4(a, u->imm);
+                e1(a, 0xf7); e1(a, 0xf1);
+                e1(a, 0x89); e1(a, 0xc6);
+                result(a, n);
+                p = PendDiv;
+                break;
+
+            case cmp:
+                if (n > 3)
+                    goto stop;
+                /* and word [flags], 3 ; xor eax, eax ; xor ecx, ecx */
+                andflags(a, 0x03);
+                e1(a, 0x31); e1(a, 0xc0);
+                e1(a, 0x31); e1(a, 0xc9);
+                /* cmp r(8+n)d, imm32 ; sete al ; seta cl */
+                e1(a, rex_b); e1(a, 0x81); e1(a, 0xf8 | n); e4(a, u->imm);
+                e1(a, 0x0f); e1(a, 0x94); e1(a, 0xc0);
+                e1(a, 0x0f); e1(a, 0x97); e1(a, 0xc1);
+                /* shl eax, 3 ; shl ecx, 2 ; or eax, ecx ; or [flags], ax */
+                e1(a, 0xc1); e1(a, 0xe0); e1(a, 0x03);
+                e1(a, 0xc1); e1(a, 0xe1); e1(a, 0x02);
+                e1(a, 0x09); e1(a, 0xc8);
+                e1(a, 0x66); e1(a, 0x09); e1(a, 0x87); e4(a, OffFlags);
+                /* lea esi, [r(8+n) - imm] */
+                e1(a, rex_b); e1(a, 0x8d); e1(a, 0xb0 | n); e4(a, -$4 u->imm);
+                p = PendSub;
+                break;
+
+            /* E and G are never pending */
+            case je:
+            case jne:
+            case jg:
+            case jng:
+                /* test byte [flags], E or G */
+                e1(a, 0xf6); e1(a, 0x87); e4(a, OffFlags);
+                e1(a, (o == je || o == jne) ? 0x08 : 0x04);
+                jumpto(a, blk, (o == je || o == jg) ? JNE : JE, u->imm, p);
+                break;
+
+            /* Z and C are tested in esi, so only while they are pending */
+            case jz:
+            case jnz:
+                if (p == PendNone)
+                    goto stop;
+                /* test si, si */
+                e1(a, 0x66); e1(a, 0x85); e1(a, 0xf6);
+                jumpto(a, blk, (o == jz) ? JE : JNE, u->imm, p);
+                break;
+
+            case jc:
+            case jnc:
+                if (p == PendNone)
+                    goto stop;
+                if (p == PendDiv) {
+                    if (o == jnc)
+                        jumpto(a, blk, JMP, u->imm, p);
+                    break;
+                }
+                if (p == PendAdd) {
+                    /* cmp esi, 0xffff */
+                    e1(a, 0x81); e1(a, 0xfe); e4(a, 0xffff);
+                    cc = (o == jc) ? JA : JBE;
+                } else {
+                    /* test esi, esi */
+                    e1(a, 0x85); e1(a, 0xf6);
+                    cc = (o == jc) ? JS : JNS;
+                }
+                jumpto(a, blk, cc, u->imm, p);
+                break;
+
+            case jmp:
+                jumpto(a, blk, JMP, u->imm, p);
+                break;
+
+            case loop:
+                /* sub r10w, 1 */
+                e1(a, 0x66); e1(a, rex_b); e1(a, 0x83); e1(a, 0xea); e1(a, 0x01);
+                jumpto(a, blk, JNE, u->imm, p);
+                break;
+
+            /* Faults and pushes into code are left to the interpreter */
+            case call:
+                /* movzx eax, word [sp] ; movzx ecx, word [b] ; add ecx, 2 ;
+                 * cmp eax, ecx ; jbe exit */
+                e1(a, 0x0f); e1(a, 0xb7); e1(a, 0x87); e4(a, OffSP);
+                e1(a, 0x0f); e1(a, 0xb7); e1(a, 0x8f); e4(a, OffB);
+                e1(a, 0x83); e1(a, 0xc1); e1(a, 0x02);
+                e1(a, 0x39); e1(a, 0xc8);
+                jexit(a, JBE, ip, p, JitDone);
+                /* sub eax, 2 ; mov [sp], ax ; mov word [rdi+rax+m], imm16 */
+                e1(a, 0x83); e1(a, 0xe8); e1(a, 0x02);
+                e1(a, 0x66); e1(a, 0x89); e1(a, 0x87); e4(a, OffSP);
+                e1(a, 0x66); e1(a, 0xc7); e1(a, 0x84); e1(a, 0x07); e4(a, OffM);
+                e2(a, u->next);
+                jumpto(a, blk, JMP, u->imm, p);
+                break;
+
+            default:
+                goto stop;
+        }
+
+        /* Room for one more instruction, its exits and the tail */
+        if (a->n + (a->nx + 5) * StubMax + 512 > JITBLOCK)
+            break;
+    }
+stop:
+    if (!k)
+        return 0;
+    jexit(a, JMP, ip, p, JitDone);
+
+    /* Back to the top: charge the next round, or stop when it is due */
+    if (a->loop) {
+        copy(a->p + a->loop, $1 &(int32){ a->n - (a->loop + 4) }, 4);
+        materialize(a, a->lp);
+        /* cmp qword [fuel], k ; jb exit ; sub qword [fuel], k ; jmp top */
+        e1(a, 0x48); e1(a, 0x83); e1(a, 0xbf); e4(a, OffFuel); e1(a, k);
+        jexit(a, JB, blk->ip, PendNone, JitJumped);
+        e1(a, 0x48); e1(a, 0x83); e1(a, 0xaf); e4(a, OffFuel); e1(a, k);
+        e1(a, 0xe9); e4(a, a->top - (a->n + 4));
+    }
+
+    /* Exit stubs: flags, resume IP, return code, then the shared tail */
+    for (n = 0; n < a->nx; n++) {
+        at = a->n;
+        materialize(a, a->x[n].p);
+        e1(a, 0x66); e1(a, 0xc7); e1(a, 0x87); e4(a, OffIP);
+        e2(a, a->x[n].ip);
+        e1(a, 0xb8); e4(a, a->x[n].st);
+        e1(a, 0xe9); e4(a, 0);
+        a->x[n].tail = a->n - 4;
+        copy(a->p + a->x[n].at, $1 &(int32){ at - (a->x[n].at + 4) }, 4);
+    }
+
+    /* Tail: mov word [ax..dx], r8w..r11w ; ret */
+    at = a->n;
+    for (n = 0; n < 4; n++) {
+        e1(a, 0x66); e1(a, rex_r); e1(a, 0x89); e1(a, modrm_d(n));
+        e4(a, OffAX + 2 * n);
+    }
+    e1(a, 0xc3);
+    for (n = 0; n < a->nx; n++)
+        copy(a->p + a->x[n].tail, $1 &(int32){ at - (a->x[n].tail + 4) }, 4);
+
+    return k;
+}
+
+/*
+ * jitblock - Compile @blk into the VM's code arena
+ *
+ * Leaves blk->native NULL when not even the first instruction can be
+ * compiled; the block is then interpreted.
+ */
+static void jitblock(VM *vm, Block *blk) {
+    int16 n;
+    Asm a;
+    JIT *j;
+
+    j = vm->jit;
+    blk->jitted = true;
+    if (j->off || j->used + JITBLOCK > JITSIZE)
+        return;
+
+    if (mprotect(j->code, JITSIZE, PROT_READ | PROT_WRITE))
+        return;
+    a.p = j->code + j->used;
+    a.n = 0;
+    a.nx = 0;
+    a.loop = 0;
+    if ((n = compile(blk, &a))) {
+        blk->native = (int (*)(VM *))(void *)a.p;
+        blk->jn = n;
+        j->used += (a.n + 15) & ~15;
+    }
+    mprotect(j->code, JITSIZE, PROT_READ | PROT_EXEC);
+
+    return;
+}
+
+/*
+ * jitfault - Send a guard page fault of compiled code to its side exit
+ * @ctx: Signal context of the fault
+ * Returns: true if it was a compiled ld or st, now resuming at the stub
+ *
+ * Called from onguard(). The stub stores the guest registers and
+ * returns to executejit() at the instruction, which the interpreter
+ * then runs and faults on as the guest's.
+ */
+bool jitfault(VM *vm, void *ctx) {
+    ucontext_t *uc;
+    int8 *pc;
+    int32 rel;
+    JIT *j;
+
+    uc = (ucontext_t *)ctx;
+    pc = (int8 *)uc->uc_mcontext.gregs[REG_RIP];
+    j = vm->jit;
+    if (!j || pc < j->code || pc >= j->code + JITSIZE)
+        return false;
+    pc += MEMOPSIZE;
+    if (pc[0] != 0x0f || pc[1] != 0x1f || pc[2] != 0x80)
+        return false;
+    copy($1 &rel, pc + 3, 4);
+    uc->uc_mcontext.gregs[REG_RIP] = (greg_t)(pc + 7 + rel);
+
+    return true;
+}
+
+#else /* !__x86_64__ */
+
+static void jitblock(VM *vm, Block *blk) {
+    blk->jitted = true;
+}
+
+bool jitfault(VM *vm, void *ctx) {
+    return false;
+}
+
+#endif
+
+/*
+ * freejit - Release the JIT code arena of @vm
+ */
+void freejit(VM *vm) {
+    if (!vm->jit)
+        return;
+
+    munmap(vm->jit->code, JITSIZE);
+    free(vm->jit);
+    vm->jit = (JIT *)0;
+
+    return;
+}
+
+/*
+ * mkjit - Attach a JIT code arena to @vm
+ */
+static void mkjit(VM *vm) {
+    JIT *j;
+    char *env;
+
+    j = (JIT *)malloc(sizeof(JIT));
+    if (!j)
+        error(vm, ErrMem);
+    j->code = mmap(0, JITSIZE, PROT_READ | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED)
+        error(vm, ErrMem);
+    j->used = 0;
+    env = getenv("HVM_NOJIT");
+    j->off = (env && *env && *env != '0');
+    vm->jit = j;
+
+    return;
+}
+
+/*
+ * jitall - Compile every block in @vm's cache not compiled yet
+ */
+void jitall(VM *vm) {
+    Block *blk;
+    int n;
+
+    if (!vm->jit)
+        mkjit(vm);
+    for (n = 0; n < BLOCKHASH; n++)
+        for (blk = vm->bc->h[n]; blk; blk = blk->hnext)
+            if (!blk->jitted)
+                jitblock(vm, blk);
+
+    return;
+}
+
+/*
+ * storedat - Address written by the push or store that returned
+ * JitStored from @blk's native code
+ *
+ * The store leaves the registers it used as they were, so its address
+ * can be worked out again from where the block stopped.
+ */
+static int16 storedat(VM *vm, Block *blk) {
+    int16 k;
+
+    for (k = 0; k < blk->jn; k++)
+        if (blk->u[k].o == st && blk->u[k].next == vm $ip)
+            return uopaddr(vm, &blk->u[k]);
+
+    return vm $sp;
+}
+
+/*
+ * retired - Instructions of @blk's native prefix that ran before it
+ * returned @st with vm $ip where it stopped
+ *
+ * Every exit resumes at an address the block recorded when it was
+ * translated, so the count comes from the block and not from code
+ * memory, which the prefix may have stored into. A jump out, or back
+ * to the top, leaves only after the whole prefix has run.
+ */
+static int16 retired(VM *vm, Block *blk, int st) {
+    int16 k;
+
+    if (st == JitJumped)
+        return blk->jn;
+    for (k = 0; k < blk->jn; k++)
+        if (blk->u[k].next == vm $ip)
+            return k + 1;
+
+    return 0;
+}
+
+/*
+ * executejit - Execution loop running compiled blocks
+ * @vm: VM instance
+ *
+ * Same semantics as execute(). Blocks come from the block cache and are
+ * compiled on first use; whatever native code does not cover is run one
+ * instruction at a time by execinstr().
+ */
+void executejit(VM *vm) {
+    int16 ip, end, jn, n;
+    Block *blk, *prev;
+    int32 gen;
+    int8 size;
+    int st;
+
+    assert(vm && *vm->m);
+    blockcache(vm);
+    prev = (Block *)0;
+
+    for (;;) {
+        /* An image's blocks are all compiled; its arena is left alone */
+        if (!vm->jit)
+            mkjit(vm);
+        if (!vm->img && vm->jit->used + JITBLOCK > JITSIZE) {
+            flushblocks(vm);
+            vm->jit->used = 0;
+            prev = (Block *)0;
+        }
+
+        blk = prev ? chained(prev, vm $ip) : (Block *)0;
+        if (!blk) {
+            if (vm->img && vm $ip <= vm->b && !cached(vm, vm $ip))
+                goto step;
+            blk = block(vm, vm $ip);
+            if (prev && !vm->img)
+                linkblock(prev, blk);
+        }
+        if (!blk->jitted)
+            jitblock(vm, blk);
+
+        gen = vm->bc->gen;
+        prev = (Block *)0;
+        if (blk->native) {
+            /* Charged up front; the last partial block runs one by one */
+            if (vm->fuel < blk->jn) {
+                execute(vm);
+                return;
+            }
+            vm->fuel -= blk->jn;
+
+            /* A store into code frees blk; refund what did not run first */
+            ip = blk->ip;
+            end = blk->end;
+            jn = blk->jn;
+            st = blk->native(vm);
+            if ((n = retired(vm, blk, st)) < jn)
+                vm->fuel += jn - n;
+            if (st == JitStored)
+                codewrite(vm, storedat(vm, blk), 2);
+            if (st == JitJumped || vm $ip != ip) {
+                if ((st == JitJumped || vm $ip == end) && gen == vm->bc->gen)
+                    prev = blk;
+                continue;
+            }
+        }
+
+step:
+        burn(vm);
+        size = execinstr(vm, vm->m + vm $ip);
+        vm $ip += size;
+    }
+}
@@ -0,0 +1,544 @@
+/*
+ * h-lib.c - H-VM Embedding API (libhvm)
+ *
+ * Wraps a VM with the program it was loaded with, so runs can be
+ * repeated on the same VM: hvmreset() puts memory and registers back in
+ * their load state, releasing the pages the run wrote, and caches
+ * survive unless the guest modified its own code. Programs loaded from
+ * an HVMImage share code pages and caches with every other VM loaded
+ * from it.
+ */
+
+#include "h-vm.h"
+#include "hvm.h"
+
+_Static_assert(HvmHalt == SysHlt && HvmNoMem == ErrMem &&
+    HvmSegv == ErrSegv && HvmInstr == ErrInstr && HvmFuel == SysFuel,
+    "status codes");
+
+struct s_hvm {
+    VM *vm;
+    int8 *code;     /* Program as loaded, or NULL */
+    int16 len;
+    HVMSnap *snap;  /* Snapshot forked from, or NULL */
+    Image *img;     /* Image loaded from, or NULL */
+};
+
+struct s_hvmimage {
+    Image *i;
+};
+
+struct s_hvmsnap {
+    Snap *s;
+    int refs;       /* The handle and each fork */
+};
+
+/* release - Drop a reference to @s */
+static void release(HVMSnap *s) {
+    if (s && !__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL)) {
+        freesnap(s->s);
+        free(s);
+    }
+
+    return;
+}
+
+/* loaded - Whether @h has a program to run */
+static bool loaded(HVM *h) {
+    return h->code || h->snap || h->img;
+}
+
+/* unload - Forget @h's program and what was translated from it */
+static void unload(HVM *h) {
+    free(h->code);
+    h->code = (int8 *)0;
+    h->len = 0;
+    release(h->snap);
+    h->snap = (HVMSnap *)0;
+    dropimage(h->img);
+    h->img = (Image *)0;
+    dropcaches(h->vm);
+
+    return;
+}
+
+/*
+ * setup - Registers and memory of a freshly loaded program
+ * Returns: false if memory could not be mapped
+ *
+ * Memory past the code is released rather than zeroed, so a VM holds
+ * only the pages its runs touch.
+ */
+static bool setup(HVM *h) {
+    VM *vm;
+
+    vm = h->vm;
+    if (!wipe(vm))
+        return false;
+    if (h->img) {
+        if (!attach(vm, h->img))
+            return false;
+    } else
+        copy(vm->m, h->code, h->len);
+    zero($1 &vm->c, sizeof(CPU));
+    vm $sp = 0xffff;
+
+    return true;
+}
+
+/*
+ * hvmnew - Create a VM with no program loaded
+ * Returns: Handle, or NULL if out of memory
+ */
+HVM *hvmnew(void) {
+    HVM *h;
+
+    if (!(h = (HVM *)calloc(1, sizeof(HVM))))
+        return (HVM *)0;
+    if (!(h->vm = virtualmachine())) {
+        free(h);
+        return (HVM *)0;
+    }
+
+    return h;
+}
+
+/*
+ * hvmload - Load and verify a program, replacing any previous one
+ * @h: VM
+ * @code: Program, run from address 0
+ * @len: Size in bytes
+ * @err: Filled in when the program is rejected; may be NULL
+ * Returns: HvmOk, HvmRejected or HvmNoMem
+ */
+int hvmload(HVM *h, const void *code, size_t len, HVMError *err) {
+    VErr e;
+    VM *vm;
+
+    vm = h->vm;
+    unload(h);
+
+    if (!len || len >= sizeof(Memory)) {
+        if (err) {
+            err->ip = 0;
+            snprintf(err->why, sizeof(err->why), "bad program size %zu", len);
+        }
+        return HvmRejected;
+    }
+    if (!(h->code = (int8 *)malloc(len)))
+        return HvmNoMem;
+    copy(h->code, $1 code, len);
+    h->len = $2 len;
+    if (!setup(h)) {
+        free(h->code);
+        h->code = (int8 *)0;
+        return HvmNoMem;
+    }
+    vm->b = $2 len;
+    if (!verify(vm, &e)) {
+        if (err) {
+            err->ip = e.ip;
+            snprintf(err->why, sizeof(err->why), "%s", e.why);
+        }
+        free(h->code);
+        h->code = (int8 *)0;
+        return HvmRejected;
+    }
+
+    return HvmOk;
+}
+
+/*
+ * hvmassemble - Assemble a program from source text and load it
+ * @h: VM
+ * @src: Assembly, as for h-vm-asm
+ * @len: Size in bytes
+ * @err: Filled in when the source or program is rejected; may be NULL
+ * Returns: As hvmload(); a source error is HvmRejected with its line
+ *          in err->why
+ */
+int hvmassemble(HVM *h, const char *src, size_t len, HVMError *err) {
+    Builder b;
+    AErr e;
+    FILE *in;
+    int st;
+
+    if (!len)
+        return hvmload(h, src, 0, err);
+    if (!(in = fmemopen((void *)src, len, "r")))
+        return HvmNoMem;
+    builder(&b, (int8 *)0, 0);
+    if (!assemble(&b, in, &e)) {
+        fclose(in);
+        freebuilder(&b);
+        unload(h);
+        if (err) {
+            err->ip = 0;
+            snprintf(err->why, sizeof(err->why), "line %u: %.50s", e.line, e.why);
+        }
+        return HvmRejected;
+    }
+    fclose(in);
+    st = hvmload(h, b.p, $i b.n, err);
+    freebuilder(&b);
+
+    return st;
+}
+
+/*
+ * hvmloadimage - Load the program of @img, replacing any previous one
+ * Returns: HvmOk or HvmNoMem
+ *
+ * Nothing is copied, verified or compiled: the VM maps the image's code
+ * and uses its caches until it writes into its code.
+ */
+int hvmloadimage(HVM *h, HVMImage *img) {
+    unload(h);
+    h->img = holdimage(img->i);
+    if (!setup(h)) {
+        dropimage(h->img);
+        h->img = (Image *)0;
+        return HvmNoMem;
+    }
+
+    return HvmOk;
+}
+
+/*
+ * libengine - Engine named @name, or the default for NULL
+ * Returns: Engine descriptor, or NULL if unknown
+ *
+ * profile is not one: it prints its report and takes over SIGUSR1,
+ * neither of which the library may do. Only h-vm -e runs it.
+ */
+static Engine *libengine(const char *name) {
+    Engine *e;
+
+    e = engine(name ? name : ENGINE);
+    if (e && e->run == executeprofile)
+        e = name ? (Engine *)0 : engines;
+
+    return e;
+}
+
+/*
+ * hvmrun - Run the loaded program from the current state
+ * @h: VM
+ * @engine: Engine name as for h-vm -e but profile, or NULL for the default
+ * Returns: HvmHalt, a guest fault, HvmNoMem, HvmRejected or HvmEngine
+ *
+ * The VM keeps its final state for hvmregs() and hvmmemory().
+ */
+int hvmrun(HVM *h, const char *engname) {
+    return hvmrunfor(h, engname, FUELMAX);
+}
+
+/*
+ * hvmrunfor - hvmrun() for at most @budget instructions
+ * Returns: As hvmrun(), or HvmFuel if the budget ran out first
+ *
+ * After HvmFuel, another hvmrun() or hvmrunfor() continues the program
+ * where it stopped, on any engine.
+ */
+int hvmrunfor(HVM *h, const char *engname, unsigned long long budget) {
+    Engine *eng;
+
+    if (!loaded(h))
+        return HvmRejected;
+    if (!(eng = libengine(engname)))
+        return HvmEngine;
+
+    return tryexecutefor(h->vm, eng, budget);
+}
+
+/*
+ * hvmbatch - Run the loaded program once per register set, in lockstep
+ * @h: VM; its memory is every run's initial memory, and it is not changed
+ * @regs: Initial registers of each run in, final registers out
+ * @status: Out: each run's status, as from hvmrun() on the switch engine
+ * @n: Number of runs
+ * Returns: HvmOk, HvmRejected or HvmNoMem
+ *
+ * Runs from the same program in the same memory that differ only in
+ * their inputs share instruction dispatch; see h-batch.c.
+ */
+int hvmbatch(HVM *h, HVMRegs *regs, int *status, size_t n) {
+    size_t k;
+    Lane *l;
+
+    if (!loaded(h))
+        return HvmRejected;
+    if (!n)
+        return HvmOk;
+    if (!(l = (Lane *)malloc(n * sizeof(Lane))))
+        return HvmNoMem;
+
+    for (k = 0; k < n; k++) {
+        l[k].r[0] = regs[k].ax;
+        l[k].r[1] = regs[k].bx;
+        l[k].r[2] = regs[k].cx;
+        l[k].r[3] = regs[k].dx;
+        l[k].sp = regs[k].sp;
+        l[k].ip = regs[k].ip;
+        l[k].flags = regs[k].flags;
+    }
+    if (!executebatch(h->vm, l, $4 n)) {
+        free(l);
+        return HvmNoMem;
+    }
+    for (k = 0; k < n; k++) {
+        regs[k].ax = l[k].r[0];
+        regs[k].bx = l[k].r[1];
+        regs[k].cx = l[k].r[2];
+        regs[k].dx = l[k].r[3];
+        regs[k].sp = l[k].sp;
+        regs[k].ip = l[k].ip;
+        regs[k].flags = l[k].flags;
+        status[k] = l[k].status;
+    }
+    free(l);
+
+    return HvmOk;
+}
+
+/*
+ * hvmregs - Copy out the register file, with flags up to date
+ */
+void hvmregs(HVM *h, HVMRegs *r) {
+    VM *vm;
+
+    vm = h->vm;
+    r->ax = vm $ax;
+    r->bx = vm $bx;
+    r->cx = vm $cx;
+    r->dx = vm $dx;
+    r->sp = vm $sp;
+    r->ip = vm $ip;
+    r->flags = evalflags(vm);
+
+    return;
+}
+
+/*
+ * hvmsetregs - Replace the register file, e.g. to pass a run its inputs
+ *
+ * Holds until the next hvmload() or hvmreset().
+ */
+void hvmsetregs(HVM *h, const HVMRegs *r) {
+    VM *vm;
+
+    vm = h->vm;
+    vm $ax = r->ax;
+    vm $bx = r->bx;
+    vm $cx = r->cx;
+    vm $dx = r->dx;
+    vm $sp = r->sp;
+    vm $ip = r->ip;
+    vm $flags = r->flags;
+    vm->c.lf.op = LazyNone;
+
+    return;
+}
+
+/*
+ * hvmmemory - Guest memory, sizeof(Memory) bytes, valid until the next
+ * call that changes the VM
+ */
+const unsigned char *hvmmemory(HVM *h) {
+    return h->vm->m;
+}
+
+/*
+ * hvmreset - Put the VM back in the state hvmload() left it in, or for
+ * a fork, the state of its snapshot
+ *
+ * Code the guest overwrote is restored and its translations dropped;
+ * otherwise caches and compiled code are kept for the next run. Pages
+ * the run wrote are released. Should memory fail to map, the VM is left
+ * with no program, and runs return HvmRejected.
+ */
+void hvmreset(HVM *h) {
+    bool changed;
+    VM *vm;
+
+    if (h->snap) {
+        if (!restore(h->vm, h->snap->s)) {
+            release(h->snap);
+            h->snap = (HVMSnap *)0;
+        }
+        return;
+    }
+    if (h->img) {
+        if (!setup(h)) {
+            dropimage(h->img);
+            h->img = (Image *)0;
+        }
+        return;
+    }
+    if (!h->code)
+        return;
+    vm = h->vm;
+    changed = memcmp(vm->m, h->code, h->len);
+    if (!setup(h)) {
+        free(h->code);
+        h->code = (int8 *)0;
+        return;
+    }
+    if (changed) {
+        dropcaches(vm);
+        verify(vm, (VErr *)0);
+    }
+
+    return;
+}
+
+/*
+ * hvmfree - Release the VM
+ */
+void hvmfree(HVM *h) {
+    if (!h)
+        return;
+
+    freevm(h->vm);
+    free(h->code);
+    release(h->snap);
+    dropimage(h->img);
+    free(h);
+
+    return;
+}
+
+/*
+ * hvmsnapshot - Capture a VM's registers and memory for hvmfork()
+ * @h: VM with a program; it is not changed and can go on running
+ * Returns: Snapshot, or NULL if out of memory or nothing is loaded
+ */
+HVMSnap *hvmsnapshot(HVM *h) {
+    HVMSnap *s;
+
+    if (!loaded(h) || !(s = (HVMSnap *)malloc(sizeof(HVMSnap))))
+        return (HVMSnap *)0;
+    if (!(s->s = snapshot(h->vm))) {
+        free(s);
+        return (HVMSnap *)0;
+    }
+    s->refs = 1;
+
+    return s;
+}
+
+/*
+ * hvmfork - Create a VM in the state captured by @s
+ * Returns: Handle, or NULL if out of memory
+ *
+ * The fork shares the snapshot's memory until it writes to it, and
+ * hvmreset() takes it back to the snapshot. Any thread may fork.
+ */
+HVM *hvmfork(HVMSnap *s) {
+    HVM *h;
+
+    if (!(h = (HVM *)calloc(1, sizeof(HVM))))
+        return (HVM *)0;
+    if (!(h->vm = forkvm(s->s))) {
+        free(h);
+        return (HVM *)0;
+    }
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+    h->snap = s;
+
+    return h;
+}
+
+/*
+ * hvmsnapfree - Release a snapshot; forks of it stay valid
+ */
+void hvmsnapfree(HVMSnap *s) {
+    release(s);
+
+    return;
+}
+
+/*
+ * hvmimage - Verify and prepare a program once for many VMs
+ * @code: Program, as for hvmload()
+ * @len: Size in bytes
+ * @err: Filled in when the program is rejected or memory runs out;
+ *       may be NULL
+ * Returns: Image for hvmloadimage(), or NULL
+ *
+ * Every translation the engines can start from is made here, so VMs
+ * loading the image run without translating or compiling anything.
+ */
+HVMImage *hvmimage(const void *code, size_t len, HVMError *err) {
+    HVMImage *img;
+    HVM *h;
+    int st;
+
+    if (!(img = (HVMImage *)malloc(sizeof(HVMImage))) || !(h = hvmnew())) {
+        free(img);
+        st = HvmNoMem;
+        goto fail;
+    }
+    if ((st = hvmload(h, code, len, err)) != HvmOk) {
+        hvmfree(h);
+        free(img);
+        goto fail;
+    }
+    if (!(img->i = mkimage(h->vm))) {
+        hvmfree(h);
+        free(img);
+        st = HvmNoMem;
+        goto fail;
+    }
+    free(h->code);
+    free(h);
+
+    return img;
+
+fail:
+    if (err && st == HvmNoMem) {
+        err->ip = 0;
+        snprintf(err->why, sizeof(err->why), "%s", hvmstrerror(st));
+    }
+    return (HVMImage *)0;
+}
+
+/*
+ * hvmimagefree - Release an image; VMs loaded from it stay valid
+ */
+void hvmimagefree(HVMImage *img) {
+    if (!img)
+        return;
+
+    dropimage(img->i);
+    free(img);
+
+    return;
+}
+
+/*
+ * hvmguard - Install the guard page SIGSEGV handler
+ * Returns: 1, or 0 if the handler could not be installed
+ *
+ * Process-wide; see guardpage().
+ */
+int hvmguard(void) {
+    return guardpage();
+}
+
+/*
+ * hvmstrerror - Describe a status code
+ */
+const char *hvmstrerror(int status) {
+    switch (status) {
+        case HvmOk:         return "ok";
+        case HvmHalt:       return "halted";
+        case HvmNoMem:      return "out of memory";
+        case HvmSegv:       return "segmentation fault";
+        case HvmInstr:      return "illegal instruction";
+        case HvmRejected:   return "program rejected";
+        case HvmEngine:     return "unknown engine";
+        case HvmFuel:       return "budget exhausted";
+        default:            return "unknown status";
+    }
+}
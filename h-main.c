@@ -0,0 +1,156 @@
+/*
+ * h-main.c - H-VM Command Line Driver
+ *
+ * Runs a program file, the built-in test program, or a compiled module,
+ * on a new VM
+ */
+
+#include "h-vm.h"
+#include "h-aot.h"
+
+/* ============================================================================
+ * Main Entry Point
+ * ========================================================================= */
+
+static Aot *module;     /* -a */
+
+static void runaot(VM *vm) {
+    aotexec(vm, module);
+}
+
+static Engine aot = { "aot", runaot };
+
+/*
+ * run - Run @vm on @eng, stopping as error() does
+ *
+ * Under tryexecute(), so that a guard page fault is a guest fault
+ * (main() installs the handler with guardpage()).
+ */
+static void run(VM *vm, Engine *eng) {
+    Errorcode e;
+
+    if ((e = tryexecute(vm, eng)) != NoErr)
+        error(vm, e);
+
+    return;
+}
+
+/*
+ * main - Entry point with arithmetic test program
+ * Usage: h-vm [-e engine] [-o file] [-a module] [program]
+ *   -e  Execution engine
+ *   -o  Write the program as a program file instead of running it
+ *   -a  Run a module built by h-vm-aot instead of the test program
+ *   program  Program file to run instead of the test program (h-file.c)
+ *
+ * Test program:
+ *   mov ax, 0x05     ; ax = 5
+ *   add ax, 0x03     ; ax = 8 (5+3)
+ *   sub ax, 0x02     ; ax = 6 (8-2)
+ *   mul ax, 0x02     ; ax = 12 (6*2)
+ *   div ax, 0x03     ; ax = 4 (12/3)
+ *   inc ax           ; ax = 5
+ *   dec ax           ; ax = 4
+ *   mov cx, 0x03
+ * next:
+ *   add ax, 0x02     ; ax = 6, 8, 10
+ *   loop next        ; three rounds
+ *   cmp ax, 0x0a     ; E set
+ *   hlt
+ */
+int main(int argc, char *argv[]) {
+    char *out, *path;
+    Program *prog;
+    Builder b;
+    Engine *eng;
+    VErr err;
+    VM *vm;
+    int opt, top;
+
+    eng = engine(ENGINE);
+    out = path = (char *)0;
+    while ((opt = getopt(argc, argv, "e:o:a:")) != -1)
+        switch (opt) {
+            case 'e':
+                if ((eng = engine(optarg)))
+                    break;
+                fprintf(stderr, "unknown engine '%s'\n", optarg);
+                goto usage;
+            case 'o':
+                out = optarg;
+                break;
+            case 'a':
+                path = optarg;
+                break;
+            default:
+            usage:
+                fprintf(stderr, "usage: %s [-e engine] [-o file] [-a module] [program]\n"
+                    "engines:", argv[0]);
+                for (eng = engines; eng->name; eng++)
+                    fprintf(stderr, " %s", eng->name);
+                fprintf(stderr, "\n");
+                return 1;
+        }
+    if (optind < argc - 1)
+        goto usage;
+    assert(eng);
+
+    guardpage();
+    if (eng->run == executeprofile)
+        profsignal();
+    vm = virtualmachine();
+    if (!vm)
+        return 1;
+    if (path) {
+        if (!(module = aotload(path)))
+            return 1;
+        run(vm, &aot);
+    }
+
+    if (optind < argc) {
+        if (!loadfile(vm, argv[optind])) {
+            perror(argv[optind]);
+            return 1;
+        }
+    } else {
+        /* Built in place in the VM's memory */
+        builder(&b, vm->m, sizeof(Memory));
+        emit(&b, mov, 0x05, 0);         /* mov ax, 0x05 */
+        emit(&b, add, 0x00, 0x03);      /* add ax, 0x03 */
+        emit(&b, sub, 0x00, 0x02);      /* sub ax, 0x02 */
+        emit(&b, mul, 0x00, 0x02);      /* mul ax, 0x02 */
+        emit(&b, div_op, 0x00, 0x03);   /* div ax, 0x03 */
+        emit(&b, inc, 0x00, 0);         /* inc ax */
+        emit(&b, dec, 0x00, 0);         /* dec ax */
+        emit(&b, mov + 2, 0x03, 0);     /* mov cx, 0x03 */
+        top = label(&b);
+        place(&b, top);
+        emit(&b, add, 0x00, 0x02);      /* add ax, 0x02 */
+        ref(&b, immof(&b, emit(&b, loop, 0, 0)), top);  /* loop next */
+        emit(&b, cmp, 0x00, 0x0a);      /* cmp ax, 0x0a */
+        emit(&b, hlt, 0, 0);
+        if (!program(vm, &b))
+            return 1;
+        freebuilder(&b);
+    }
+    prog = vm->m + vm->b;
+    if (!verify(vm, &err)) {
+        fprintf(stderr, "program rejected at 0x%04x: %s\n", err.ip, err.why);
+        return 1;
+    }
+    if (out) {
+        if (!savefile(vm, out, (Section *)0, 0)) {
+            perror(out);
+            return 1;
+        }
+        return 0;
+    }
+    printf("vm   = %p (sz: %zu)\n", vm, sizeof(struct s_vm));
+    printf("prog = %p\n", prog);
+
+    run(vm, eng);
+
+    printhex($1 prog, (map(mov)+map(nop)+map(hlt)), ' ');
+
+    return 0;
+}
@@ -0,0 +1,482 @@
+/*
+ * h-pool.c - H-VM Worker Pool
+ *
+ * Runs batches of independent programs on one worker thread per core.
+ * Each worker owns a Chase-Lev deque of runnable tasks: the owner pushes
+ * and pops at the bottom without locking, and a worker that runs dry
+ * steals from the top of another's. Jobs come in through a shared submit
+ * queue that workers drain into their own deques a few at a time, and
+ * go out through a completion queue. Tasks yield after QUANTUM
+ * instructions and requeue behind newer submissions, so a runaway
+ * guest cannot hold a worker.
+ *
+ * VMs are recycled: a worker loads the next program into a VM it has
+ * finished with, so guest memory, translation caches and JIT arenas are
+ * allocated once per worker instead of once per job.
+ */
+
+#include "h-vm.h"
+#include "hvm.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DEQUESIZE   256     /* Tasks per worker deque; a power of two */
+#define GRAB        16      /* Most tasks taken from the submit queue at once */
+#define SPARES      4       /* Idle VMs kept per worker */
+#define QUANTUM     65536   /* Instructions a task runs before yielding */
+
+typedef struct s_task Task;
+struct s_task {
+    HVMJob job;
+    HVMRegs regs;   /* Copy of *job.regs */
+    HVM *h;         /* VM of a started task */
+    int64 left;     /* Budget left */
+    HVMResult res;
+    Task *next;     /* Submit, completion or free list */
+};
+
+/* Task list, oldest first */
+struct s_fifo {
+    Task *head, *tail;
+};
+typedef struct s_fifo Fifo;
+
+/* Chase-Lev work-stealing deque; top and bottom never wrap */
+struct s_deque {
+    atomic_long top;
+    atomic_long bottom;
+    _Atomic(Task *) buf[DEQUESIZE];
+};
+typedef struct s_deque Deque;
+
+/* Cache-line aligned so workers do not share deque indices */
+struct __attribute__((aligned(64))) s_worker {
+    Deque dq;
+    struct s_hvmpool *pool;
+    pthread_t thread;
+    HVM *spare[SPARES];
+    int32 nspare;
+    int32 seed;     /* Victim selection */
+};
+typedef struct s_worker Worker;
+
+struct s_hvmpool {
+    Worker *w;
+    int32 n;
+    int32 started;          /* Threads to join */
+    pthread_mutex_t lock;   /* Guards everything below */
+    pthread_cond_t work;    /* Tasks submitted or shutting down */
+    pthread_cond_t done;    /* Task completed */
+    Fifo submit, complete;
+    int32 queued;           /* Tasks on the submit queue */
+    int32 idle;             /* Workers waiting on work */
+    int64 inflight;         /* Submitted and not yet collected */
+    Task *free;
+    bool stop;
+};
+
+/* ============================================================================
+ * Queues
+ * ========================================================================= */
+
+static void put(Fifo *q, Task *t) {
+    t->next = (Task *)0;
+    if (q->tail)
+        q->tail->next = t;
+    else
+        q->head = t;
+    q->tail = t;
+}
+
+static Task *take(Fifo *q) {
+    Task *t;
+
+    if ((t = q->head) && !(q->head = t->next))
+        q->tail = (Task *)0;
+
+    return t;
+}
+
+/*
+ * dqpush - Add @t at the bottom of @d; owner only
+ * Returns: false if the deque is full
+ */
+static bool dqpush(Deque *d, Task *t) {
+    long b, top;
+
+    b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    top = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - top >= DEQUESIZE)
+        return false;
+    atomic_store_explicit(&d->buf[b & (DEQUESIZE - 1)], t, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+
+    return true;
+}
+
+/*
+ * dqpop - Take the newest task from the bottom of @d; owner only
+ * Returns: The task, or NULL if empty or a thief got the last one
+ */
+static Task *dqpop(Deque *d) {
+    long b, top;
+    Task *t;
+
+    b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (top > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return (Task *)0;
+    }
+    t = atomic_load_explicit(&d->buf[b & (DEQUESIZE - 1)], memory_order_relaxed);
+    if (top == b) {
+        /* Last task: race thieves for it */
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            t = (Task *)0;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+
+    return t;
+}
+
+/*
+ * dqsteal - Take the oldest task from the top of @d; any thread
+ * Returns: The task, or NULL if empty or another thread won it
+ */
+static Task *dqsteal(Deque *d) {
+    long b, top;
+    Task *t;
+
+    top = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (top >= b)
+        return (Task *)0;
+    t = atomic_load_explicit(&d->buf[top & (DEQUESIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        return (Task *)0;
+
+    return t;
+}
+
+static bool empty(Deque *d) {
+    return atomic_load_explicit(&d->top, memory_order_acquire) >=
+        atomic_load_explicit(&d->bottom, memory_order_acquire);
+}
+
+/* ============================================================================
+ * Workers
+ * ========================================================================= */
+
+/*
+ * grab - Move a fair share of the submit queue to @w's deque
+ * Returns: One of the tasks to run now, or NULL if the queue was empty
+ *
+ * The deque is filled under the pool lock, so a worker going to sleep
+ * either sees the tasks there or is woken to steal them.
+ */
+static Task *grab(Worker *w) {
+    HVMPool *p;
+    int32 k, share;
+    Task *t;
+
+    p = w->pool;
+    pthread_mutex_lock(&p->lock);
+    if (!(t = take(&p->submit))) {
+        pthread_mutex_unlock(&p->lock);
+        return (Task *)0;
+    }
+    p->queued--;
+    share = p->queued / p->n + 1;
+    if (share > GRAB)
+        share = GRAB;
+    for (k = 1; k < share && p->submit.head && dqpush(&w->dq, p->submit.head); k++) {
+        take(&p->submit);
+        p->queued--;
+    }
+    if (k > 1 && p->idle)
+        pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    return t;
+}
+
+/* thieve - Steal from the other workers, starting at a random one */
+static Task *thieve(Worker *w) {
+    HVMPool *p;
+    int32 k, v;
+    Task *t;
+
+    p = w->pool;
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 17;
+    w->seed ^= w->seed << 5;
+    for (v = w->seed % p->n, k = 0; k < p->n; k++, v = (v + 1) % p->n)
+        if (&p->w[v] != w && (t = dqsteal(&p->w[v].dq)))
+            return t;
+
+    return (Task *)0;
+}
+
+/* anywork - Whether there is a task for an idle worker; pool lock held */
+static bool anywork(HVMPool *p) {
+    int32 k;
+
+    if (p->submit.head)
+        return true;
+    for (k = 0; k < p->n; k++)
+        if (!empty(&p->w[k].dq))
+            return true;
+
+    return false;
+}
+
+/*
+ * run - Run @t for one quantum on a recycled VM
+ *
+ * A task that is still running after its quantum keeps its VM and goes
+ * to the back of the submit queue, so long jobs take turns with short
+ * ones instead of holding a worker; anything else posts its result.
+ */
+static void run(Worker *w, Task *t) {
+    HVMResult *r;
+    HVMPool *p;
+    int64 q;
+    HVM *h;
+
+    p = w->pool;
+    r = &t->res;
+    if (!(h = t->h)) {
+        zero($1 r, sizeof(HVMResult));
+        r->tag = t->job.tag;
+        if (!(h = w->nspare ? w->spare[--w->nspare] : hvmnew())) {
+            r->status = HvmNoMem;
+            goto done;
+        }
+        if (t->job.image)
+            r->status = hvmloadimage(h, t->job.image);
+        else
+            r->status = hvmload(h, t->job.code, t->job.len, &r->err);
+        if (r->status != HvmOk)
+            goto recycle;
+        if (t->job.regs)
+            hvmsetregs(h, &t->regs);
+        t->h = h;
+        t->left = t->job.budget ? t->job.budget : FUELMAX;
+    }
+
+    q = (t->left < QUANTUM) ? t->left : QUANTUM;
+    r->status = hvmrunfor(h, t->job.engine, q);
+    if (r->status == HvmFuel && (t->left -= q)) {
+        pthread_mutex_lock(&p->lock);
+        put(&p->submit, t);
+        p->queued++;
+        if (p->idle)
+            pthread_cond_signal(&p->work);
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    hvmregs(h, &r->regs);
+    t->h = (HVM *)0;
+
+recycle:
+    if (w->nspare < SPARES)
+        w->spare[w->nspare++] = h;
+    else
+        hvmfree(h);
+
+done:
+    pthread_mutex_lock(&p->lock);
+    put(&p->complete, t);
+    pthread_cond_signal(&p->done);
+    pthread_mutex_unlock(&p->lock);
+
+    return;
+}
+
+static void *worker(void *arg) {
+    HVMPool *p;
+    Worker *w;
+    bool stop;
+    Task *t;
+
+    w = (Worker *)arg;
+    p = w->pool;
+    for (;;) {
+        if ((t = dqpop(&w->dq)) || (t = grab(w)) || (t = thieve(w))) {
+            run(w, t);
+            continue;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->idle++;
+        while (!p->stop && !anywork(p))
+            pthread_cond_wait(&p->work, &p->lock);
+        p->idle--;
+        stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+            break;
+    }
+
+    return (void *)0;
+}
+
+/* ============================================================================
+ * Pool API
+ * ========================================================================= */
+
+/*
+ * hvmpoolnew - Start a pool of worker threads
+ * @threads: Number of workers, or 0 for one per online CPU
+ * Returns: Pool, or NULL if out of memory or threads could not start
+ */
+HVMPool *hvmpoolnew(int threads) {
+    HVMPool *p;
+    int32 k;
+
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    if (!(p = (HVMPool *)calloc(1, sizeof(HVMPool))))
+        return (HVMPool *)0;
+    if (!(p->w = (Worker *)aligned_alloc(64, threads * sizeof(Worker)))) {
+        free(p);
+        return (HVMPool *)0;
+    }
+    zero($1 p->w, threads * sizeof(Worker));
+    pthread_mutex_init(&p->lock, 0);
+    pthread_cond_init(&p->work, 0);
+    pthread_cond_init(&p->done, 0);
+
+    p->n = $4 threads;
+    for (k = 0; k < p->n; k++) {
+        p->w[k].pool = p;
+        p->w[k].seed = 2463534242u + k * 0x9e3779b9u;
+    }
+    for (k = 0; k < p->n; k++, p->started++)
+        if (pthread_create(&p->w[k].thread, 0, worker, &p->w[k]))
+            break;
+    if (p->started < p->n) {
+        hvmpoolfree(p);
+        return (HVMPool *)0;
+    }
+
+    return p;
+}
+
+/*
+ * hvmsubmit - Queue a job
+ * @p: Pool
+ * @job: Copied, but job->code must stay valid until its result is collected
+ * Returns: HvmOk or HvmNoMem
+ */
+int hvmsubmit(HVMPool *p, const HVMJob *job) {
+    Task *t;
+
+    pthread_mutex_lock(&p->lock);
+    if ((t = p->free))
+        p->free = t->next;
+    else if (!(t = (Task *)malloc(sizeof(Task)))) {
+        pthread_mutex_unlock(&p->lock);
+        return HvmNoMem;
+    }
+    t->job = *job;
+    t->h = (HVM *)0;
+    if (job->regs)
+        t->regs = *job->regs;
+    put(&p->submit, t);
+    p->queued++;
+    p->inflight++;
+    if (p->idle)
+        pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    return HvmOk;
+}
+
+/*
+ * hvmcollect - Take the result of a finished job
+ * @p: Pool
+ * @r: Filled in with the result
+ * @wait: Block until a job finishes if none has yet
+ * Returns: 1 with a result, 0 if nothing is in flight (or, without
+ * @wait, nothing has finished)
+ *
+ * Results come in completion order; use the job tag to match them up.
+ */
+int hvmcollect(HVMPool *p, HVMResult *r, int wait) {
+    Task *t;
+
+    pthread_mutex_lock(&p->lock);
+    while (!(t = take(&p->complete)) && wait && p->inflight)
+        pthread_cond_wait(&p->done, &p->lock);
+    if (t) {
+        *r = t->res;
+        t->next = p->free;
+        p->free = t;
+        p->inflight--;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return t ? 1 : 0;
+}
+
+static void freetask(Task *t) {
+    hvmfree(t->h);
+    free(t);
+}
+
+static void freelist(Task *t) {
+    Task *next;
+
+    for (; t; t = next) {
+        next = t->next;
+        freetask(t);
+    }
+}
+
+/*
+ * hvmpoolfree - Stop the workers and release the pool
+ *
+ * Jobs not yet run are dropped along with uncollected results.
+ */
+void hvmpoolfree(HVMPool *p) {
+    Worker *w;
+    Task *t;
+
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    for (w = p->w; w < p->w + p->started; w++)
+        pthread_join(w->thread, 0);
+    for (w = p->w; w < p->w + p->n; w++) {
+        while ((t = dqpop(&w->dq)))
+            freetask(t);
+        while (w->nspare)
+            hvmfree(w->spare[--w->nspare]);
+    }
+    freelist(p->submit.head);
+    freelist(p->complete.head);
+    freelist(p->free);
+
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->lock);
+    free(p->w);
+    free(p);
+
+    return;
+}
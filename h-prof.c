@@ -0,0 +1,256 @@
+/*
+ * h-prof.c - H-VM Execution Profiler
+ *
+ * The profile engine is execute() with counters: executions per opcode
+ * and per guest IP, and host time spent in each opcode's handler (TSC
+ * cycles on x86-64, nanoseconds elsewhere). The counting lives in its
+ * own loop, so the other engines carry no profiling code at all.
+ *
+ * A sorted text report goes to stderr when the VM stops, and, once
+ * profsignal() has been called, on SIGUSR1. HVM_PROFILE=file also
+ * writes it as CSV (file ends in .csv) or JSON.
+ */
+
+#include "h-vm.h"
+#include <signal.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+#endif
+
+#define PROFTOP     20  /* Hot spots in the text report */
+
+struct s_prof {
+    int64 total;            /* Instructions executed */
+    int64 ops[256];         /* Executions per opcode */
+    int64 clk[256];         /* Host time in each opcode's handler */
+    int64 ips[65536];       /* Executions per guest IP */
+    sig_atomic_t dumped;    /* Value of dumps at the last report */
+};
+typedef struct s_prof Prof;
+
+static volatile sig_atomic_t dumps;     /* SIGUSR1s received */
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define CLOCKNAME "tsc"
+  #define now() $8 __rdtsc()
+#else
+  #define CLOCKNAME "ns"
+static int64 now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return $8 ts.tv_sec * 1000000000ULL + $8 ts.tv_nsec;
+}
+#endif
+
+/* onusr1 - SIGUSR1 handler; every profiling VM reports once per signal */
+static void onusr1(int sig) {
+    (void)sig;
+    dumps++;
+}
+
+/*
+ * profsignal - Have SIGUSR1 print the report of every profiling VM
+ *
+ * Installed for the whole process, so only on request; h-vm does it
+ * for -e profile.
+ */
+void profsignal(void) {
+    signal(SIGUSR1, onusr1);
+
+    return;
+}
+
+/* Opcode and IP orderings for the report; per thread for VM pools */
+static _Thread_local int64 *sortkey;
+
+static int bykey(const void *a, const void *b) {
+    int64 x = sortkey[*(const int32 *)a], y = sortkey[*(const int32 *)b];
+
+    return (x < y) - (x > y);
+}
+
+/*
+ * sorted - Indices of the non-zero counts in @count[0..n), hottest first
+ * @key: Values to sort by
+ * @len: Number of indices returned
+ */
+static int32 *sorted(int64 *count, int64 *key, int32 n, int32 *len) {
+    int32 *ix, k;
+
+    ix = (int32 *)malloc(n * sizeof(int32));
+    if (!ix) {
+        *len = 0;
+        return (int32 *)0;
+    }
+    for (*len = k = 0; k < (int32)n; k++)
+        if (count[k])
+            ix[(*len)++] = k;
+    sortkey = key;
+    qsort(ix, *len, sizeof(int32), bykey);
+
+    return ix;
+}
+
+/* opname - Mnemonic of opcode @o with its byte, as "mov/0d", in @buf */
+static const char *opname(int8 o, char buf[16]) {
+    snprintf(buf, 16, "%s/%02x", optable[o].n ? optable[o].n : "???", o);
+
+    return buf;
+}
+
+/* profwrite - Write the machine-readable report to @path */
+static void profwrite(VM *vm, const char *path) {
+    int32 *ops, *ips, nops, nips, k;
+    const char *ext;
+    char name[16];
+    bool csv;
+    Prof *p;
+    FILE *f;
+
+    p = vm->prof;
+    if (!(f = fopen(path, "w"))) {
+        perror(path);
+        return;
+    }
+    ext = strrchr(path, '.');
+    csv = ext && !strcmp(ext, ".csv");
+    ops = sorted(p->ops, p->clk, 256, &nops);
+    ips = sorted(p->ips, p->ips, 65536, &nips);
+
+    if (csv) {
+        fprintf(f, "kind,key,name,count,%s\n", CLOCKNAME);
+        for (k = 0; k < nops; k++)
+            fprintf(f, "opcode,0x%02x,%s,%llu,%llu\n", ops[k],
+                opname(ops[k], name), p->ops[ops[k]], p->clk[ops[k]]);
+        for (k = 0; k < nips; k++)
+            fprintf(f, "ip,0x%04x,%s,%llu,\n", ips[k],
+                opname(vm->m[ips[k]], name), p->ips[ips[k]]);
+    } else {
+        fprintf(f, "{\n  \"instructions\": %llu,\n  \"clock\": \"%s\",\n"
+            "  \"opcodes\": [", p->total, CLOCKNAME);
+        for (k = 0; k < nops; k++)
+            fprintf(f, "%s\n    {\"opcode\": %d, \"name\": \"%s\", "
+                "\"count\": %llu, \"time\": %llu}", k ? "," : "", ops[k],
+                opname(ops[k], name), p->ops[ops[k]], p->clk[ops[k]]);
+        fprintf(f, "\n  ],\n  \"ips\": [");
+        for (k = 0; k < nips; k++)
+            fprintf(f, "%s\n    {\"ip\": %d, \"name\": \"%s\", \"count\": %llu}",
+                k ? "," : "", ips[k], opname(vm->m[ips[k]], name),
+                p->ips[ips[k]]);
+        fprintf(f, "\n  ]\n}\n");
+    }
+
+    free(ops);
+    free(ips);
+    fclose(f);
+
+    return;
+}
+
+/*
+ * profreport - Report the profile of @vm
+ *
+ * Text to stderr, sorted by time per opcode and by count per IP, plus
+ * the HVM_PROFILE file if one was asked for.
+ */
+void profreport(VM *vm) {
+    int32 *ops, *ips, nops, nips, k;
+    const char *path;
+    char name[16];
+    int64 clk;
+    Prof *p;
+
+    if (!(p = vm->prof))
+        return;
+
+    for (clk = k = 0; k < 256; k++)
+        clk += p->clk[k];
+    ops = sorted(p->ops, p->clk, 256, &nops);
+    ips = sorted(p->ips, p->ips, 65536, &nips);
+
+    fprintf(stderr, "Profile: %llu instructions, %llu %s in handlers\n",
+        p->total, clk, CLOCKNAME);
+    fprintf(stderr, "%-10s %10s %7s %14s %10s\n",
+        "opcode", "count", "%", CLOCKNAME, CLOCKNAME "/op");
+    for (k = 0; k < nops; k++)
+        fprintf(stderr, "%-10s %10llu %6.2f%% %14llu %10.1f\n",
+            opname(ops[k], name), p->ops[ops[k]],
+            100.0 * p->ops[ops[k]] / p->total, p->clk[ops[k]],
+            (double)p->clk[ops[k]] / p->ops[ops[k]]);
+    fprintf(stderr, "Hot spots:\n%-8s %12s %7s  %s\n", "ip", "count", "%", "opcode");
+    for (k = 0; k < nips && k < PROFTOP; k++)
+        fprintf(stderr, "0x%04x   %12llu %6.2f%%  %s\n", ips[k],
+            p->ips[ips[k]], 100.0 * p->ips[ips[k]] / p->total,
+            opname(vm->m[ips[k]], name));
+
+    free(ops);
+    free(ips);
+    if ((path = getenv("HVM_PROFILE")) && *path)
+        profwrite(vm, path);
+
+    return;
+}
+
+/*
+ * freeprof - Report and release the profile of @vm
+ */
+void freeprof(VM *vm) {
+    if (!vm->prof)
+        return;
+
+    profreport(vm);
+    free(vm->prof);
+    vm->prof = (Prof *)0;
+
+    return;
+}
+
+/*
+ * executeprofile - Execution loop with profiling
+ * @vm: VM instance
+ *
+ * Same semantics as execute(). hlt is counted but not timed, as its
+ * handler does not return.
+ */
+void executeprofile(VM *vm) {
+    Program *pp, *brk;
+    int16 size;
+    int64 t;
+    Prof *p;
+    int8 o;
+
+    assert(vm && *vm->m);
+    if (!vm->prof) {
+        if (!(vm->prof = (Prof *)calloc(1, sizeof(Prof))))
+            error(vm, ErrMem);
+        vm->prof->dumped = dumps;
+    }
+    p = vm->prof;
+
+    size = 0;
+    brk = vm->m + vm->b;
+
+    do {
+        vm $ip += size;
+        pp = vm->m + vm $ip;
+
+        burn(vm);
+        if (pp > brk)
+            segfault(vm);
+        if (p->dumped != dumps) {
+            p->dumped = dumps;
+            profreport(vm);
+        }
+        o = *pp;
+        p->total++;
+        p->ops[o]++;
+        p->ips[vm $ip]++;
+        t = now();
+        size = execinstr(vm, pp);
+        p->clk[o] += now() - t;
+    } while (o != (Opcode)hlt);
+
+    return;
+}
@@ -0,0 +1,142 @@
+/*
+ * h-sched.c - H-VM Time-Sliced Scheduler
+ *
+ * Interleaves many VMs on the calling thread. Each turn runs one VM for
+ * a fixed quantum of instructions with hvmrunfor(); a VM that uses up
+ * its quantum goes to the back of its priority's queue. Levels are
+ * strict, so a runnable high-priority VM waits at most one quantum for
+ * the thread however many long-running VMs share it.
+ */
+
+#include "h-vm.h"
+#include "hvm.h"
+
+#define SCHEDPRIO   4   /* Priority levels; 0 is the highest */
+
+typedef struct s_slot Slot;
+struct s_slot {
+    HVM *h;
+    const char *engine;
+    void *tag;
+    Slot *next;
+};
+
+struct s_hvmsched {
+    int64 quantum;
+    Slot *head[SCHEDPRIO], *tail[SCHEDPRIO];
+    Slot *free;
+};
+
+/*
+ * hvmschednew - Create an empty scheduler
+ * @quantum: Instructions per turn
+ * Returns: Scheduler, or NULL if out of memory
+ */
+HVMSched *hvmschednew(unsigned long long quantum) {
+    HVMSched *s;
+
+    if (!(s = (HVMSched *)calloc(1, sizeof(HVMSched))))
+        return (HVMSched *)0;
+    s->quantum = quantum ? quantum : 1;
+
+    return s;
+}
+
+/* enqueue - Append @t to the queue of priority @prio */
+static void enqueue(HVMSched *s, Slot *t, int prio) {
+    t->next = (Slot *)0;
+    if (s->tail[prio])
+        s->tail[prio]->next = t;
+    else
+        s->head[prio] = t;
+    s->tail[prio] = t;
+}
+
+/*
+ * hvmspawn - Add a loaded VM to the scheduler
+ * @s: Scheduler
+ * @h: VM, run from its current state; still owned by the caller
+ * @engine: Engine name, or NULL for the default
+ * @prio: Priority, 0 (highest) to 3; clamped
+ * @tag: Handed back with the result
+ * Returns: HvmOk or HvmNoMem
+ */
+int hvmspawn(HVMSched *s, HVM *h, const char *engine, int prio, void *tag) {
+    Slot *t;
+
+    if ((t = s->free))
+        s->free = t->next;
+    else if (!(t = (Slot *)malloc(sizeof(Slot))))
+        return HvmNoMem;
+    t->h = h;
+    t->engine = engine;
+    t->tag = tag;
+    enqueue(s, t, (prio < 0) ? 0 : (prio >= SCHEDPRIO) ? SCHEDPRIO - 1 : prio);
+
+    return HvmOk;
+}
+
+/*
+ * hvmschedrun - Run quanta until a VM stops
+ * @s: Scheduler
+ * @r: Filled in with the stopped VM's tag, status and registers
+ * Returns: 1 with a result, 0 if no VM is left
+ *
+ * The stopped VM leaves the scheduler; its memory can be read, and it
+ * can be reset and spawned again.
+ */
+int hvmschedrun(HVMSched *s, HVMResult *r) {
+    int prio, st;
+    Slot *t;
+
+    for (;;) {
+        for (prio = 0; prio < SCHEDPRIO && !s->head[prio]; prio++)
+            ;
+        if (prio == SCHEDPRIO)
+            return 0;
+
+        t = s->head[prio];
+        if (!(s->head[prio] = t->next))
+            s->tail[prio] = (Slot *)0;
+        st = hvmrunfor(t->h, t->engine, s->quantum);
+        if (st == HvmFuel) {
+            enqueue(s, t, prio);
+            continue;
+        }
+
+        zero($1 r, sizeof(HVMResult));
+        r->tag = t->tag;
+        r->status = st;
+        hvmregs(t->h, &r->regs);
+        t->next = s->free;
+        s->free = t;
+
+        return 1;
+    }
+}
+
+static void freeslots(Slot *t) {
+    Slot *next;
+
+    for (; t; t = next) {
+        next = t->next;
+        free(t);
+    }
+}
+
+/*
+ * hvmschedfree - Release the scheduler; VMs still in it are not freed
+ */
+void hvmschedfree(HVMSched *s) {
+    int prio;
+
+    if (!s)
+        return;
+
+    for (prio = 0; prio < SCHEDPRIO; prio++)
+        freeslots(s->head[prio]);
+    freeslots(s->free);
+    free(s);
+
+    return;
+}
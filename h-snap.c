@@ -0,0 +1,120 @@
+/*
+ * h-snap.c - H-VM Snapshots and Fork
+ *
+ * A snapshot freezes a VM's registers and memory so that any number of
+ * VMs can be started from that state. The memory image goes into an
+ * anonymous file, which each fork maps privately over its own m. Forks
+ * share the snapshot's pages until they write to them, and the kernel
+ * copies only the pages written. Dirty tracking is therefore per page
+ * (4KB), and a fork costs one mapping instead of a copy of memory.
+ */
+
+#include "h-vm.h"
+#include <sys/mman.h>
+
+/* blank - Whether @n bytes at @p are all zero */
+static bool blank(int8 *p, size_t n) {
+    return !*p && !memcmp(p, p + 1, n - 1);
+}
+
+/*
+ * snapshot - Capture @vm's registers and memory
+ * Returns: Snapshot, or NULL if out of memory
+ *
+ * @vm is not changed and can go on running; the snapshot does not
+ * follow it. Pages of zeros are left as holes in the image, so forks
+ * read them from the shared zero page as a fresh VM would.
+ */
+Snap *snapshot(VM *vm) {
+    size_t len, pg, step, n;
+    Snap *s;
+
+    len = pageup(sizeof(Memory));
+    step = pageup(1);
+    if (!(s = (Snap *)malloc(sizeof(Snap))))
+        return (Snap *)0;
+    s->m = (int8 *)MAP_FAILED;
+    s->starts = (Starts *)0;
+    if ((s->fd = memfd_create("hvm-snapshot", MFD_CLOEXEC)) < 0
+            || ftruncate(s->fd, len)
+            || (s->m = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                s->fd, 0)) == MAP_FAILED) {
+        freesnap(s);
+        return (Snap *)0;
+    }
+    for (pg = 0; pg < sizeof(Memory); pg += n) {
+        n = (sizeof(Memory) - pg < step) ? sizeof(Memory) - pg : step;
+        if (!blank(vm->m + pg, n))
+            copy(s->m + pg, vm->m + pg, $i n);
+    }
+    mprotect(s->m, len, PROT_READ);
+
+    s->c = vm->c;
+    s->b = vm->b;
+    s->enc = vm->enc;
+    s->verified = vm->verified;
+    s->starts = s->verified ? holdstarts(vm->starts) : (Starts *)0;
+
+    return s;
+}
+
+/*
+ * restore - Put @vm in the state captured by @s
+ * Returns: false if the memory could not be mapped; @vm is then unusable
+ *
+ * Replaces @vm's memory wholesale, so pages it wrote are dropped rather
+ * than copied back. Caches are kept if @vm's code matches @s's, as after
+ * any run that did not modify its own code.
+ */
+bool restore(VM *vm, Snap *s) {
+    if (vm->b != s->b || vm->enc != s->enc || memcmp(vm->m, s->m, $4 s->b + 1))
+        dropcaches(vm);
+    if (mmap(vm->m, pageup(sizeof(Memory)), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, s->fd, 0) == MAP_FAILED)
+        return false;
+
+    vm->c = s->c;
+    vm->b = s->b;
+    vm->enc = s->enc;
+    vm->verified = s->verified;
+    if (vm->verified) {
+        dropstarts(vm->starts);
+        vm->starts = holdstarts(s->starts);
+    }
+
+    return true;
+}
+
+/*
+ * forkvm - Create a VM in the state captured by @s
+ * Returns: New VM, or NULL if out of memory
+ */
+VM *forkvm(Snap *s) {
+    VM *vm;
+
+    if (!(vm = virtualmachine()))
+        return (VM *)0;
+    if (!restore(vm, s)) {
+        freevm(vm);
+        return (VM *)0;
+    }
+
+    return vm;
+}
+
+/*
+ * freesnap - Release @s; VMs forked from it keep their memory
+ */
+void freesnap(Snap *s) {
+    if (!s)
+        return;
+
+    if (s->m != (int8 *)MAP_FAILED)
+        munmap(s->m, pageup(sizeof(Memory)));
+    if (s->fd >= 0)
+        close(s->fd);
+    dropstarts(s->starts);
+    free(s);
+
+    return;
+}
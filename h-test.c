@@ -0,0 +1,660 @@
+/*
+ * h-test.c - H-VM Regression Tests
+ *
+ * Runs guest programs through the libhvm API and checks the status and
+ * registers they end with; programs are built with the internal builder
+ * where a test needs their bytes. Each test prints its name and result;
+ * the exit status is the number of failures.
+ *
+ * Usage: h-test
+ */
+
+#include "h-vm.h"
+#include "hvm.h"
+
+static int failed;
+
+/* Engines libhvm runs; each test that names no engine tries them all */
+static const char *libengines[] = {
+    "switch", "threaded", "uops", "blocks", "jit", "verified", 0
+};
+
+/* check - Report test @name, failing it unless @ok */
+static void check(const char *name, int ok) {
+    printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+    failed += !ok;
+
+    return;
+}
+
+/* load - New VM running assembly @src; NULL if it does not assemble */
+static HVM *load(const char *src) {
+    HVMError err;
+    HVM *h;
+
+    if (!(h = hvmnew()))
+        return (HVM *)0;
+    if (hvmassemble(h, src, strlen(src), &err) != HvmOk) {
+        fprintf(stderr, "0x%04x: %s\n", err.ip, err.why);
+        hvmfree(h);
+        return (HVM *)0;
+    }
+
+    return h;
+}
+
+/*
+ * everyengine - Run @src from a newly loaded VM on every libhvm engine
+ * @budget: Instructions to run, or 0 for no limit
+ * @reg: offsetof() the register in HVMRegs that must end as @val
+ * Returns: Whether every run ended with @status at @ip and @reg at @val
+ */
+static int everyengine(const char *src, unsigned long long budget, int status,
+        unsigned short ip, size_t reg, unsigned short val) {
+    const char **e;
+    HVMRegs r;
+    int ok;
+    HVM *h;
+
+    for (ok = 1, e = libengines; *e; e++) {
+        if (!(h = load(src)))
+            return 0;
+        ok &= (budget ? hvmrunfor(h, *e, budget) : hvmrun(h, *e)) == status;
+        hvmregs(h, &r);
+        ok &= r.ip == ip && *(unsigned short *)((char *)&r + reg) == val;
+        hvmfree(h);
+    }
+
+    return ok;
+}
+
+/* assembled - Assemble @src into @b in encoding @enc; false on an error */
+static bool assembled(Builder *b, const char *src, int8 enc) {
+    AErr err;
+    FILE *in;
+    bool ok;
+
+    builder(b, (int8 *)0, 0);
+    b->enc = enc;
+    if (!(in = fmemopen((void *)src, strlen(src), "r")))
+        return false;
+    if (!(ok = assemble(b, in, &err)))
+        fprintf(stderr, "%u: %s\n", err.line, err.why);
+    fclose(in);
+
+    return ok && built(b);
+}
+
+/*
+ * selfmodify - Resume on verified after jit stored into the code
+ *
+ * The store turns div ax, 1 into div ax, 0. A resumed run must not
+ * trust the load-time verification any more, and faults instead.
+ */
+static void selfmodify(void) {
+    static const char src[] =
+        "    mov bx, t\n"
+        "    mov ax, 0\n"
+        "    mov [bx+2], ax\n"
+        "    mov cx, 100\n"
+        "l:  loop l\n"
+        "t:  div ax, 1\n"
+        "    hlt\n";
+    int first, second;
+    HVM *h;
+
+    if (!(h = load(src))) {
+        check("jit store, then verified", 0);
+        return;
+    }
+    first = hvmrunfor(h, "jit", 20);
+    second = hvmrunfor(h, "verified", 100000);
+    check("jit store, then verified", first == HvmFuel && second == HvmInstr);
+    hvmfree(h);
+
+    return;
+}
+
+/*
+ * selfbudget - A block that stores over its own first instruction
+ * stops when the budget runs out, on every engine
+ *
+ * The store turns mov ax, 0xffff into bytes of another length; the
+ * part of the budget given back must not be counted from them.
+ */
+static void selfbudget(void) {
+    static const char src[] =
+        "    mov ax, 0xffff\n"
+        "    mov [0x0000], ax\n"
+        "l:  jmp l\n";
+
+    check("budget of a block storing into itself",
+        everyengine(src, 3, HvmFuel, 8, offsetof(HVMRegs, ax), 0xffff));
+
+    return;
+}
+
+/*
+ * hltover - A store of hlt, hlt over itself, with the budget running
+ * out on the last partial block; the run goes on to the hlt after it
+ */
+static void hltover(void) {
+    static const char src[] =
+        "    mov ax, 0x0202\n"
+        "    nop\n"
+        "    nop\n"
+        "s:  mov [s], ax\n"
+        "    inc bx\n"
+        "    inc bx\n"
+        "    hlt\n";
+
+    check("store of hlt over itself",
+        everyengine(src, 0, HvmHalt, 14, offsetof(HVMRegs, bx), 2));
+    check("store of hlt over itself, budget",
+        everyengine(src, 6, HvmFuel, 14, offsetof(HVMRegs, bx), 2));
+
+    return;
+}
+
+/*
+ * lastword - A load from a base register reaching 0xffff faults on
+ * every engine, after running long enough to be compiled
+ */
+static void lastword(const char *name) {
+    static const char src[] =
+        "    mov bx, 0xff00\n"
+        "l:  mov ax, [bx+0]\n"
+        "    inc bx\n"
+        "    jmp l\n";
+
+    check(name, everyengine(src, 0, HvmSegv, 3, offsetof(HVMRegs, bx), 0xffff));
+
+    return;
+}
+
+/*
+ * callover - The push of a call overwrites the call's own operand; the
+ * jump still goes where the operand said before the push
+ */
+static void callover(void) {
+    static const char src[] =
+        "    jmp s\n"
+        "t:  hlt\n"
+        "s:  mov sp, 10\n"
+        "    call t\n"
+        "    hlt\n";
+
+    check("call over its own operand",
+        everyengine(src, 0, HvmHalt, 3, offsetof(HVMRegs, sp), 8));
+
+    return;
+}
+
+/*
+ * batch - hvmbatch() ends each lane as hvmrun() on the switch engine
+ * ends a run from the same registers
+ *
+ * Lanes loop for different counts, write memory of their own, and
+ * either halt or fault. A few store into code, which takes them out of
+ * the group.
+ */
+static void batch(void) {
+    static const char src[] =
+        "    mov [bx+0], ax\n"
+        "    mov dx, [bx+0]\n"
+        "p:  nop\n"
+        "    nop\n"
+        "l:  add dx, 7\n"
+        "    loop l\n"
+        "    cmp ax, 5\n"
+        "    je f\n"
+        "    hlt\n"
+        "f:  mov dx, [cx-1]\n"
+        "    hlt\n";
+    HVMRegs in[40], out[40], r;
+    int st[40];
+    size_t k;
+    int ok;
+    HVM *h;
+
+    if (!(h = load(src))) {
+        check("batch lanes as single runs", 0);
+        return;
+    }
+    hvmregs(h, &r);
+    for (k = 0; k < 40; k++) {
+        in[k] = r;
+        in[k].ax = k;
+        in[k].bx = 0x8000 + 2 * k;
+        in[k].cx = 1 + k % 9;
+        /* nop, nop over p */
+        if (!(k % 13)) {
+            in[k].ax = 0x0101;
+            in[k].bx = 10;
+        }
+        out[k] = in[k];
+    }
+
+    ok = hvmbatch(h, out, st, 40) == HvmOk;
+    for (k = 0; ok && k < 40; k++) {
+        hvmreset(h);
+        hvmsetregs(h, &in[k]);
+        ok &= hvmrun(h, "switch") == st[k];
+        hvmregs(h, &r);
+        ok &= !memcmp(&r, &out[k], sizeof(r));
+    }
+    check("batch lanes as single runs", ok);
+    hvmfree(h);
+
+    return;
+}
+
+/*
+ * forks - A fork of a VM stopped halfway finishes as the VM does, and
+ * goes back to the snapshot on reset; writes stay in the VM making them
+ */
+static void forks(void) {
+    static const char src[] =
+        "    mov bx, 0x8000\n"
+        "    mov cx, 20\n"
+        "l:  mov [bx+0], cx\n"
+        "    add bx, 2\n"
+        "    loop l\n"
+        "    hlt\n";
+    static unsigned char mem[0x10000];
+    HVMRegs at, r1, r2;
+    HVM *h, *c, *d;
+    HVMSnap *s;
+    int ok;
+
+    if (!(h = load(src))) {
+        check("snapshot and fork", 0);
+        return;
+    }
+    ok = hvmrunfor(h, "switch", 30) == HvmFuel;
+    hvmregs(h, &at);
+    memcpy(mem, hvmmemory(h), sizeof(mem));
+    if (!(s = hvmsnapshot(h)) || !(c = hvmfork(s))) {
+        check("snapshot and fork", 0);
+        return;
+    }
+
+    /* Both finish alike from the snapshot */
+    ok &= hvmrun(h, "switch") == HvmHalt && hvmrun(c, "jit") == HvmHalt;
+    hvmregs(h, &r1);
+    hvmregs(c, &r2);
+    ok &= !memcmp(&r1, &r2, sizeof(r1)) && r1.cx == 0 && r1.bx == 0x8028;
+    ok &= !memcmp(hvmmemory(h), hvmmemory(c), sizeof(mem));
+
+    /* A later fork, and the first one reset, see none of those writes */
+    if (!(d = hvmfork(s))) {
+        check("snapshot and fork", 0);
+        return;
+    }
+    hvmreset(c);
+    hvmregs(c, &r1);
+    hvmregs(d, &r2);
+    ok &= !memcmp(&r1, &at, sizeof(at)) && !memcmp(&r2, &at, sizeof(at));
+    ok &= !memcmp(hvmmemory(c), mem, sizeof(mem));
+    ok &= !memcmp(hvmmemory(d), mem, sizeof(mem));
+    ok &= hvmrun(d, "uops") == HvmHalt;
+    hvmregs(d, &r2);
+    hvmregs(h, &r1);
+    ok &= !memcmp(&r1, &r2, sizeof(r1));
+    check("snapshot and fork", ok);
+
+    hvmfree(d);
+    hvmfree(c);
+    hvmsnapfree(s);
+    hvmfree(h);
+
+    return;
+}
+
+/*
+ * image - Two VMs share an image; one storing into its code leaves the
+ * other's, and its own after a reset, as the image has it
+ *
+ * With dx set the program writes dx, hlt hlt, over t before getting
+ * there; without it, it runs the two inc ax at t.
+ */
+static void image(void) {
+    static const char src[] =
+        "    mov cx, 50\n"
+        "l:  add ax, 3\n"
+        "    loop l\n"
+        "    cmp dx, 0\n"
+        "    je t\n"
+        "    mov bx, t\n"
+        "    mov [bx+0], dx\n"
+        "t:  inc ax\n"
+        "    inc ax\n"
+        "    hlt\n";
+    const char **e;
+    HVMImage *img;
+    HVMRegs r1, r2;
+    HVM *h1, *h2;
+    Builder b;
+    int ok;
+
+    img = assembled(&b, src, EncVar) ? hvmimage(b.p, b.n, (HVMError *)0)
+        : (HVMImage *)0;
+    freebuilder(&b);
+    h1 = hvmnew();
+    h2 = hvmnew();
+    if (!img || !h1 || !h2 || hvmloadimage(h1, img) != HvmOk
+            || hvmloadimage(h2, img) != HvmOk) {
+        check("shared image", 0);
+        return;
+    }
+
+    for (ok = 1, e = libengines; *e; e++) {
+        hvmreset(h1);
+        hvmreset(h2);
+        hvmregs(h1, &r1);
+        r1.dx = 0x0202;
+        hvmsetregs(h1, &r1);
+        ok &= hvmrun(h1, *e) == HvmHalt && hvmrun(h2, *e) == HvmHalt;
+        hvmregs(h1, &r1);
+        hvmregs(h2, &r2);
+        ok &= r1.ax == 150 && r2.ax == 152 && r2.ip == r1.ip + 4;
+    }
+    hvmreset(h1);
+    ok &= hvmrun(h1, "jit") == HvmHalt;
+    hvmregs(h1, &r1);
+    ok &= r1.ax == 152;
+    check("shared image", ok);
+
+    hvmfree(h2);
+    hvmfree(h1);
+    hvmimagefree(img);
+
+    return;
+}
+
+/*
+ * file - A program file loads back as it was saved, in each encoding
+ *
+ * Entry point and stack pointer come back with the code; of the data
+ * sections, the page is mapped and the odd-sized one copied.
+ */
+static void file(const char *name, int8 enc) {
+    static const char src[] =
+        "    hlt\n"
+        "s:  mov ax, [0x2000]\n"
+        "    mov bx, [0x3001]\n"
+        "    push ax\n"
+        "    hlt\n";
+    Section sect[2] = { { 0x2000, 0x1000, 0 }, { 0x3001, 3, 0 } };
+    char path[] = "/tmp/h-test-XXXXXX";
+    VM *vm, *back;
+    Builder b;
+    int32 k;
+    int fd;
+    int ok;
+
+    vm = virtualmachine();
+    back = virtualmachine();
+    if (!vm || !back || !assembled(&b, src, enc) || !program(vm, &b)
+            || (fd = mkstemp(path)) < 0) {
+        check(name, 0);
+        return;
+    }
+    close(fd);
+    freebuilder(&b);
+    vm $ip = (enc == EncWord) ? WORDSIZE : 1;
+    vm $sp = 0x9000;
+    for (k = 0; k < 0x1000; k++)
+        vm->m[0x2000 + k] = (int8)(k * 7 + 1);
+    copy(vm->m + 0x3001, $1 "\x34\x12\x56", 3);
+
+    ok = savefile(vm, path, sect, 2) && loadfile(back, path);
+    ok &= back->b == vm->b && back->enc == vm->enc;
+    ok &= back $ip == vm $ip && back $sp == vm $sp;
+    ok &= !memcmp(back->m, vm->m, sizeof(Memory));
+    ok &= tryexecute(back, engine("switch")) == SysHlt;
+    ok &= back $ax == 0x0801 && back $bx == 0x1234;
+    ok &= back->m[0x8ffe] == 0x01 && back $sp == 0x8ffe;
+    check(name, ok);
+
+    unlink(path);
+    freevm(back);
+    freevm(vm);
+
+    return;
+}
+
+/*
+ * assembly - The assembler encodes a program as emit() does, in each encoding
+ *
+ * One instruction of each layout, memory operands of every form, and
+ * labels used before and after they are placed.
+ */
+static void assembly(const char *name, int8 enc) {
+    static const char src[] =
+        "start: mov ax, 0x1234\n"
+        "       mov sp, 0xff00\n"
+        "       mov cx, [bx+4]\n"
+        "       mov [dx-2], ax\n"
+        "       lea bx, [d]\n"
+        "       add ax, 3\n"
+        "       cmp cx, 0x7f\n"
+        "       inc dx\n"
+        "       push bx\n"
+        "       pop cx\n"
+        "       ste\n"
+        "       je d\n"
+        "l:     loop l\n"
+        "       call start\n"
+        "       ret\n"
+        "d:     hlt\n";
+    Builder a, b;
+    int start, l, d;
+    int ok;
+
+    builder(&b, (int8 *)0, 0);
+    b.enc = enc;
+    start = label(&b);
+    l = label(&b);
+    d = label(&b);
+    place(&b, start);
+    emit(&b, mov, 0x1234, 0);
+    emit(&b, movsp, 0xff00, 0);
+    emit(&b, ld, memregs(2, 1), 4);
+    emit(&b, st, memregs(0, 3), $2 -2);
+    ref(&b, immof(&b, emit(&b, lea, memregs(1, BaseNone), 0)), d);
+    emit(&b, add, 0, 3);
+    emit(&b, cmp, 2, 0x7f);
+    emit(&b, inc, 3, 0);
+    emit(&b, push, 1, 0);
+    emit(&b, pop, 2, 0);
+    emit(&b, ste, 0, 0);
+    ref(&b, immof(&b, emit(&b, je, 0, 0)), d);
+    place(&b, l);
+    ref(&b, immof(&b, emit(&b, loop, 0, 0)), l);
+    ref(&b, immof(&b, emit(&b, call, 0, 0)), start);
+    emit(&b, ret, 0, 0);
+    place(&b, d);
+    emit(&b, hlt, 0, 0);
+
+    ok = assembled(&a, src, enc);
+    ok &= built(&b) && a.n == b.n && !memcmp(a.p, b.p, b.n);
+    check(name, ok);
+
+    freebuilder(&a);
+    freebuilder(&b);
+
+    return;
+}
+
+/*
+ * pool - Jobs run on a pool end as hvmrun() on the switch engine ends
+ * them, however they were split into quanta and whichever VM ran them
+ *
+ * Far more jobs than workers, most longer than a quantum, on every
+ * engine; a third fault, some stop on their budget and some run from
+ * an image.
+ */
+static void pool(void) {
+    static const char *src[2] = {
+        "l:  add ax, 3\n"
+        "    loop l\n"
+        "    dec dx\n"
+        "    jnz l\n"
+        "    hlt\n",
+
+        "l:  add ax, 3\n"
+        "    loop l\n"
+        "    mov bx, [cx-1]\n"
+        "    hlt\n"
+    };
+    HVMJob jobs[48];
+    HVMRegs in[48], r;
+    HVMImage *img;
+    HVMResult res;
+    bool seen[48];
+    Builder b[2];
+    HVM *ref[2];
+    HVMPool *p;
+    int k, n, j, st;
+    int ok;
+
+    for (ok = 1, j = 0; j < 2; j++) {
+        ok &= assembled(&b[j], src[j], EncVar);
+        ok &= (ref[j] = hvmnew()) && hvmload(ref[j], b[j].p, b[j].n, 0) == HvmOk;
+    }
+    if (!ok || !(img = hvmimage(b[0].p, b[0].n, 0)) || !(p = hvmpoolnew(2))) {
+        check("pool jobs as single runs", 0);
+        return;
+    }
+
+    for (k = 0; k < 48; k++) {
+        j = (k % 3 == 2);
+        hvmregs(ref[j], &in[k]);
+        in[k].cx = 1 + 977 * k;
+        in[k].dx = 1 + k % 3;
+        jobs[k] = (HVMJob){
+            .code = b[j].p,
+            .len = b[j].n,
+            .regs = &in[k],
+            .engine = libengines[k % 6],
+            .tag = &jobs[k],
+            .budget = (k % 7 == 3) ? 100000 : 0,
+            .image = (!j && !(k % 4)) ? img : (HVMImage *)0
+        };
+        seen[k] = false;
+        ok &= hvmsubmit(p, &jobs[k]) == HvmOk;
+    }
+
+    for (n = 0; hvmcollect(p, &res, 1); n++) {
+        k = (HVMJob *)res.tag - jobs;
+        j = (k % 3 == 2);
+        ok &= !seen[k];
+        seen[k] = true;
+        hvmreset(ref[j]);
+        hvmsetregs(ref[j], &in[k]);
+        st = jobs[k].budget ? hvmrunfor(ref[j], "switch", jobs[k].budget)
+            : hvmrun(ref[j], "switch");
+        hvmregs(ref[j], &r);
+        ok &= res.status == st && !memcmp(&res.regs, &r, sizeof(r));
+    }
+    check("pool jobs as single runs", ok && n == 48);
+
+    hvmpoolfree(p);
+    hvmimagefree(img);
+    for (j = 0; j < 2; j++) {
+        hvmfree(ref[j]);
+        freebuilder(&b[j]);
+    }
+
+    return;
+}
+
+/*
+ * sched - Of VMs all longer than a quantum, the ones spawned later at a
+ * higher priority finish first, though they run longest; each ends as a
+ * single hvmrun() does
+ */
+static void sched(void) {
+    static const char src[] =
+        "l:  add ax, 3\n"
+        "    loop l\n"
+        "    mov bx, [dx+0]\n"
+        "    hlt\n";
+    HVMRegs in[6], r;
+    HVMResult res;
+    HVMSched *s;
+    HVM *h[6];
+    int k, n;
+    int ok;
+
+    if (!(s = hvmschednew(1000))) {
+        check("scheduler priorities", 0);
+        return;
+    }
+    /* 0..3 at priority 2, then 4 and 5 at 0; dx 0xffff faults */
+    for (ok = 1, k = 0; k < 6; k++) {
+        if (!(h[k] = load(src))) {
+            check("scheduler priorities", 0);
+            return;
+        }
+        hvmregs(h[k], &in[k]);
+        in[k].cx = (k < 4) ? 3000 + 1000 * k : 20000 + 1000 * k;
+        in[k].dx = (k == 1) ? 0xffff : 0x8000;
+        hvmsetregs(h[k], &in[k]);
+        ok &= hvmspawn(s, h[k], libengines[k], (k < 4) ? 2 : 0, &h[k]) == HvmOk;
+    }
+
+    for (n = 0; hvmschedrun(s, &res); n++) {
+        k = (HVM **)res.tag - h;
+        ok &= (n < 2) == (k >= 4);
+        hvmreset(h[k]);
+        hvmsetregs(h[k], &in[k]);
+        ok &= hvmrun(h[k], "switch") == res.status;
+        hvmregs(h[k], &r);
+        ok &= !memcmp(&r, &res.regs, sizeof(r));
+    }
+    check("scheduler priorities", ok && n == 6);
+
+    hvmschedfree(s);
+    for (k = 0; k < 6; k++)
+        hvmfree(h[k]);
+
+    return;
+}
+
+/* noprofile - libhvm does not run the profile engine, which prints */
+static void noprofile(void) {
+    HVM *h;
+
+    if (!(h = load("hlt\n"))) {
+        check("no profile engine", 0);
+        return;
+    }
+    check("no profile engine", hvmrun(h, "profile") == HvmEngine);
+    hvmfree(h);
+
+    return;
+}
+
+int main(void) {
+    selfmodify();
+    selfbudget();
+    hltover();
+    noprofile();
+    callover();
+    batch();
+    pool();
+    sched();
+    forks();
+    image();
+    file("program file", EncVar);
+    file("program file, word encoding", EncWord);
+    assembly("assembler as emit()", EncVar);
+    assembly("assembler as emit(), word encoding", EncWord);
+    lastword("load at 0xffff");
+    hvmguard();
+    lastword("load at 0xffff, guard page");
+
+    return failed;
+}
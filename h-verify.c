@@ -0,0 +1,470 @@
+/*
+ * h-verify.c - H-VM Bytecode Verifier
+ *
+ * Checks a loaded program once, before it runs, for everything that
+ * does not depend on run-time values: opcodes, operand encodings,
+ * immediate divisors, code bounds, jump targets and the H/L states each
+ * instruction can see. A verified program can then run on
+ * executeverified(), which leaves those checks out of the hot loop.
+ */
+
+#include "h-vm.h"
+
+#define Lo  0x01    /* L flag in the tracked H/L state */
+#define Hi  0x02    /* H flag in the tracked H/L state */
+
+#define RETS    64  /* Calls executeverified() remembers, power of two */
+
+/* reject - Fill @e and fail verification */
+static bool reject(VErr *e, int32 ip, const char *fmt, ...) {
+    va_list ap;
+
+    if (!e)
+        return false;
+    e->ip = $2 ip;
+    va_start(ap, fmt);
+    vsnprintf(e->why, sizeof(e->why), fmt, ap);
+    va_end(ap);
+
+    return false;
+}
+
+/* Sets of H/L states, as in[] of verify() keeps them */
+#define HL(s)   (1 << (s))  /* The set holding only state @s */
+
+/*
+ * flow - The H/L states after instruction @o, given the set @in before
+ * it. Mirrors the masks in the flag handlers; clg clears H and L.
+ */
+static int8 flow(int8 o, int8 in) {
+    int8 out, s, t;
+
+    for (out = 0, s = 0; s < 4; s++) {
+        if (!(in & HL(s)))
+            continue;
+        switch (o) {
+            case sth: t = s | Hi; break;
+            case stl: t = s | Lo; break;
+            case clh: t = s & ~Hi; break;
+            case cll: t = s & ~Lo; break;
+            case clg: t = 0; break;
+            default: t = s; break;
+        }
+        out |= HL(t);
+    }
+
+    return out;
+}
+
+/* merge - Add the states @add to @set; true if that changed it */
+static bool merge(int8 *set, int8 add) {
+    if ((*set | add) == *set)
+        return false;
+    *set |= add;
+
+    return true;
+}
+
+/*
+ * states - Find the H/L states each instruction of checked code can see
+ * @in: One set per code byte, filled in; empty where no instruction
+ * starts
+ * Returns: false if a jump goes anywhere but an instruction
+ *
+ * A run may start or resume at any instruction with H and L clear. The
+ * states flow on from there to the next instruction unless this one
+ * stops, to jump targets, and from every ret to the instruction after
+ * every call, since which call a ret returns to is not known here. The
+ * sets only grow, so going over the code until none changes ends soon.
+ */
+static bool states(VM *vm, int8 *in, VErr *e) {
+    int8 o, out, rets, s;
+    bool changed;
+    int32 ip;
+    Uop u;
+    OD *d;
+
+    for (ip = 0; ip < vm->b; ip += isize(vm, vm->m[ip]))
+        in[ip] = HL(0);
+    for (ip = 0; ip < vm->b; ip += isize(vm, vm->m[ip])) {
+        d = &optable[vm->m[ip]];
+        if (!(d->f & OpTarget))
+            continue;
+        decode(vm, $2 ip, &u);
+        if (u.imm >= vm->b || !in[u.imm])
+            return reject(e, ip, "%s to 0x%04x, which is not an instruction",
+                d->n, u.imm);
+    }
+
+    rets = 0;
+    do {
+        changed = false;
+        for (ip = 0; ip < vm->b; ip += s) {
+            o = vm->m[ip];
+            d = &optable[o];
+            s = isize(vm, o);
+            out = flow(o, in[ip]);
+            if (o == ret)
+                changed |= merge(&rets, out);
+            if (d->f & OpTarget) {
+                decode(vm, $2 ip, &u);
+                changed |= merge(&in[u.imm], out);
+            }
+            if (o == call)
+                changed |= merge(&in[ip + s], rets);
+            else if (!(d->f & OpStop))
+                changed |= merge(&in[ip + s], out);
+        }
+    } while (changed);
+
+    return true;
+}
+
+/*
+ * verify - Verify the program loaded in @vm
+ * @vm: VM instance, code in [0, vm->b)
+ * @e: Offset and reason of the first problem, or NULL
+ * Returns: true and marks @vm verified if the program is valid
+ *
+ * Encodings are checked one instruction after the other, then jump
+ * targets and the H and L flags each instruction can see, see states().
+ * Instructions that would fault for one of those states are rejected
+ * like bad encodings, as is code that can run past its end.
+ */
+bool verify(VM *vm, VErr *e) {
+    int8 *in, last, s;
+    Starts *map;
+    Program *p;
+    int32 ip;
+    bool ok;
+    Uop u;
+    OD *d;
+
+    vm->verified = false;
+    if (!vm->b)
+        return reject(e, 0, "empty program");
+    if (vm->enc == EncWord && vm->b % WORDSIZE)
+        return reject(e, vm->b - vm->b % WORDSIZE, "code is not whole words");
+
+    last = 0;
+    for (ip = 0; ip < vm->b; ip += s) {
+        p = vm->m + ip;
+        d = &optable[*p];
+        if (!(s = isize(vm, *p)))
+            return reject(e, ip, "undefined opcode 0x%02x", *p);
+        if (ip + s > vm->b)
+            return reject(e, ip, "%s runs past the end of code", d->n);
+
+        if (vm->enc == EncWord)
+            decodeword(p, &u);
+        else
+            decodeop(p, &u);
+        if (vm->enc == EncWord && d->l == LayWordWord)
+            return reject(e, ip, "%s has no word encoding", d->n);
+        if (d->r == RegArg && u.r > 3) {
+            if (d->l == LayWord && vm->enc == EncVar)
+                return reject(e, ip, "%s: bad register selector 0x%04x",
+                    d->n, u.imm);
+            return reject(e, ip, "%s: bad register selector 0x%02x",
+                d->n, *(p+1));
+        }
+        if (*p == div_op && !u.imm)
+            return reject(e, ip, "div by zero");
+        last = *p;
+    }
+    if (!(optable[last].f & OpStop))
+        return reject(e, ip - isize(vm, last),
+            "code does not end with hlt, jmp or ret");
+
+    if (!(in = (int8 *)calloc(vm->b, 1)))
+        return reject(e, 0, "out of memory");
+    ok = states(vm, in, e);
+    for (ip = 0; ok && ip < vm->b; ip += isize(vm, vm->m[ip])) {
+        p = vm->m + ip;
+        switch (*p) {
+            case mov ... movsp:
+            case ld:
+            case st:
+                if (in[ip] & HL(Hi | Lo))
+                    ok = reject(e, ip, "mov with both H and L set");
+                break;
+
+            case push:
+            case pop:
+                if (in[ip] & ~HL(0))
+                    ok = reject(e, ip, "%s with %s set", optable[*p].n,
+                        (in[ip] & (HL(Hi) | HL(Hi | Lo))) ? "H" : "L");
+                break;
+
+            default:
+                break;
+        }
+    }
+    free(in);
+    if (!ok)
+        return false;
+
+    /* For boundary(); the end of code counts, as it does for execute() */
+    if (!(map = (Starts *)calloc(1, sizeof(Starts) + (vm->b >> 3) + 1)))
+        return reject(e, 0, "out of memory");
+    map->refs = 1;
+    map->b = vm->b;
+    for (ip = 0; ip < vm->b; ip += isize(vm, vm->m[ip]))
+        map->bits[ip >> 3] |= 1 << (ip & 7);
+    map->bits[ip >> 3] |= 1 << (ip & 7);
+    dropstarts(vm->starts);
+    vm->starts = map;
+    vm->verified = true;
+
+    return true;
+}
+
+/*
+ * holdstarts - Take a reference to @st
+ * Returns: @st, which may be NULL
+ */
+Starts *holdstarts(Starts *st) {
+    if (st)
+        __atomic_add_fetch(&st->refs, 1, __ATOMIC_RELAXED);
+
+    return st;
+}
+
+/*
+ * dropstarts - Drop a reference to @st, freeing it with the last one
+ */
+void dropstarts(Starts *st) {
+    if (st && !__atomic_sub_fetch(&st->refs, 1, __ATOMIC_ACQ_REL))
+        free(st);
+
+    return;
+}
+
+/*
+ * boundary - Whether an instruction of verified code starts at @ip
+ *
+ * Resuming at such an address with H and L clear is as safe as starting
+ * at 0: the flags can only be a subset of what verify() allowed for.
+ * Looked up in the map verify() leaves in vm->starts.
+ */
+static bool boundary(VM *vm, int16 ip) {
+    Starts *st;
+
+    st = vm->starts;
+    return ip <= st->b && (st->bits[ip >> 3] & (1 << (ip & 7)));
+}
+
+/*
+ * executeverified - Execution loop for verified programs
+ * @vm: VM instance
+ *
+ * Same semantics as execute(), minus the checks verify() has already
+ * done: no code bound, register selector, divisor or H/L tests are left,
+ * only the stack pointer checks that depend on run-time values. Runs
+ * that verify() cannot vouch for (unverified code, or not starting on
+ * an instruction boundary with H and L clear) go to execute(), and so
+ * does the rest of a run once a push, call or store has written into
+ * code, or a ret goes anywhere but back to the call that pushed its
+ * address: the calls are remembered on a small stack of our own.
+ * Memory operands are only tested for a word at 0xffff, and not even
+ * that once guardpage() has been called; see fastload(). Verified
+ * EncWord code runs on executeuops().
+ */
+void executeverified(VM *vm) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"    /* l_bad, then each row */
+    static void *checked[256] = ISALABELS, *unchecked[256] = ISAFASTLABELS;
+#pragma GCC diagnostic pop
+    int16 rets[RETS], a, to;
+    void **labels;
+    int32 depth;
+    Program *pp;
+    int64 fuel;
+
+#define word(p) ((Args)(((int16)*((p)+2) << 8) | (int16)*((p)+1)))
+#define greg(n) ((&vm $ax) + (n))
+#define addr(p) ((*((p)+1) >> 4) == BaseNone ? word((p)+2) \
+                    : $2 (word((p)+2) + *greg(*((p)+1) >> 4)))
+#define data(p) greg(*((p)+1) & 0x0f)
+#define next(n) do { \
+        vm $ip += (n); \
+        pp += (n); \
+        if (__builtin_expect(!fuel--, 0)) \
+            goto l_fuel; \
+        goto *labels[*pp]; \
+    } while (0)
+#define stored(n) do { \
+        if (!vm->verified) { \
+            vm $ip += (n); \
+            vm->fuel = fuel; \
+            execute(vm); \
+            return; \
+        } \
+    } while (0)
+#define jump(to) do { \
+        vm $ip = (to); \
+        pp = vm->m + vm $ip; \
+        next(0); \
+    } while (0)
+
+    assert(vm && *vm->m);
+    if ((vm $flags & 0x03) || !(vm->verified || verify(vm, 0))
+            || !boundary(vm, vm $ip)) {
+        execute(vm);
+        return;
+    }
+    /* The labels below decode EncVar */
+    if (vm->enc == EncWord) {
+        executeuops(vm);
+        return;
+    }
+    labels = guarded ? unchecked : checked;
+    depth = 0;
+    pp = vm->m + vm $ip;
+    fuel = vm->fuel;
+    next(0);
+
+/* The budget lives in a register; store it before leaving the loop */
+l_fuel:
+    vm->fuel = 0;
+    error(vm, SysFuel);
+
+l_bad:
+    segfault(vm);
+
+l_nop:
+    next(nop_size);
+
+l_hlt:
+    error(vm, SysHlt);
+
+l_mov:
+    opmov(vm, greg(*pp - mov), word(pp));
+    next(mov_size);
+
+l_movsp:
+    vm $sp = (Reg)word(pp);
+    next(movsp_size);
+
+l_ld:
+    opmov(vm, data(pp), opload(vm, addr(pp)));
+    next(ld_size);
+
+l_st:
+    opstore(vm, addr(pp), *data(pp));
+    stored(st_size);
+    next(st_size);
+
+/* ld and st once guardpage() has been called: no test for 0xffff */
+l_ldfast:
+    opmov(vm, data(pp), fastload(vm, addr(pp)));
+    next(ld_size);
+
+l_stfast:
+    faststore(vm, addr(pp), *data(pp));
+    stored(st_size);
+    next(st_size);
+
+l_lea:
+    *data(pp) = addr(pp);
+    next(lea_size);
+
+l_ste: vm $flags |= 0x08; next(ste_size);
+l_cle: opclf(vm, 0x07); next(cle_size);
+l_stg: vm $flags |= 0x04; next(stg_size);
+l_clg: opclf(vm, 0x0c); next(clg_size);
+l_sth: vm $flags |= 0x02; next(sth_size);
+l_clh: opclf(vm, 0x0d); next(clh_size);
+l_stl: vm $flags |= 0x01; next(stl_size);
+l_cll: opclf(vm, 0x0e); next(cll_size);
+
+l_push:
+    if (vm $sp < 2)
+        error(vm, ErrInstr);
+    if (vm $sp < (vm->b - 2))
+        error(vm, ErrSegv);
+    oppush(vm, *greg(*(pp+1)));
+    stored(push_size);
+    next(push_size);
+
+l_pop:
+    if (vm $sp > 0xfffd)
+        error(vm, ErrInstr);
+    *greg(*(pp+1)) = oppop(vm);
+    next(pop_size);
+
+l_add:
+    opadd(vm, greg(*(pp+1)), *(pp+3));
+    next(add_size);
+
+l_sub:
+    opsub(vm, greg(*(pp+1)), *(pp+3));
+    next(sub_size);
+
+l_mul:
+    opmul(vm, greg(*(pp+1)), *(pp+3));
+    next(mul_size);
+
+l_div_op:
+    opdiv(vm, greg(*(pp+1)), *(pp+3));
+    next(div_op_size);
+
+l_inc:
+    opinc(vm, greg(*(pp+1)));
+    next(inc_size);
+
+l_dec:
+    opdec(vm, greg(*(pp+1)));
+    next(dec_size);
+
+l_cmp:
+    opcmp(vm, *greg(*(pp+1)), *(pp+3));
+    next(cmp_size);
+
+l_jmp:
+    jump(word(pp));
+
+l_je: l_jne: l_jg: l_jng: l_jz: l_jnz: l_jc: l_jnc:
+    if (taken(vm, *pp))
+        jump(word(pp));
+    next(je_size);
+
+/* The push may overwrite the operand; the target is read before it */
+l_call:
+    if (vm $sp < 2)
+        error(vm, ErrInstr);
+    if (vm $sp < (vm->b - 2))
+        error(vm, ErrSegv);
+    to = word(pp);
+    a = $2 (vm $ip + call_size);
+    oppush(vm, a);
+    rets[depth++ & (RETS - 1)] = a;
+    vm $ip = to;
+    stored(0);
+    jump(vm $ip);
+
+l_ret:
+    if (vm $sp > 0xfffd)
+        error(vm, ErrInstr);
+    a = oppop(vm);
+    if (!depth || rets[--depth & (RETS - 1)] != a) {
+        vm $ip = a;
+        vm->fuel = fuel;
+        execute(vm);
+        return;
+    }
+    jump(a);
+
+l_loop:
+    if (--vm $cx)
+        jump(word(pp));
+    next(loop_size);
+
+#undef jump
+#undef stored
+#undef next
+#undef data
+#undef addr
+#undef greg
+#undef word
+}
@@ -0,0 +1,438 @@
+/*
+ * h-vm-aot.c - H-VM Ahead-of-Time Compiler
+ *
+ * Translates the code of a program file (see h-file.c) or raw bytecode
+ * image into C built on the same instruction kernels as the interpreter,
+ * then builds it with the system compiler into a shared object for
+ * aotload(). A program file's entry point, stack pointer and data
+ * sections go into the module with the code.
+ *
+ * Usage: h-vm-aot [-c] [-o output] image
+ *   -c  Write the generated C instead of building a shared object
+ *   -o  Output path (default: image.so, or stdout with -c)
+ */
+
+#include "h-aot.h"
+#include <sys/wait.h>
+
+#ifndef HVM_INCDIR
+  #define HVM_INCDIR "."
+#endif
+
+static const char *regs[] = { "$ax", "$bx", "$cx", "$dx" };
+
+/* Conditions of je ... jnc */
+static const char *conds[] = {
+    "equal(vm)", "!equal(vm)", "gt(vm)", "!gt(vm)",
+    "zero_flag(vm)", "!zero_flag(vm)", "carry_flag(vm)", "!carry_flag(vm)"
+};
+
+/* Zero bytes that end a run of data, in datarun() */
+#define DATAGAP     64
+
+/* Per code byte, in emitc() */
+#define AtInstr     0x01    /* An instruction starts here */
+#define AtTarget    0x02    /* ... and is jumped to, so it has a label */
+
+/*
+ * emitjump - Emit a jump to guest address @to, indented by @ind: to its
+ * label, or out to the interpreter if it has none
+ */
+static void emitjump(FILE *f, const int8 *at, int16 to, int ind) {
+    if (at[to] & AtTarget)
+        fprintf(f, "%*sgoto l_%04x;\n", ind, "", to);
+    else
+        fprintf(f, "%*saotstop(0x%04x, AotExit);\n", ind, "", to);
+}
+
+/*
+ * emitinstr - Emit the C for the instruction at @ip
+ * @f: Output
+ * @u: Decoded instruction
+ * @ip: Its guest address
+ * @at: What is at each code byte, see emitc()
+ *
+ * Operand checks that depend only on the encoding are resolved here;
+ * instructions that would always fault are left to the interpreter so
+ * the reference handler raises the fault.
+ */
+static void emitinstr(FILE *f, Uop *u, int16 ip, const int8 *at) {
+    const char *r;
+    char a[32];
+
+    r = (u->r < 4) ? regs[u->r] : (const char *)0;
+    switch (u->o) {
+        case nop:
+            break;
+
+        case hlt:
+            fprintf(f, "            aotstop(0x%04x, SysHlt);\n", ip);
+            break;
+
+        case ste: fprintf(f, "            vm $flags |= 0x08;\n"); break;
+        case stg: fprintf(f, "            vm $flags |= 0x04;\n"); break;
+        case sth: fprintf(f, "            vm $flags |= 0x02;\n"); break;
+        case stl: fprintf(f, "            vm $flags |= 0x01;\n"); break;
+        case cle: fprintf(f, "            opclf(vm, 0x07);\n"); break;
+        case clg: fprintf(f, "            opclf(vm, 0x0c);\n"); break;
+        case clh: fprintf(f, "            opclf(vm, 0x0d);\n"); break;
+        case cll: fprintf(f, "            opclf(vm, 0x0e);\n"); break;
+
+        case mov ... movsp:
+            fprintf(f, "            if (higher(vm) && lower(vm))\n"
+                "                aotstop(0x%04x, ErrInstr);\n", ip);
+            if (u->o <= mov_last)
+                fprintf(f, "            opmov(vm, &vm %s, 0x%04x);\n",
+                    regs[u->o - mov], u->imm);
+            else
+                fprintf(f, "            vm $sp = 0x%04x;\n", u->imm);
+            break;
+
+        /*
+         * Compiled C may keep guest registers out of vm across an
+         * access, which a fault in the guard page would lose; the one
+         * address that reaches it is tested for and interpreted.
+         */
+        case ld:
+        case st:
+            if (!r || (u->base > 3 && u->imm == 0xffff))
+                goto interpret;
+            fprintf(f, "            if (higher(vm) && lower(vm))\n"
+                "                aotstop(0x%04x, ErrInstr);\n", ip);
+            if (u->base < 4) {
+                snprintf(a, sizeof(a), "(int16)(vm %s + 0x%04x)",
+                    regs[u->base], u->imm);
+                fprintf(f, "            if (%s == 0xffff)\n"
+                    "                aotstop(0x%04x, AotExit);\n", a, ip);
+            } else
+                snprintf(a, sizeof(a), "0x%04x", u->imm);
+            if (u->o == ld)
+                fprintf(f, "            opmov(vm, &vm %s, *(int16 *)(vm->m + %s));\n",
+                    r, a);
+            else
+                fprintf(f, "            *(int16 *)(vm->m + %s) = vm %s;\n"
+                    "            if (%s <= vm->b)\n"
+                    "                aotstop(0x%04x, AotStored);\n",
+                    a, r, a, u->next);
+            break;
+
+        case lea:
+            if (!r)
+                goto interpret;
+            if (u->base < 4)
+                fprintf(f, "            vm %s = vm %s + 0x%04x;\n",
+                    r, regs[u->base], u->imm);
+            else
+                fprintf(f, "            vm %s = 0x%04x;\n", r, u->imm);
+            break;
+
+        case push:
+            if (!r)
+                goto interpret;
+            fprintf(f, "            if (higher(vm) || lower(vm) || vm $sp < 2)\n"
+                "                aotstop(0x%04x, ErrInstr);\n"
+                "            if (vm $sp < (vm->b - 2))\n"
+                "                aotstop(0x%04x, ErrSegv);\n"
+                "            vm $sp -= 2;\n"
+                "            *(int16 *)(vm->m + vm $sp) = vm %s;\n"
+                "            if (vm $sp <= vm->b)\n"
+                "                aotstop(0x%04x, AotStored);\n",
+                ip, ip, r, u->next);
+            break;
+
+        case pop:
+            if (!r)
+                goto interpret;
+            fprintf(f, "            if (higher(vm) || lower(vm) || vm $sp > 0xfffd)\n"
+                "                aotstop(0x%04x, ErrInstr);\n"
+                "            vm %s = oppop(vm);\n", ip, r);
+            break;
+
+        case add:
+        case sub:
+        case mul:
+            if (!r)
+                goto interpret;
+            fprintf(f, "            op%s(vm, &vm %s, 0x%04x);\n",
+                (u->o == add) ? "add" : (u->o == sub) ? "sub" : "mul",
+                r, u->imm);
+            break;
+
+        case div_op:
+            if (!r || !u->imm)
+                goto interpret;
+            fprintf(f, "            opdiv(vm, &vm %s, 0x%04x);\n", r, u->imm);
+            break;
+
+        case inc:
+        case dec:
+            if (!r)
+                goto interpret;
+            fprintf(f, "            op%s(vm, &vm %s);\n",
+                (u->o == inc) ? "inc" : "dec", r);
+            break;
+
+        case cmp:
+            if (!r)
+                goto interpret;
+            fprintf(f, "            opcmp(vm, vm %s, 0x%04x);\n", r, u->imm);
+            break;
+
+        case jmp:
+            emitjump(f, at, u->imm, 12);
+            break;
+
+        case je ... jnc:
+            fprintf(f, "            if (%s)\n", conds[u->o - je]);
+            emitjump(f, at, u->imm, 16);
+            break;
+
+        case loop:
+            fprintf(f, "            if (--vm $cx)\n");
+            emitjump(f, at, u->imm, 16);
+            break;
+
+        case call:
+            fprintf(f, "            if (vm $sp < 2)\n"
+                "                aotstop(0x%04x, ErrInstr);\n"
+                "            if (vm $sp < (vm->b - 2))\n"
+                "                aotstop(0x%04x, ErrSegv);\n"
+                "            vm $sp -= 2;\n"
+                "            *(int16 *)(vm->m + vm $sp) = 0x%04x;\n"
+                "            if (vm $sp <= vm->b)\n"
+                "                aotstop(0x%04x, AotStored);\n",
+                ip, ip, u->next, u->imm);
+            emitjump(f, at, u->imm, 12);
+            break;
+
+        /* Dispatched again by the switch */
+        case ret:
+            fprintf(f, "            if (vm $sp > 0xfffd)\n"
+                "                aotstop(0x%04x, ErrInstr);\n"
+                "            vm $ip = oppop(vm);\n"
+                "            continue;\n", ip);
+            break;
+
+        default:
+        interpret:
+            fprintf(f, "            aotstop(0x%04x, AotExit);\n", ip);
+            break;
+    }
+
+    return;
+}
+
+/*
+ * datarun - Find the first run of data in @vm's memory at or after @lo
+ * Returns: Its start, or sizeof(Memory) if there is none; *@end is set
+ *          past its last nonzero byte
+ */
+static int32 datarun(VM *vm, int32 lo, int32 *end) {
+    int32 k;
+
+    while (lo < sizeof(Memory) && !vm->m[lo])
+        lo++;
+    for (*end = k = lo; k < sizeof(Memory) && k < *end + DATAGAP; k++)
+        if (vm->m[k])
+            *end = k + 1;
+
+    return lo;
+}
+
+/*
+ * emitdata - Emit the memory above the code as aotdata[]
+ *
+ * Memory starts out clear, so that is the data sections loadfile()
+ * placed there; runs of them are emitted without the zeros in between.
+ */
+static void emitdata(FILE *f, VM *vm) {
+    int32 lo, end, k, n;
+
+    for (n = 0, lo = vm->b; (lo = datarun(vm, lo, &end)) < sizeof(Memory);
+            n++, lo = end) {
+        fprintf(f, "static const int8 aotd%d[] = {", n);
+        for (k = lo; k < end; k++)
+            fprintf(f, "%s0x%02x,", ((k - lo) % 12) ? " " : "\n    ", vm->m[k]);
+        fprintf(f, "\n};\n\n");
+    }
+
+    fprintf(f, "const int32 aotndata = %d;\n", n);
+    fprintf(f, "const AotData aotdata[] = {\n");
+    for (n = 0, lo = vm->b; (lo = datarun(vm, lo, &end)) < sizeof(Memory);
+            n++, lo = end)
+        fprintf(f, "    { 0x%04x, %d, aotd%d },\n", lo, end - lo, n);
+    fprintf(f, "    { 0, 0, 0 }\n};\n\n");
+
+    return;
+}
+
+/*
+ * emitc - Write the C translation of the program loaded in @vm
+ *
+ * aotentry() is a switch on vm $ip with one case per instruction that
+ * falls through to the next, so it can resume at any instruction. Jump
+ * targets also get a label to go to directly; a ret goes round the
+ * switch again.
+ */
+static void emitc(FILE *f, VM *vm, const char *src) {
+    int32 ip, n;
+    int8 *at;
+    Uop u;
+
+    if (!(at = (int8 *)calloc(0x10000, 1))) {
+        perror("h-vm-aot");
+        exit(1);
+    }
+    for (ip = 0; ip < vm->b; ip = u.next) {
+        decode(vm, $2 ip, &u);
+        at[ip] |= AtInstr;
+        if (optable[u.o].f & OpTarget)
+            at[u.imm] |= AtTarget;
+        if (!u.o)
+            break;
+    }
+    for (ip = 0; ip < 0x10000; ip++)
+        if (!(at[ip] & AtInstr))
+            at[ip] = 0;
+
+    fprintf(f, "/* Generated by h-vm-aot from %s - do not edit */\n\n", src);
+    fprintf(f, "#include \"h-aot.h\"\n\n");
+
+    fprintf(f, "const int32 aotsize = %d;\n", vm->b);
+    fprintf(f, "const int8 aotenc = %d;\n", vm->enc);
+    fprintf(f, "const int16 aotip = 0x%04x;\n", vm $ip);
+    fprintf(f, "const int16 aotsp = 0x%04x;\n\n", vm $sp);
+    fprintf(f, "const int8 aotimage[] = {");
+    for (n = 0; n < vm->b; n++)
+        fprintf(f, "%s0x%02x,", (n % 12) ? " " : "\n    ", vm->m[n]);
+    fprintf(f, "\n};\n\n");
+    emitdata(f, vm);
+
+    fprintf(f, "int aotentry(VM *vm) {\n    for (;;) switch (vm $ip) {\n");
+    for (ip = 0; ip < vm->b; ip = u.next) {
+        decode(vm, $2 ip, &u);
+        if (at[ip] & AtTarget)
+            fprintf(f, "        case 0x%04x: l_%04x:\n", ip, ip);
+        else
+            fprintf(f, "        case 0x%04x:\n", ip);
+        emitinstr(f, &u, $2 ip, at);
+        if (!u.o)
+            break;
+    }
+    fprintf(f, "        default:\n            aotstop(vm $ip, AotExit);\n    }\n}\n");
+    free(at);
+
+    return;
+}
+
+/*
+ * build - Compile generated C at @csrc into the shared object @out
+ * Returns: Exit status of the compiler, or -1 if it could not be run
+ *
+ * The compiler is $CC, split at blanks, or cc. Paths go to it as
+ * arguments of their own, never through a shell.
+ */
+static int build(const char *csrc, const char *out) {
+    char *args[32], *cc, *w;
+    const char *env;
+    int n, status;
+    pid_t pid;
+
+    env = getenv("CC");
+    if (!(cc = strdup(env && *env ? env : "cc")))
+        return -1;
+    n = 0;
+    for (w = strtok(cc, " \t"); w && n < 24; w = strtok((char *)0, " \t"))
+        args[n++] = w;
+    if (!n)
+        args[n++] = (char *)"cc";
+    args[n++] = (char *)"-O2";
+    args[n++] = (char *)"-shared";
+    args[n++] = (char *)"-fPIC";
+    args[n++] = (char *)"-w";
+    args[n++] = (char *)"-I";
+    args[n++] = (char *)HVM_INCDIR;
+    args[n++] = (char *)"-o";
+    args[n++] = (char *)out;
+    args[n++] = (char *)csrc;
+    args[n] = (char *)0;
+
+    status = -1;
+    if ((pid = fork()) < 0)
+        perror("fork");
+    else if (!pid) {
+        execvp(args[0], args);
+        perror(args[0]);
+        _exit(127);
+    } else {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+    free(cc);
+
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    char out[4096], csrc[] = "/tmp/h-vm-aot-XXXXXX.c";
+    bool conly;
+    VErr err;
+    FILE *f;
+    VM *vm;
+    int opt, fd, ret;
+
+    conly = false;
+    *out = 0;
+    while ((opt = getopt(argc, argv, "co:")) != -1)
+        switch (opt) {
+            case 'c':
+                conly = true;
+                break;
+            case 'o':
+                snprintf(out, sizeof(out), "%s", optarg);
+                break;
+            default:
+                goto usage;
+        }
+    if (optind != argc - 1)
+        goto usage;
+
+    vm = virtualmachine();
+    if (!vm || !loadfile(vm, argv[optind])) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (!verify(vm, &err)) {
+        fprintf(stderr, "%s: rejected at 0x%04x: %s\n", argv[optind],
+            err.ip, err.why);
+        return 1;
+    }
+
+    if (conly) {
+        f = *out ? fopen(out, "w") : stdout;
+        if (!f) {
+            perror(out);
+            return 1;
+        }
+        emitc(f, vm, argv[optind]);
+        return fclose(f) ? 1 : 0;
+    }
+
+    if (!*out)
+        snprintf(out, sizeof(out), "%s.so", argv[optind]);
+    if ((fd = mkstemps(csrc, 2)) < 0 || !(f = fdopen(fd, "w"))) {
+        perror(csrc);
+        return 1;
+    }
+    emitc(f, vm, argv[optind]);
+    fclose(f);
+    ret = build(csrc, out);
+    unlink(csrc);
+
+    return ret ? 1 : 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-c] [-o output] image\n", argv[0]);
+    return 1;
+}
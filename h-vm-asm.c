@@ -0,0 +1,116 @@
+/*
+ * h-vm-asm.c - H-VM Assembler
+ *
+ * Assembles a source file (see h-asm.c), verifies the result and writes
+ * it as a program file for h-vm. The program starts at address 0 with
+ * the stack at the top of memory. With -d, disassembles a program file
+ * instead.
+ *
+ * Usage: h-vm-asm [-d] [-w] [-o output] [source]
+ *   -d  Disassemble the program file source
+ *   -w  Emit EncWord code: fixed 4-byte words with 16-bit immediates
+ *   -o  Output path (default: a.hvm, or stdout with -d)
+ *   source  Assembly text; standard input if omitted
+ */
+
+#include "h-vm.h"
+
+/*
+ * listing - Write the code of the program file at @src as assembly
+ * Returns: Exit status
+ */
+static int listing(const char *src, const char *out) {
+    char line[80];
+    int32 ip;
+    int size;
+    FILE *f;
+    VM *vm;
+
+    if (!(vm = virtualmachine()) || !loadfile(vm, src)) {
+        perror(src);
+        return 1;
+    }
+    f = out ? fopen(out, "w") : stdout;
+    if (!f) {
+        perror(out);
+        return 1;
+    }
+
+    if (vm $ip || vm $sp != 0xffff)
+        fprintf(f, "; entry 0x%04x, sp 0x%04x\n", vm $ip, vm $sp);
+    if (vm->enc == EncWord)
+        fprintf(f, "; word encoding (h-vm-asm -w)\n");
+    for (ip = 0; ip < vm->b; ip += size) {
+        size = disasm(vm, $2 ip, line, sizeof(line));
+        fprintf(f, "    %-30s; %04x\n", line, ip);
+    }
+
+    return fclose(f) ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *src, *out;
+    bool dis, word;
+    Builder b;
+    VErr verr;
+    AErr err;
+    FILE *in;
+    VM *vm;
+    int opt;
+
+    out = (const char *)0;
+    dis = word = false;
+    while ((opt = getopt(argc, argv, "dwo:")) != -1)
+        switch (opt) {
+            case 'd':
+                dis = true;
+                break;
+            case 'w':
+                word = true;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    if (optind < argc - 1 || (dis && optind == argc))
+        goto usage;
+    src = (optind < argc) ? argv[optind] : "-";
+    if (dis)
+        return listing(src, out);
+    if (!out)
+        out = "a.hvm";
+
+    in = strcmp(src, "-") ? fopen(src, "r") : stdin;
+    if (!in || !(vm = virtualmachine())) {
+        perror(src);
+        return 1;
+    }
+
+    /* Assembled in place in the VM's memory */
+    builder(&b, vm->m, sizeof(Memory));
+    b.enc = word ? EncWord : EncVar;
+    if (!assemble(&b, in, &err)) {
+        fprintf(stderr, "%s:%u: %s\n", src, err.line, err.why);
+        return 1;
+    }
+    if (!program(vm, &b)) {
+        fprintf(stderr, "%s: empty program\n", src);
+        return 1;
+    }
+    if (!verify(vm, &verr)) {
+        fprintf(stderr, "%s: rejected at 0x%04x: %s\n", src, verr.ip, verr.why);
+        return 1;
+    }
+    if (!savefile(vm, out, (Section *)0, 0)) {
+        perror(out);
+        return 1;
+    }
+
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-d] [-w] [-o output] [source]\n", argv[0]);
+    return 1;
+}
@@ -5,6 +5,33 @@
  */
 
 #include "h-vm.h"
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* ============================================================================
+ * Control Operations
+ * ========================================================================= */
+
+/*
+ * Handlers take the immediate of their instruction. Those that take a
+ * register get it from the variants generated below, NULL for a bad
+ * selector; every fault is raised in the same order as in the other
+ * engines.
+ */
+
+static void __nop(VM *vm, Args imm) {
+    (void)vm;
+    (void)imm;
+
+    return;
+}
+
+static void __hlt(VM *vm, Args imm) {
+    (void)imm;
+    error(vm, SysHlt);
+}
 
 /* ============================================================================
  * Flag Operations
@@ -18,36 +45,44 @@
  *   Bit 0: L - Lower byte flag
  */
 
-void __ste(VM *vm, Opcode opcode, Args a1, Args a2) {
+static void __ste(VM *vm, Args imm) {
+    (void)imm;
     vm $flags |= 0x08;
 }
 
-void __stg(VM *vm, Opcode opcode, Args a1, Args a2) {
+static void __stg(VM *vm, Args imm) {
+    (void)imm;
     vm $flags |= 0x04;
 }
 
-void __sth(VM *vm, Opcode opcode, Args a1, Args a2) {
+static void __sth(VM *vm, Args imm) {
+    (void)imm;
     vm $flags |= 0x02;
 }
 
-void __stl(VM *vm, Opcode opcode, Args a1, Args a2) {
+static void __stl(VM *vm, Args imm) {
+    (void)imm;
     vm $flags |= 0x01;
 }
 
-void __cle(VM *vm, Opcode opcode, Args a1, Args a2) {
-    vm $flags &= 0x07;
+static void __cle(VM *vm, Args imm) {
+    (void)imm;
+    opclf(vm, 0x07);
 }
 
-void __clg(VM *vm, Opcode opcode, Args a1, Args a2) {
-    vm $flags &= 0x0c;
+static void __clg(VM *vm, Args imm) {
+    (void)imm;
+    opclf(vm, 0x0c);
 }
 
-void __clh(VM *vm, Opcode opcode, Args a1, Args a2) {
-    vm $flags &= 0x0d;
+static void __clh(VM *vm, Args imm) {
+    (void)imm;
+    opclf(vm, 0x0d);
 }
 
-void __cll(VM *vm, Opcode opcode, Args a1, Args a2) {
-    vm $flags &= 0x0e;
+static void __cll(VM *vm, Args imm) {
+    (void)imm;
+    opclf(vm, 0x0e);
 }
 
 /* ============================================================================
@@ -55,86 +90,84 @@ void __cll(VM *vm, Opcode opcode, Args a1, Args a2) {
  * ========================================================================= */
 
 /*
- * __mov - Move data to registers
+ * __mov - Move an immediate to a register
  * @vm: VM instance
- * @opcode: Specific MOV variant (0x08-0x0f)
- * @a1: Source value or address
- * @a2: Unused for most variants
+ * @reg: Destination, fixed by the opcode
+ * @imm: Value
  *
- * Supports:
- *   - Full 16-bit register moves
- *   - High byte (H flag) and low byte (L flag) operations
- *   - Memory address operations (placeholders)
+ * With H set the value's low byte replaces the high byte. With L set
+ * the high byte is kept and the whole value ORed into it, so a value
+ * above 0xff also sets bits of the high byte. Both set is an illegal
+ * instruction. See opmov().
  */
-void __mov(VM *vm, Opcode opcode, Args a1, Args a2) {
-    int16 dst;
-
-    dst = $2 a1;
+static inline void __mov(VM *vm, Reg *reg, Args imm) {
     if (higher(vm) && lower(vm))
         error(vm, ErrInstr);
+    opmov(vm, reg, imm);
 
-    switch (opcode) {
-        /* mov ax - 0x08 */
-        case 0x08:
-            if (higher(vm))
-                vm $ax = (((Reg)a1 << 8) | (vm $ax & 0xFF));
-            else if (lower(vm))
-                vm $ax = ((Reg)a1 | (vm $ax & 0xFF00));
-            else
-                vm $ax = (Reg)a1;
-            break;
+    return;
+}
 
-        /* mov bx - 0x09 */
-        case 0x09:
-            if (higher(vm))
-                vm $bx = (((Reg)a1 << 8) | (vm $bx & 0xFF));
-            else if (lower(vm))
-                vm $bx = ((Reg)a1 | (vm $bx & 0xFF00));
-            else
-                vm $bx = (Reg)a1;
-            break;
+/* __movsp - Set the stack pointer */
+static void __movsp(VM *vm, Args imm) {
+    if (higher(vm) && lower(vm))
+        error(vm, ErrInstr);
+    vm $sp = (Reg)imm;
 
-        /* mov cx - 0x0a */
-        case 0x0a:
-            if (higher(vm))
-                vm $cx = (((Reg)a1 << 8) | (vm $cx & 0xFF));
-            else if (lower(vm))
-                vm $cx = ((Reg)a1 | (vm $cx & 0xFF00));
-            else
-                vm $cx = (Reg)a1;
-            break;
+    return;
+}
 
-        /* mov dx - 0x0b */
-        case 0x0b:
-            if (higher(vm))
-                vm $dx = (((Reg)a1 << 8) | (vm $dx & 0xFF));
-            else if (lower(vm))
-                vm $dx = ((Reg)a1 | (vm $dx & 0xFF00));
-            else
-                vm $dx = (Reg)a1;
-            break;
+/* ============================================================================
+ * Memory Operations
+ * ========================================================================= */
 
-        /* mov sp - 0x0c */
-        case 0x0c:
-            vm $sp = (Reg)dst;
-            break;
+/*
+ * Memory instructions get the effective address as their immediate and
+ * their data register from memop(), NULL if the register byte is bad.
+ */
 
-        /* mov [addr],ax - 0x0d */
-        case 0x0d:
-            break;
+/*
+ * __ld - Load a word from memory
+ * @vm: VM instance
+ * @reg: Destination, or NULL for a bad register byte
+ * @imm: Address
+ *
+ * Honours the H/L flags like mov; both set is an illegal instruction.
+ */
+static inline void __ld(VM *vm, Reg *reg, Args imm) {
+    if (higher(vm) && lower(vm))
+        error(vm, ErrInstr);
+    if (!reg)
+        error(vm, ErrInstr);
+    opmov(vm, reg, opload(vm, imm));
 
-        /* mov [addr],bx - 0x0e */
-        case 0x0e:
-            break;
+    return;
+}
 
-        /* mov [addr],dx - 0x0f */
-        case 0x0f:
-            break;
+/*
+ * __st - Store a register to memory
+ * @vm: VM instance
+ * @reg: Source, or NULL for a bad register byte
+ * @imm: Address
+ *
+ * Always stores the whole word, but both H and L set is still an
+ * illegal instruction as for every mov.
+ */
+static inline void __st(VM *vm, Reg *reg, Args imm) {
+    if (higher(vm) && lower(vm))
+        error(vm, ErrInstr);
+    if (!reg)
+        error(vm, ErrInstr);
+    opstore(vm, imm, *reg);
 
-        default:
-            error(vm, ErrInstr);
-            break;
-    }
+    return;
+}
+
+/* __lea - Load an effective address; flags are neither read nor set */
+static inline void __lea(VM *vm, Reg *reg, Args imm) {
+    if (!reg)
+        error(vm, ErrInstr);
+    *reg = (Reg)imm;
 
     return;
 }
@@ -146,43 +179,16 @@ void __mov(VM *vm, Opcode opcode, Args a1, Args a2) {
 /*
  * __add - Add value to register
  * @vm: VM instance
- * @opcode: ADD opcode
- * @a1: Register selector (0x00=AX, 0x01=BX, 0x02=CX, 0x03=DX)
- * @a2: 16-bit value to add
+ * @reg: Register, or NULL for a bad selector
+ * @imm: Value to add
  *
  * Sets zero flag if result is 0
  * Sets carry flag if overflow occurs
  */
-void __add(VM *vm, Opcode opcode, Args a1, Args a2) {
-    int32 result;
-    Reg *reg;
-
-    /* Select target register */
-    switch (a1) {
-        case 0x00: reg = &(vm->c.r.ax); break;
-        case 0x01: reg = &(vm->c.r.bx); break;
-        case 0x02: reg = &(vm->c.r.cx); break;
-        case 0x03: reg = &(vm->c.r.dx); break;
-        default:
-            error(vm, ErrInstr);
-    }
-
-    /* Perform addition with overflow detection */
-    result = $4 *reg + $4 a2;
-    
-    /* Clear arithmetic flags */
-    vm $flags &= 0x0F;  /* Clear Z and C flags */
-    
-    /* Set carry flag if overflow */
-    if (result > 0xFFFF)
-        vm $flags |= 0x20;  /* Set C flag */
-    
-    /* Update register (truncate to 16-bit) */
-    *reg = $2 (result & 0xFFFF);
-    
-    /* Set zero flag if result is 0 */
-    if (*reg == 0)
-        vm $flags |= 0x10;  /* Set Z flag */
+static inline void __add(VM *vm, Reg *reg, Args imm) {
+    if (!reg)
+        error(vm, ErrInstr);
+    opadd(vm, reg, imm);
 
     return;
 }
@@ -190,43 +196,16 @@ void __add(VM *vm, Opcode opcode, Args a1, Args a2) {
 /*
  * __sub - Subtract value from register
  * @vm: VM instance
- * @opcode: SUB opcode
- * @a1: Register selector (0x00=AX, 0x01=BX, 0x02=CX, 0x03=DX)
- * @a2: 16-bit value to subtract
+ * @reg: Register, or NULL for a bad selector
+ * @imm: Value to subtract
  *
  * Sets zero flag if result is 0
  * Sets carry flag if underflow occurs
  */
-void __sub(VM *vm, Opcode opcode, Args a1, Args a2) {
-    int result;  /* Signed for underflow detection */
-    Reg *reg;
-
-    /* Select target register */
-    switch (a1) {
-        case 0x00: reg = &(vm->c.r.ax); break;
-        case 0x01: reg = &(vm->c.r.bx); break;
-        case 0x02: reg = &(vm->c.r.cx); break;
-        case 0x03: reg = &(vm->c.r.dx); break;
-        default:
-            error(vm, ErrInstr);
-    }
-
-    /* Perform subtraction with underflow detection */
-    result = $4 *reg - $4 a2;
-    
-    /* Clear arithmetic flags */
-    vm $flags &= 0x0F;  /* Clear Z and C flags */
-    
-    /* Set carry flag if underflow */
-    if (result < 0)
-        vm $flags |= 0x20;  /* Set C flag */
-    
-    /* Update register (handle underflow wrap-around) */
-    *reg = $2 (result & 0xFFFF);
-    
-    /* Set zero flag if result is 0 */
-    if (*reg == 0)
-        vm $flags |= 0x10;  /* Set Z flag */
+static inline void __sub(VM *vm, Reg *reg, Args imm) {
+    if (!reg)
+        error(vm, ErrInstr);
+    opsub(vm, reg, imm);
 
     return;
 }
@@ -234,84 +213,37 @@ void __sub(VM *vm, Opcode opcode, Args a1, Args a2) {
 /*
  * __mul - Multiply register by value
  * @vm: VM instance
- * @opcode: MUL opcode
- * @a1: Register selector
- * @a2: 16-bit value to multiply by
+ * @reg: Register, or NULL for a bad selector
+ * @imm: Value to multiply by
  *
  * Sets carry flag if result > 0xFFFF (overflow)
  * Sets zero flag if result is 0
  */
-void __mul(VM *vm, Opcode opcode, Args a1, Args a2) {
-    int32 result;
-    Reg *reg;
-
-    /* Select target register */
-    switch (a1) {
-        case 0x00: reg = &(vm->c.r.ax); break;
-        case 0x01: reg = &(vm->c.r.bx); break;
-        case 0x02: reg = &(vm->c.r.cx); break;
-        case 0x03: reg = &(vm->c.r.dx); break;
-        default:
-            error(vm, ErrInstr);
-    }
-
-    /* Perform multiplication */
-    result = $4 *reg * $4 a2;
-    
-    /* Clear arithmetic flags */
-    vm $flags &= 0x0F;
-    
-    /* Set carry flag if overflow */
-    if (result > 0xFFFF)
-        vm $flags |= 0x20;
-    
-    /* Update register (truncate to 16-bit) */
-    *reg = $2 (result & 0xFFFF);
-    
-    /* Set zero flag if result is 0 */
-    if (*reg == 0)
-        vm $flags |= 0x10;
+static inline void __mul(VM *vm, Reg *reg, Args imm) {
+    if (!reg)
+        error(vm, ErrInstr);
+    opmul(vm, reg, imm);
 
     return;
 }
 
 /*
- * __div - Divide register by value
+ * __div_op - Divide register by value
  * @vm: VM instance
- * @opcode: DIV opcode
- * @a1: Register selector
- * @a2: 16-bit divisor
+ * @reg: Register, or NULL for a bad selector
+ * @imm: Divisor
  *
  * Stores quotient in register
  * Errors on division by zero
  * Sets zero flag if result is 0
  */
-void __div(VM *vm, Opcode opcode, Args a1, Args a2) {
-    Reg *reg;
-
+static inline void __div_op(VM *vm, Reg *reg, Args imm) {
     /* Check for division by zero */
-    if (a2 == 0)
+    if (imm == 0)
         error(vm, ErrInstr);
-
-    /* Select target register */
-    switch (a1) {
-        case 0x00: reg = &(vm->c.r.ax); break;
-        case 0x01: reg = &(vm->c.r.bx); break;
-        case 0x02: reg = &(vm->c.r.cx); break;
-        case 0x03: reg = &(vm->c.r.dx); break;
-        default:
-            error(vm, ErrInstr);
-    }
-
-    /* Perform division */
-    *reg = *reg / a2;
-    
-    /* Clear arithmetic flags */
-    vm $flags &= 0x0F;
-    
-    /* Set zero flag if result is 0 */
-    if (*reg == 0)
-        vm $flags |= 0x10;
+    if (!reg)
+        error(vm, ErrInstr);
+    opdiv(vm, reg, imm);
 
     return;
 }
@@ -319,43 +251,17 @@ void __div(VM *vm, Opcode opcode, Args a1, Args a2) {
 /*
  * __inc - Increment register by 1
  * @vm: VM instance
- * @opcode: INC opcode
- * @a1: Register selector
- * @a2: Unused
+ * @reg: Register, or NULL for a bad selector
+ * @imm: Unused
  *
  * Sets carry flag on overflow (0xFFFF -> 0x0000)
  * Sets zero flag if result is 0
  */
-void __inc(VM *vm, Opcode opcode, Args a1, Args a2) {
-    Reg *reg;
-    int32 result;
-
-    /* Select target register */
-    switch (a1) {
-        case 0x00: reg = &(vm->c.r.ax); break;
-        case 0x01: reg = &(vm->c.r.bx); break;
-        case 0x02: reg = &(vm->c.r.cx); break;
-        case 0x03: reg = &(vm->c.r.dx); break;
-        default:
-            error(vm, ErrInstr);
-    }
-
-    /* Increment with overflow detection */
-    result = $4 *reg + 1;
-    
-    /* Clear arithmetic flags */
-    vm $flags &= 0x0F;
-    
-    /* Set carry flag if overflow */
-    if (result > 0xFFFF)
-        vm $flags |= 0x20;
-    
-    /* Update register */
-    *reg = $2 (result & 0xFFFF);
-    
-    /* Set zero flag if result is 0 */
-    if (*reg == 0)
-        vm $flags |= 0x10;
+static inline void __inc(VM *vm, Reg *reg, Args imm) {
+    (void)imm;
+    if (!reg)
+        error(vm, ErrInstr);
+    opinc(vm, reg);
 
     return;
 }
@@ -363,48 +269,37 @@ void __inc(VM *vm, Opcode opcode, Args a1, Args a2) {
 /*
  * __dec - Decrement register by 1
  * @vm: VM instance
- * @opcode: DEC opcode
- * @a1: Register selector
- * @a2: Unused
+ * @reg: Register, or NULL for a bad selector
+ * @imm: Unused
  *
  * Sets carry flag on underflow (0x0000 -> 0xFFFF)
  * Sets zero flag if result is 0
  */
-void __dec(VM *vm, Opcode opcode, Args a1, Args a2) {
-    Reg *reg;
-    int result;  /* Signed for underflow detection */
-
-    /* Select target register */
-    switch (a1) {
-        case 0x00: reg = &(vm->c.r.ax); break;
-        case 0x01: reg = &(vm->c.r.bx); break;
-        case 0x02: reg = &(vm->c.r.cx); break;
-        case 0x03: reg = &(vm->c.r.dx); break;
-        default:
-            error(vm, ErrInstr);
-    }
-
-    /* Decrement with underflow detection */
-    result = $4 *reg - 1;
-    
-    /* Clear arithmetic flags */
-    vm $flags &= 0x0F;
-    
-    /* Set carry flag if underflow */
-    if (result < 0)
-        vm $flags |= 0x20;
-    
-    /* Update register */
-    *reg = $2 (result & 0xFFFF);
-    
-    /* Set zero flag if result is 0 */
-    if (*reg == 0)
-        vm $flags |= 0x10;
+static inline void __dec(VM *vm, Reg *reg, Args imm) {
+    (void)imm;
+    if (!reg)
+        error(vm, ErrInstr);
+    opdec(vm, reg);
 
     return;
 }
 
+/*
+ * __cmp - Compare register with value
+ * @vm: VM instance
+ * @reg: Register, or NULL for a bad selector
+ * @imm: Value to compare with
+ *
+ * Sets E if equal and G if the register is above, unsigned; Z and C as
+ * sub would, leaving the register alone
+ */
+static inline void __cmp(VM *vm, Reg *reg, Args imm) {
+    if (!reg)
+        error(vm, ErrInstr);
+    opcmp(vm, *reg, imm);
 
+    return;
+}
 
 /* ============================================================================
  * Stack Operations
@@ -413,50 +308,24 @@ void __dec(VM *vm, Opcode opcode, Args a1, Args a2) {
 /*
  * __push - Push register value onto stack
  * @vm: VM instance
- * @opcode: PUSH opcode
- * @a1: Register selector (0x00=ax, 0x01=bx, 0x02=cx, 0x03=dx)
- * @a2: Unused
+ * @reg: Register, or NULL for a bad selector
+ * @imm: Unused
  *
  * Stack grows downward from 0xFFFF
  * Checks for stack overflow and flag conflicts
  */
-void __push(VM *vm, Opcode opcode, Args a1, Args a2) {
-    int16 src;
-    int16 *dst;
-    void *mem;
-
+static inline void __push(VM *vm, Reg *reg, Args imm) {
+    (void)imm;
     if (higher(vm) || lower(vm))
         error(vm, ErrInstr);
     if (vm $sp < 2)
         error(vm, ErrInstr);
     if (vm $sp < (vm->b - 2))
         error(vm, ErrSegv);
+    if (!reg)
+        error(vm, ErrInstr);
 
-    switch (a1) {
-        /* push ax = 0x00 */
-        case 0x00:
-            src = vm $ax;
-            break;
-        /* push bx = 0x01 */
-        case 0x01:
-            src = vm $bx;
-            break;
-        /* push cx = 0x02 */
-        case 0x02:
-            src = vm $cx;
-            break;
-        /* push dx = 0x03 */
-        case 0x03:
-            src = vm $dx;
-            break;
-        default:
-            error(vm, ErrInstr);
-    }
-
-    vm $sp -= 2;
-    mem = vm->m + vm $sp;
-    dst = mem;
-    *dst = src;
+    oppush(vm, *reg);
 
     return;
 }
@@ -464,51 +333,251 @@ void __push(VM *vm, Opcode opcode, Args a1, Args a2) {
 /*
  * __pop - Pop value from stack into register
  * @vm: VM instance
- * @opcode: POP opcode
- * @a1: Register selector (0x00=ax, 0x01=bx, 0x02=cx, 0x03=dx)
- * @a2: Unused
+ * @reg: Register, or NULL for a bad selector
+ * @imm: Unused
  *
  * Checks for stack underflow and flag conflicts
  */
-void __pop(VM *vm, Opcode opcode, Args a1, Args a2) {
-    int16 *src;
-    void *mem;
-
+static inline void __pop(VM *vm, Reg *reg, Args imm) {
+    (void)imm;
     if (higher(vm) || lower(vm))
         error(vm, ErrInstr);
     if (vm $sp > 0xfffd)
         error(vm, ErrInstr);
+    if (!reg)
+        error(vm, ErrInstr);
 
-    mem = vm->m + vm $sp;
-    src = mem;
+    *reg = oppop(vm);
 
-    switch (a1) {
-        /* pop ax = 0x00 */
-        case 0x00:
-            vm $ax = *src;
-            break;
-        /* pop bx = 0x01 */
-        case 0x01:
-            vm $bx = *src;
-            break;
-        /* pop cx = 0x02 */
-        case 0x02:
-            vm $cx = *src;
-            break;
-        /* pop dx = 0x03 */
-        case 0x03:
-            vm $dx = *src;
-            break;
-        default:
-            error(vm, ErrInstr);
-    }
-    vm $sp += 2;
+    return;
+}
+
+/* ============================================================================
+ * Control Transfer
+ * ========================================================================= */
+
+/*
+ * Jumps take their target and set vm $ip to wherever execution goes on,
+ * taken or not; execinstr() leaves it alone for them (OpJump). A jump
+ * out of the program faults on the next instruction, as running off its
+ * end does.
+ */
+
+/* jumpif - Go to @to if @t, else past the instruction @o at vm $ip */
+static inline void jumpif(VM *vm, bool t, Args to, int8 o) {
+    vm $ip = t ? (Reg)to : $2 (vm $ip + isize(vm, o));
+}
+
+static void __jmp(VM *vm, Args imm) {
+    vm $ip = (Reg)imm;
+}
+
+static void __je(VM *vm, Args imm) {
+    jumpif(vm, equal(vm), imm, je);
+}
+
+static void __jne(VM *vm, Args imm) {
+    jumpif(vm, !equal(vm), imm, jne);
+}
+
+static void __jg(VM *vm, Args imm) {
+    jumpif(vm, gt(vm), imm, jg);
+}
+
+static void __jng(VM *vm, Args imm) {
+    jumpif(vm, !gt(vm), imm, jng);
+}
+
+static void __jz(VM *vm, Args imm) {
+    jumpif(vm, zero_flag(vm), imm, jz);
+}
+
+static void __jnz(VM *vm, Args imm) {
+    jumpif(vm, !zero_flag(vm), imm, jnz);
+}
+
+static void __jc(VM *vm, Args imm) {
+    jumpif(vm, carry_flag(vm), imm, jc);
+}
+
+static void __jnc(VM *vm, Args imm) {
+    jumpif(vm, !carry_flag(vm), imm, jnc);
+}
+
+/*
+ * __call - Push the address of the next instruction and jump
+ * @vm: VM instance
+ * @imm: Target
+ *
+ * Checks the stack as push does; H and L do not matter
+ */
+static void __call(VM *vm, Args imm) {
+    if (vm $sp < 2)
+        error(vm, ErrInstr);
+    if (vm $sp < (vm->b - 2))
+        error(vm, ErrSegv);
+
+    oppush(vm, $2 (vm $ip + isize(vm, call)));
+    vm $ip = (Reg)imm;
 
     return;
 }
 
+/*
+ * __ret - Pop the return address into IP
+ * @vm: VM instance
+ * @imm: Unused
+ */
+static void __ret(VM *vm, Args imm) {
+    (void)imm;
+    if (vm $sp > 0xfffd)
+        error(vm, ErrInstr);
+
+    vm $ip = oppop(vm);
+
+    return;
+}
+
+/*
+ * __loop - Decrement CX and jump unless it reached zero
+ * @vm: VM instance
+ * @imm: Target
+ *
+ * Leaves the flags alone
+ */
+static void __loop(VM *vm, Args imm) {
+    jumpif(vm, --vm $cx != 0, imm, loop);
+}
+
+/* ============================================================================
+ * Opcode Table
+ * ========================================================================= */
+
+/*
+ * Per-register variants of the handlers that take a register, generated
+ * from h-isa.h. Each passes its register as a constant, so there is no
+ * register selection left at run time; name_bad takes a bad selector.
+ */
+#define VARIANTS_RegNone(name, n)
+#define VARIANTS_RegOp(name, n) \
+    _Static_assert((n) == 4, #name ": RegOp rows need one opcode per register"); \
+    static void name##_ax(VM *vm, Args imm) { __##name(vm, &vm $ax, imm); } \
+    static void name##_bx(VM *vm, Args imm) { __##name(vm, &vm $bx, imm); } \
+    static void name##_cx(VM *vm, Args imm) { __##name(vm, &vm $cx, imm); } \
+    static void name##_dx(VM *vm, Args imm) { __##name(vm, &vm $dx, imm); }
+#define VARIANTS_RegArg(name, n) \
+    VARIANTS_RegOp(name, 4) \
+    static void name##_bad(VM *vm, Args imm) { __##name(vm, (Reg *)0, imm); }
+#define VARIANTS(name, op, n, lay, reg, f, mnem) VARIANTS_##reg(name, n)
+
+ISA(VARIANTS)
+
+/* Opcode descriptors indexed by opcode byte */
+#define DESC_RegNone(name, op, n, lay, f, mnem) \
+    [op ... (op) + (n) - 1] = { laysize(lay), lay, RegNone, f, mnem },
+#define DESC_RegArg(name, op, n, lay, f, mnem) \
+    [op ... (op) + (n) - 1] = { laysize(lay), lay, RegArg, f, mnem },
+#define DESC_RegOp(name, op, n, lay, f, mnem) \
+    [op]       = { laysize(lay), lay, RegOp + 0, f, mnem }, \
+    [(op) + 1] = { laysize(lay), lay, RegOp + 1, f, mnem }, \
+    [(op) + 2] = { laysize(lay), lay, RegOp + 2, f, mnem }, \
+    [(op) + 3] = { laysize(lay), lay, RegOp + 3, f, mnem },
+#define DESC(name, op, n, lay, reg, f, mnem) DESC_##reg(name, op, n, lay, f, mnem)
+
+OD optable[256] = { ISA(DESC) };
+
+/*
+ * Dispatch table - the handler for each opcode and register selector,
+ * the fifth column taking a bad selector. Rows without a selector have
+ * the same handler in every column.
+ */
+#define ALL(h) { h, h, h, h, h }
+#define HANDLERS_RegNone(name, op, n) \
+    [op ... (op) + (n) - 1] = ALL(__##name),
+#define HANDLERS_RegArg(name, op, n) \
+    [op ... (op) + (n) - 1] = \
+        { name##_ax, name##_bx, name##_cx, name##_dx, name##_bad },
+#define HANDLERS_RegOp(name, op, n) \
+    [op] = ALL(name##_ax), [(op) + 1] = ALL(name##_bx), \
+    [(op) + 2] = ALL(name##_cx), [(op) + 3] = ALL(name##_dx),
+#define HANDLERS(name, op, n, lay, reg, f, mnem) HANDLERS_##reg(name, op, n)
+
+static const Handler handlers[256][5] = { ISA(HANDLERS) };
+
+/* ============================================================================
+ * Guard Page
+ * ========================================================================= */
+
+/*
+ * Guest memory is followed by an inaccessible page. A 16-bit address
+ * cannot leave memory, so the only access that can is a word at 0xffff.
+ * Loads and stores test for it until guardpage() has installed
+ * onguard(); from then on the fast engines leave the test out (see
+ * fastload()) and the access faults in hardware instead. The host
+ * fault becomes an ErrSegv of the VM that tryexecute() is running on
+ * the faulting thread, or, in compiled code, a side exit back to the
+ * interpreter (see jitfault()). execute() and execinstr() keep the
+ * test. The handler is opt-in because it is process-wide: a host with
+ * its own SIGSEGV handling decides whether to share it.
+ */
+bool guarded;                       /* onguard() is installed */
+static __thread VM *running         /* Innermost tryexecute() on this thread */
+    __attribute__((tls_model("initial-exec")));    /* Safe in a handler */
+static struct sigaction hostsegv;   /* SIGSEGV disposition we replaced */
+static size_t guard;                /* Guard size, one page */
+static pthread_mutex_t guardlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* onguard - SIGSEGV handler; faults of anything but a guard go on */
+static void onguard(int sig, siginfo_t *si, void *ctx) {
+    int8 *a;
+    VM *vm;
+
+    a = (int8 *)si->si_addr;
+    vm = running;
+    if (vm && a >= vm->m + sizeof(Memory)
+            && a < vm->m + sizeof(Memory) + guard) {
+        if (jitfault(vm, ctx))
+            return;     /* Resumes in the side exit of the access */
+        segfault(vm);
+    }
+
+    if (hostsegv.sa_flags & SA_SIGINFO)
+        hostsegv.sa_sigaction(sig, si, ctx);
+    else if (hostsegv.sa_handler != SIG_DFL && hostsegv.sa_handler != SIG_IGN)
+        hostsegv.sa_handler(sig);
+    else
+        signal(SIGSEGV, SIG_DFL);   /* The access is retried and kills us */
 
+    return;
+}
 
+/*
+ * guardpage - Install onguard(), so loads and stores skip their check
+ * Returns: true, or false if the handler could not be installed
+ *
+ * Call it before running VMs, and again after installing another
+ * SIGSEGV handler to put onguard() back in front of it. Whatever it
+ * displaces receives the faults it does not recognise.
+ */
+bool guardpage(void) {
+    struct sigaction sa, old;
+    bool ok;
+
+    guard = pageup(1);
+    zero($1 &sa, sizeof(sa));
+    sa.sa_sigaction = onguard;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;  /* error() does not return */
+    sigemptyset(&sa.sa_mask);
+    pthread_mutex_lock(&guardlock);
+    ok = !sigaction(SIGSEGV, &sa, &old);
+    if (ok && !((old.sa_flags & SA_SIGINFO) && old.sa_sigaction == onguard))
+        hostsegv = old;
+    if (ok)
+        guarded = true;
+    pthread_mutex_unlock(&guardlock);
+
+    return ok;
+}
 
 /* ============================================================================
  * VM Core Functions
@@ -517,21 +586,51 @@ void __pop(VM *vm, Opcode opcode, Args a1, Args a2) {
 /*
  * virtualmachine - Allocate and initialize a new VM
  * Returns: Pointer to initialized VM, or NULL on error
+ *
+ * The VM is one anonymous mapping laid out so that m starts on a page
+ * boundary, the other fields filling the end of the page(s) before it,
+ * and the guard page following it. Its pages can then be replaced by a
+ * snapshot's (see h-snap.c).
+ *
+ * Memory is reserved, not committed: a page costs nothing until the
+ * guest writes to it, and pages only read map the kernel's shared zero
+ * page. A VM running a small program holds a few pages, not 64KB.
  */
 VM *virtualmachine(void) {
-    VM *p;
-    int16 size;
+    size_t head;
+    int8 *p;
+    VM *vm;
 
-    size = $2 sizeof(struct s_vm);
-    p = (VM *)malloc($i size);
-    if (!p) {
+    head = pageup(offsetof(VM, m));
+    p = mmap(0, head + pageup(sizeof(Memory)) + pageup(1), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        errno = ErrMem;
+        return (VM *)0;
+    }
+    vm = (VM *)(p + head - offsetof(VM, m));
+    if (mprotect(vm->m + sizeof(Memory), pageup(1), PROT_NONE)) {
+        munmap(p, head + pageup(sizeof(Memory)) + pageup(1));
         errno = ErrMem;
         return (VM *)0;
     }
-    zero($1 p, size);
-    p $sp = 0xffff;  /* Stack starts at top of memory */
+    vm $sp = 0xffff;  /* Stack starts at top of memory */
+    vm->fuel = FUELMAX;
+
+    return vm;
+}
 
-    return p;
+/*
+ * wipe - Zero all of @vm's memory and release its pages
+ * Returns: false if the memory could not be mapped; @vm is then unusable
+ *
+ * Cheaper than zeroing for all but the smallest ranges, and leaves
+ * memory uncommitted again, including memory shared with a snapshot.
+ */
+bool wipe(VM *vm) {
+    return mmap(vm->m, pageup(sizeof(Memory)), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+        != MAP_FAILED;
 }
 
 /*
@@ -540,27 +639,25 @@ VM *virtualmachine(void) {
  * Returns: Size of instruction in bytes, or 0 if not found
  */
 int8 map(Opcode o) {
-    int8 n, ret;
-    IM *p;
-
-    ret = 0;
-    for (n = IMs, p = instrmap; n; n--, p++)
-        if (p->o == o) {
-            ret = p->s;
-            break;
-        }
-    
-    return ret;
+    return optable[(int8)o].s;
 }
 
 /*
  * error - Handle VM errors and exit
  * @vm: VM instance
  * @e: Error code
+ *
+ * Inside tryexecute() the VM is left intact and control returns there
+ * with @e instead.
  */
 void error(VM* vm, Errorcode e) {
     int8 exitcode;
 
+    if (vm && vm->trap) {
+        vm->status = e;
+        longjmp(*vm->trap, 1);
+    }
+
     exitcode = -1;
     switch(e) {
         case ErrSegv:
@@ -571,6 +668,10 @@ void error(VM* vm, Errorcode e) {
             fprintf(stderr, "%s\n", "VM Illegal instruction");
             break;
 
+        case SysFuel:
+            fprintf(stderr, "%s\n", "VM Instruction budget exhausted");
+            break;
+
         case SysHlt:
             fprintf(stderr, "%s\n", "System halted");
             exitcode = 0;
@@ -593,301 +694,586 @@ void error(VM* vm, Errorcode e) {
             break;
     }
     if (vm)
-        free(vm);
+        freevm(vm);
 
     exit($i exitcode);
 }
 
-/* ============================================================================
- * Instruction Builder Functions
- * ========================================================================= */
-
 /*
- * i0 - Create instruction with no arguments
- * @op: Opcode
- * Returns: Pointer to instruction
+ * freevm - Release @vm and everything attached to it
  */
-Instruction *i0(Opcode op) {
-    Instruction *i;
-    int8 size;
-
-    size = map(op);
-    i = (Instruction *)malloc(size);
-    assert(i);
-    zero($1 i, size);
-    i->o = op;
+void freevm(VM *vm) {
+    detach(vm);
+    free(vm->uc);
+    freeblocks(vm);
+    freejit(vm);
+    freeprof(vm);
+    dropstarts(vm->starts);
+    munmap(vm->m - pageup(offsetof(VM, m)),
+        pageup(offsetof(VM, m)) + pageup(sizeof(Memory)) + pageup(1));
 
-    return i;
+    return;
 }
 
 /*
- * i1 - Create instruction with one argument
- * @op: Opcode
- * @a1: First argument
- * Returns: Pointer to instruction
+ * tryexecute - Run @vm on @eng until it stops, without exiting
+ * @vm: VM instance
+ * @eng: Execution engine
+ * Returns: SysHlt, or the error code of the fault that stopped it
+ *
+ * Nothing is printed or freed; the VM can be inspected, reset and run
+ * again. Only here does a guard page fault become ErrSegv (see
+ * guardpage()); elsewhere it is an ordinary host crash.
  */
-Instruction *i1(Opcode op, Args a1) {
-    Instruction *i;
-    int8 size;
-
-    size = map(op);
-    i = (Instruction *)malloc(size);
-    assert(i);
-    zero($1 i, size);
-    i->o = op;
-    i->a[0] = a1;
-
-    return i;
+Errorcode tryexecute(VM *vm, Engine *eng) {
+    jmp_buf trap, *outer;
+    VM *prev;
+
+    outer = vm->trap;
+    prev = running;
+    vm->trap = &trap;
+    vm->status = NoErr;
+    running = vm;
+    if (!setjmp(trap))
+        eng->run(vm);
+    running = prev;
+    vm->trap = outer;
+
+    return vm->status;
 }
 
 /*
- * i2 - Create instruction with two arguments
- * @op: Opcode
- * @a1: First argument
- * @a2: Second argument
- * Returns: Pointer to instruction
+ * tryexecutefor - tryexecute() for at most @budget instructions
+ * @vm: VM instance
+ * @eng: Execution engine
+ * @budget: Instructions to run, or FUELMAX for no limit
+ * Returns: As tryexecute(), or SysFuel when the budget ran out
+ *
+ * After SysFuel the VM is intact and the next call continues from
+ * vm $ip, on this or any other engine.
  */
-Instruction *i2(Opcode op, Args a1, Args a2) {
-    Instruction *i;
-    int8 size;
+Errorcode tryexecutefor(VM *vm, Engine *eng, int64 budget) {
+    Errorcode e;
 
-    size = map(op);
-    i = (Instruction *)malloc(size);
-    assert(i);
-    zero($1 i, size);
-    i->o = op;
-    i->a[0] = a1;
-    i->a[1] = a2;
+    vm->fuel = budget;
+    e = tryexecute(vm, eng);
+    vm->fuel = FUELMAX;
 
-    return i;
+    return e;
 }
 
+/* ============================================================================
+ * Execution Engine
+ * ========================================================================= */
+
 /*
- * i - Convert instruction to program bytes
- * @i: Instruction to convert
- * Returns: Pointer to program bytes
+ * execinstr - Execute a single instruction
+ * @vm: VM instance
+ * @p: Pointer to instruction in memory
+ *
+ * Decodes the operands as decodeop() or decodeword() does and dispatches
+ * to the variant of the instruction's handler for its register selector
+ * Returns: Size of the executed instruction, or 0 for a jump, which has
+ * set vm $ip itself
+ *
+ * Memory instructions are passed their effective address, see memop().
  */
-Program *i(Instruction *i) {
-    Program *p;
-    int8 size;
+int8 execinstr(VM* vm, Program *p) {
+    Args sel, imm;
+    int32 w;
+    OD *d;
+
+    /* One load, no layout switch */
+    if (vm->enc == EncWord) {
+        copy($1 &w, p, WORDSIZE);
+        d = &optable[w & 0xff];
+        if (!d->s)
+            segfault(vm);
+        sel = (w >> 8) & 0xff;
+        imm = (Args)(w >> 16);
+        if (d->l == LayMem)
+            sel = memop(vm, sel, &imm);
+        handlers[w & 0xff][(sel < 4) ? sel : 4](vm, imm);
+        return (d->f & OpJump) ? 0 : WORDSIZE;
+    }
 
-    size = map(i->o);
-    p = (Program *)malloc($i size);
-    assert(p);
-    copy(p, $1 i, 1);
-    copy((p+1), $1 i->a, (size-1));
+    d = &optable[*p];
+    sel = imm = 0;
+    switch (d->l) {
+        case LayNone:
+            break;
+
+        case LayByte:
+            sel = *(p+1);
+            break;
+
+        case LayWord:
+        case LayWordWord:
+            imm = sel = (Args)((*(p+2) << 8) | *(p+1));
+            break;
+
+        case LayRegImm:
+            sel = *(p+1);
+            imm = *(p+3);
+            break;
+
+        case LayMem:
+            imm = (Args)((*(p+4) << 8) | *(p+3));
+            sel = memop(vm, *(p+1), &imm);
+            break;
 
-    return p;
+        default:
+            segfault(vm);
+            break;
+    }
+    handlers[*p][(sel < 4) ? sel : 4](vm, imm);
+
+    return (d->f & OpJump) ? 0 : d->s;
 }
 
 /*
- * exampleprogram - Load variadic program into VM memory
+ * execute - Main execution loop
  * @vm: VM instance
- * @...: Variable number of Program* pointers, ending with hlt
- * Returns: Pointer to end of program
+ *
+ * Executes instructions from memory, starting at $ip, until hlt or a
+ * fault calls error(); it does not return. Other engines continue a run
+ * here, when code memory may have been stored over, so nothing is
+ * assumed about its contents, not even that an instruction is still
+ * there once it has run.
  */
-Program *exampleprogram(VM *vm, ...) {
-    Program *p, *instr;
-    va_list ap;
-    Opcode opc;
-    int8 size;
+void execute(VM *vm) {
+    Program *pp, *brk;
+    int16 size;
 
-    va_start(ap, vm);
-    p = vm->m;
+    assert(vm);
+    brk = vm->m + vm->b;
 
-    do {
-        instr = va_arg(ap, Program*);
-        opc = (Opcode)*instr;
-        size = map(opc);
-        copy($1 p, $1 instr, size);
-        p += size;
-        vm->b += size;
-    } while(opc != hlt);
-    va_end(ap);
+    for (;;) {
+        pp = vm->m + vm $ip;
 
-    return p;
+        burn(vm);
+        if (pp > brk)
+            segfault(vm);
+        size = execinstr(vm, pp);
+        vm $ip += size;
+    }
 }
 
 /* ============================================================================
- * Execution Engine
+ * Threaded Execution Engine
  * ========================================================================= */
 
 /*
- * execinstr - Execute a single instruction
+ * executethreaded - Direct-threaded execution loop
  * @vm: VM instance
- * @p: Pointer to instruction in memory
  *
- * Parses instruction arguments and dispatches to appropriate handler
+ * Same semantics as execute(), but each opcode has its own label that
+ * decodes its operands inline and ends with its own indirect jump to the
+ * next handler (GCC labels-as-values), so there is no central switch and
+ * no call per instruction. EncWord code runs on executeuops().
  */
-void execinstr(VM* vm, Program *p) {
+void executethreaded(VM *vm) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"    /* l_bad, then each row */
+    static void *checked[256] = ISALABELS, *unchecked[256] = ISAFASTLABELS;
+#pragma GCC diagnostic pop
+    Program *pp, *brk;
+    void **labels;
     Args a1, a2;
-    int16 size;
+    int64 fuel;
+    Reg *reg;
 
-    a1 = a2 = 0;
-    size = map(*p);
+#define word(p) ((Args)(((int16)*((p)+2) << 8) | (int16)*((p)+1)))
+#define mem(p) word((p)+2)
+#define next(n) do { \
+        vm $ip += (n); \
+        pp += (n); \
+        if (__builtin_expect(!fuel--, 0)) \
+            goto l_fuel; \
+        if (pp > brk) \
+            segfault(vm); \
+        goto *labels[*pp]; \
+    } while (0)
+#define jump(to) do { \
+        vm $ip = (to); \
+        pp = vm->m + vm $ip; \
+        next(0); \
+    } while (0)
 
-    switch (size) {
-        case 1:
-            break;
+    assert(vm && *vm->m);
+    /* Labels decode EncVar; word code is as fast from micro-ops */
+    if (vm->enc == EncWord) {
+        executeuops(vm);
+        return;
+    }
+    labels = guarded ? unchecked : checked;
+    brk = vm->m + vm->b;
+    pp = vm->m + vm $ip;
+    fuel = vm->fuel;
+    next(0);
 
-        case 2:
-            a1 = *(p+1);
-            break;
+/* The budget lives in a register; only a stop for it needs it stored */
+l_fuel:
+    vm->fuel = 0;
+    error(vm, SysFuel);
 
-        case 3:
-            a1 = (
-                (((int16)*(p+2) & 0xff) << 8)
-                    | ((int16)*(p+1) & 0xff)
-            );
-            break;
+l_bad:
+    segfault(vm);
 
-        case 4:
-            /* For 4-byte instructions created with i2(op, reg, value):
-             * Memory layout: [op][a0_lo][a0_hi][a1_lo]
-             * where a0=register (we only need low byte), a1=value (only low byte available)
-             * 
-             * Since i2 stores 16-bit args and we copy 3 bytes, we get:
-             * p+1 = low byte of a[0] (register)
-             * p+2 = high byte of a[0] (should be 0)
-             * p+3 = low byte of a[1] (value)
-             * 
-             * For small values this works, but we need to fix this properly
-             * by only reading the low byte as the value.
-             */
-            a1 = *(p+1);  /* Register selector (low byte of a[0]) */
-            a2 = *(p+3);  /* Value (low byte of a[1]) */
-            break;
+l_nop:
+    next(nop_size);
 
-        case 5:
-            a1 = (
-                (((int16)*(p+2) & 0xff) << 8)
-                    | ((int16)*(p+1) & 0xff)
-            );
+l_hlt:
+    error(vm, SysHlt);
 
-            a2 = (
-                (((int16)*(p+4) & 0xff) << 8)
-                    | ((int16)*(p+3) & 0xff)
-            );
-            break;
+l_mov:
+    if (higher(vm) && lower(vm))
+        error(vm, ErrInstr);
+    opmov(vm, regsel(vm, *pp - mov), word(pp));
+    next(mov_size);
 
-        default:
-            segfault(vm);
+l_movsp:
+    if (higher(vm) && lower(vm))
+        error(vm, ErrInstr);
+    vm $sp = (Reg)word(pp);
+    next(movsp_size);
+
+l_ld:
+    a2 = mem(pp);
+    if (higher(vm) && lower(vm))
+        error(vm, ErrInstr);
+    if (!(reg = regsel(vm, memop(vm, *(pp+1), &a2))))
+        error(vm, ErrInstr);
+    opmov(vm, reg, opload(vm, a2));
+    next(ld_size);
+
+l_st:
+    a2 = mem(pp);
+    if (higher(vm) && lower(vm))
+        error(vm, ErrInstr);
+    if (!(reg = regsel(vm, memop(vm, *(pp+1), &a2))))
+        error(vm, ErrInstr);
+    opstore(vm, a2, *reg);
+    next(st_size);
+
+/* ld and st once guardpage() has been called: no test for 0xffff */
+l_ldfast:
+    a2 = mem(pp);
+    if (higher(vm) && lower(vm))
+        error(vm, ErrInstr);
+    if (!(reg = regsel(vm, memop(vm, *(pp+1), &a2))))
+        error(vm, ErrInstr);
+    opmov(vm, reg, fastload(vm, a2));
+    next(ld_size);
+
+l_stfast:
+    a2 = mem(pp);
+    if (higher(vm) && lower(vm))
+        error(vm, ErrInstr);
+    if (!(reg = regsel(vm, memop(vm, *(pp+1), &a2))))
+        error(vm, ErrInstr);
+    faststore(vm, a2, *reg);
+    next(st_size);
+
+l_lea:
+    a2 = mem(pp);
+    if (!(reg = regsel(vm, memop(vm, *(pp+1), &a2))))
+        error(vm, ErrInstr);
+    *reg = (Reg)a2;
+    next(lea_size);
+
+l_ste: vm $flags |= 0x08; next(ste_size);
+l_cle: opclf(vm, 0x07); next(cle_size);
+l_stg: vm $flags |= 0x04; next(stg_size);
+l_clg: opclf(vm, 0x0c); next(clg_size);
+l_sth: vm $flags |= 0x02; next(sth_size);
+l_clh: opclf(vm, 0x0d); next(clh_size);
+l_stl: vm $flags |= 0x01; next(stl_size);
+l_cll: opclf(vm, 0x0e); next(cll_size);
+
+l_push:
+    a1 = word(pp);
+    if (higher(vm) || lower(vm) || vm $sp < 2)
+        error(vm, ErrInstr);
+    if (vm $sp < (vm->b - 2))
+        error(vm, ErrSegv);
+    if (!(reg = regsel(vm, a1)))
+        error(vm, ErrInstr);
+    oppush(vm, *reg);
+    next(push_size);
+
+l_pop:
+    a1 = word(pp);
+    if (higher(vm) || lower(vm) || vm $sp > 0xfffd)
+        error(vm, ErrInstr);
+    if (!(reg = regsel(vm, a1)))
+        error(vm, ErrInstr);
+    *reg = oppop(vm);
+    next(pop_size);
+
+l_add:
+    if (!(reg = regsel(vm, *(pp+1))))
+        error(vm, ErrInstr);
+    opadd(vm, reg, *(pp+3));
+    next(add_size);
+
+l_sub:
+    if (!(reg = regsel(vm, *(pp+1))))
+        error(vm, ErrInstr);
+    opsub(vm, reg, *(pp+3));
+    next(sub_size);
+
+l_mul:
+    if (!(reg = regsel(vm, *(pp+1))))
+        error(vm, ErrInstr);
+    opmul(vm, reg, *(pp+3));
+    next(mul_size);
+
+l_div_op:
+    a2 = *(pp+3);
+    if (a2 == 0 || !(reg = regsel(vm, *(pp+1))))
+        error(vm, ErrInstr);
+    opdiv(vm, reg, a2);
+    next(div_op_size);
+
+l_inc:
+    if (!(reg = regsel(vm, *(pp+1))))
+        error(vm, ErrInstr);
+    opinc(vm, reg);
+    next(inc_size);
+
+l_dec:
+    if (!(reg = regsel(vm, *(pp+1))))
+        error(vm, ErrInstr);
+    opdec(vm, reg);
+    next(dec_size);
+
+l_cmp:
+    if (!(reg = regsel(vm, *(pp+1))))
+        error(vm, ErrInstr);
+    opcmp(vm, *reg, *(pp+3));
+    next(cmp_size);
+
+l_jmp:
+    jump(word(pp));
+
+/* The conditional jumps are all the same size */
+l_je: l_jne: l_jg: l_jng: l_jz: l_jnz: l_jc: l_jnc:
+    if (taken(vm, *pp))
+        jump(word(pp));
+    next(je_size);
+
+/* The push may overwrite the operand; the target is read before it */
+l_call:
+    if (vm $sp < 2)
+        error(vm, ErrInstr);
+    if (vm $sp < (vm->b - 2))
+        error(vm, ErrSegv);
+    a2 = word(pp);
+    oppush(vm, $2 (vm $ip + call_size));
+    jump(a2);
+
+l_ret:
+    if (vm $sp > 0xfffd)
+        error(vm, ErrInstr);
+    jump(oppop(vm));
+
+l_loop:
+    if (--vm $cx)
+        jump(word(pp));
+    next(loop_size);
+
+#undef jump
+#undef next
+#undef mem
+#undef word
+}
+
+/* ============================================================================
+ * Predecoded Execution Engine
+ * ========================================================================= */
+
+/*
+ * decode - Decode the instruction at @ip into a micro-op
+ * @vm: VM instance
+ * @ip: Guest address of the instruction
+ * @u: Micro-op to fill
+ */
+void decode(VM *vm, int16 ip, Uop *u) {
+    if (vm->enc == EncWord)
+        decodeword(vm->m + ip, u);
+    else
+        decodeop(vm->m + ip, u);
+    u->next = ip + isize(vm, vm->m[ip]);
+
+    return;
+}
+
+/* decodeuop - Decode the instruction at @ip into its cache slot */
+static Uop *decodeuop(VM *vm, int16 ip) {
+    Uop *u;
+
+    own(vm);
+    u = &vm->uc->u[ip];
+    decode(vm, ip, u);
+
+    return u;
+}
+
+/*
+ * predecode - Build the micro-op cache for the loaded program
+ * @vm: VM instance with its program in memory and vm->b set
+ *
+ * Walks the code once from address 0; instructions reached any other
+ * way, or running off the end of memory, are decoded on first
+ * execution.
+ */
+void predecode(VM *vm) {
+    int32 n, ip;
+    int8 s;
+
+    own(vm);
+    n = $4 vm->b + 1;
+    free(vm->uc);
+    vm->uc = (UC *)malloc(sizeof(UC) + n * sizeof(Uop));
+    if (!vm->uc)
+        error(vm, ErrMem);
+    vm->uc->n = n;
+    zero($1 vm->uc->u, $i (n * sizeof(Uop)));
+
+    for (ip = 0; ip < vm->b; ip += s) {
+        if (!(s = isize(vm, vm->m[ip])) || ip + s > sizeof(Memory))
             break;
+        decodeuop(vm, $2 ip);
     }
 
-    switch (*p) {
-        case mov: 
-        case 0x09 ... 0x0f:
-            __mov(vm, (Opcode)*p, a1, a2);
-            break;
+    return;
+}
 
-        case nop:
-            break;
-        
-        case hlt:
-            error(vm, SysHlt);
-            break;
+/*
+ * invalidate - Drop cached translations of a modified code range
+ * @vm: VM instance
+ * @addr: First modified address
+ * @len: Number of modified bytes
+ *
+ * Any micro-op starting up to 4 bytes before @addr may cover it; the
+ * block cache is flushed whole if any translated block overlaps.
+ */
+void invalidate(VM *vm, int16 addr, int16 len) {
+    int32 lo, hi, ip;
+
+    own(vm);
+    if (vm->uc) {
+        lo = (addr > 4) ? $4 addr - 4 : 0;
+        hi = $4 addr + len;
+        if (hi > vm->uc->n)
+            hi = vm->uc->n;
+        for (ip = lo; ip < hi; ip++)
+            vm->uc->u[ip].next = 0;
+    }
+    if (vm->bc && addr < vm->bc->hi && $4 addr + len > vm->bc->lo)
+        flushblocks(vm);
+
+    return;
+}
 
-        case ste:    __ste(vm, (Opcode)*p, a1, a2); break;
-        case stg:    __stg(vm, (Opcode)*p, a1, a2); break;
-        case sth:    __sth(vm, (Opcode)*p, a1, a2); break;
-        case stl:    __stl(vm, (Opcode)*p, a1, a2); break;
-        case cle:    __cle(vm, (Opcode)*p, a1, a2); break;
-        case clg:    __clg(vm, (Opcode)*p, a1, a2); break;
-        case clh:    __clh(vm, (Opcode)*p, a1, a2); break;
-        case cll:    __cll(vm, (Opcode)*p, a1, a2); break;
-        case push:  __push(vm, (Opcode)*p, a1, a2); break;
-        case pop:    __pop(vm, (Opcode)*p, a1, a2); break;
-        
-        /* Arithmetic operations */
-        case add:    __add(vm, (Opcode)*p, a1, a2); break;
-        case sub:    __sub(vm, (Opcode)*p, a1, a2); break;
-        case mul:    __mul(vm, (Opcode)*p, a1, a2); break;
-        case div_op: __div(vm, (Opcode)*p, a1, a2); break;
-        case inc:    __inc(vm, (Opcode)*p, a1, a2); break;
-        case dec:    __dec(vm, (Opcode)*p, a1, a2); break;
+/*
+ * dropcaches - Forget everything translated from the current code
+ *
+ * For when the code is replaced as a whole; the JIT arena is kept.
+ */
+void dropcaches(VM *vm) {
+    if (vm->img) {
+        detach(vm);
+        return;
     }
+    free(vm->uc);
+    vm->uc = (UC *)0;
+    if (vm->bc)
+        flushblocks(vm);
 
     return;
 }
 
 /*
- * execute - Main execution loop
+ * executeuops - Execution loop over predecoded micro-ops
  * @vm: VM instance
  *
- * Executes instructions from memory until HLT is encountered
+ * Same semantics as execute(); operands come from the micro-op cache
+ * instead of being reassembled from program bytes on every step.
+ * Invalidated slots are decoded again on first execution.
  */
-void execute(VM *vm) {
-    int32 brkaddr;
-    Program *pp;
-    int16 size;
+void executeuops(VM *vm) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"    /* l_bad, then each row */
+    static void *checked[256] = UOPLABELS, *unchecked[256] = UOPFASTLABELS;
+#pragma GCC diagnostic pop
+    void **labels;
+    int16 nip;
+    Reg *reg;
+    Uop *u;
+
+    /* nip is latched before the handler runs: a store may invalidate u */
+#define next() do { \
+        vm $ip = nip; \
+        dispatch(); \
+    } while (0)
+#define dispatch() do { \
+        burn(vm); \
+        if (vm $ip > vm->b) \
+            segfault(vm); \
+        u = &vm->uc->u[vm $ip]; \
+        if (!u->next) \
+            u = decodeuop(vm, vm $ip); \
+        nip = u->next; \
+        goto *labels[u->o]; \
+    } while (0)
+#define stored()
+#define skip(k) __builtin_unreachable()     /* predecode() does not fuse */
 
     assert(vm && *vm->m);
-    size = 0;
-    brkaddr = ((int32)vm->m + vm->b);
-    pp = (Program *)&vm->m;
-
-    do {
-        vm $ip += size;
-        pp += size;
+    if (!vm->uc || vm->uc->n <= vm->b)
+        predecode(vm);
+    labels = guarded ? unchecked : checked;
+    dispatch();
 
-        if ((int32)pp > brkaddr)
-            segfault(vm);
-        size = map(*pp);
-        execinstr(vm, pp);
-    } while (*pp != (Opcode)hlt);
+#include "h-uops.inc"
 
-    return;
+#undef skip
+#undef stored
+#undef dispatch
+#undef next
 }
 
 /* ============================================================================
- * Main Entry Point
+ * Engine Selection
  * ========================================================================= */
 
+/* Available engines; the first entry is the reference implementation */
+Engine engines[] = {
+    { "switch",   execute },
+    { "threaded", executethreaded },
+    { "uops",     executeuops },
+    { "blocks",   executeblocks },
+    { "jit",      executejit },
+    { "verified", executeverified },
+    { "profile",  executeprofile },
+    { 0, 0 }
+};
+
 /*
- * main - Entry point with arithmetic test program
- *
- * Test program:
- *   mov ax, 0x05     ; ax = 5
- *   add ax, 0x03     ; ax = 8 (5+3)
- *   sub ax, 0x02     ; ax = 6 (8-2)
- *   mul ax, 0x02     ; ax = 12 (6*2)
- *   div ax, 0x03     ; ax = 4 (12/3)
- *   inc ax           ; ax = 5
- *   dec ax           ; ax = 4
- *   hlt
- */
-int main(int argc, char *argv[]) {
-    Program *prog;
-    VM *vm;
+ * engine - Look up an execution engine by name
+ * @name: Engine name
+ * Returns: Engine descriptor, or NULL if unknown
+ */
+Engine *engine(const char *name) {
+    Engine *e;
+
+    for (e = engines; e->name; e++)
+        if (!strcmp(e->name, name))
+            return e;
 
-    vm = virtualmachine();
-    prog = exampleprogram(vm,
-        /* mov ax, 0x05 */
-        i(i1(mov, 0x05)),
-        /* add ax, 0x03 */
-        i(i2(add, 0x00, 0x03)),
-        /* sub ax, 0x02 */
-        i(i2(sub, 0x00, 0x02)),
-        /* mul ax, 0x02 */
-        i(i2(mul, 0x00, 0x02)),
-        /* div ax, 0x03 */
-        i(i2(div_op, 0x00, 0x03)),
-        /* inc ax */
-        i(i1(inc, 0x00)),
-        /* dec ax */
-        i(i1(dec, 0x00)),
-        
-        i(i0(hlt)) 
-    );
-    printf("vm   = %p (sz: %d)\n", vm, sizeof(struct s_vm));
-    printf("prog = %p\n", prog);
-
-    execute(vm);
-
-    printhex($1 prog, (map(mov)+map(nop)+map(hlt)), ' ');
-
-    return 0;
+    return (Engine *)0;
 }
 
 #pragma GCC diagnostic pop
\ No newline at end of file
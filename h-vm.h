@@ -16,7 +16,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <setjmp.h>
 #include "h-utils.h"
+#include "h-isa.h"
 
 #pragma GCC diagnostic ignored "-Wstringop-truncation"
 #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
@@ -50,6 +52,7 @@ typedef unsigned long long int int64;
 #define ErrMem      0x02    /* Memory allocation error */
 #define ErrSegv     0x04    /* Segmentation fault */
 #define ErrInstr    0x08    /* Illegal instruction */
+#define SysFuel     0x40    /* Instruction budget exhausted; resumable */
 
 typedef unsigned char Errorcode;
 
@@ -61,7 +64,7 @@ typedef unsigned char Errorcode;
  * Architecture Overview:
  *   16-bit registers: AX, BX, CX, DX, SP, IP
  *   FLAGS register with condition flags
- *   65KB memory (full 16-bit address space)
+ *   64KB memory (full 16-bit address space)
  */
 
 typedef unsigned short int Reg;
@@ -84,8 +87,27 @@ struct s_registers {
 };
 typedef struct s_registers Registers;
 
+/*
+ * Lazy Z/C flags - arithmetic records which rule derives Z and C from
+ * its untruncated result instead of updating FLAGS itself; evalflags()
+ * folds the record into FLAGS when they are read.
+ */
+enum e_lazy {
+    LazyNone = 0,   /* FLAGS are current */
+    LazyAdd,        /* C = res > 0xffff (add, mul, inc) */
+    LazySub,        /* C = (int)res < 0 (sub, dec) */
+    LazyDiv         /* C = 0 (div) */
+};
+
+struct s_lazy {
+    int32 res;  /* Untruncated result of the last arithmetic op */
+    int8 op;    /* enum e_lazy */
+};
+typedef struct s_lazy Lazy;
+
 struct s_cpu {
     Registers r;
+    Lazy lf;    /* Pending Z/C */
 };
 typedef struct s_cpu CPU;
 
@@ -93,16 +115,168 @@ typedef struct s_cpu CPU;
  * Memory and VM Structures
  * ========================================================================= */
 
-typedef int8 Memory[((int16)(-1))];  /* 65KB memory */
+typedef int8 Memory[0x10000];   /* 64KB memory, every 16-bit address */
 typedef int8 Program;
 
+/*
+ * Micro-op - a predecoded instruction. Indexed by the guest IP of the
+ * instruction it was decoded from; next == 0 marks an empty or
+ * invalidated slot (no instruction can end at address 0).
+ */
+struct s_uop {
+    int8 o;     /* Opcode */
+    int8 r;     /* Register index, 0xff if the selector is invalid */
+    int8 base;  /* Base register of a LayMem operand, or BaseNone */
+    int16 imm;  /* Immediate */
+    int16 next; /* IP of the following instruction */
+};
+typedef struct s_uop Uop;
+
+/* Micro-op cache covering code addresses 0..n-1 */
+struct s_uopcache {
+    int32 n;
+    Uop u[];
+};
+typedef struct s_uopcache UC;
+
+/*
+ * Translated basic block - straight-line micro-ops from ip up to and
+ * including a block-ending instruction, or BLOCKMAX instructions
+ */
+#define BLOCKMAX    64
+#define BLOCKHASH   256     /* Hash buckets, power of two */
+
+struct s_vm;
+
+struct s_block {
+    int16 ip;               /* Guest address of the first instruction */
+    int16 end;              /* Guest address following the block */
+    int16 n;                /* Number of micro-ops, one per instruction */
+    struct s_block *chain;  /* Successor at end, linked on first exit */
+    struct s_block *jump;   /* Successor of the last jump out, see chained() */
+    struct s_block *hnext;  /* Next block in the same hash bucket */
+    int (*native)(struct s_vm *);   /* JIT code for a prefix, or NULL */
+    bool jitted;            /* JIT compilation has been attempted */
+    int32 hits;             /* Entries, counted with HVM_NGRAMS only */
+    int16 jn;               /* Guest instructions in the JIT prefix */
+    Uop u[];
+};
+typedef struct s_block Block;
+
+/* Block cache keyed by guest address */
+struct s_blockcache {
+    int32 gen;              /* Bumped on every flush */
+    int16 lo, hi;           /* Guest range covered by translated blocks */
+    bool fuse;              /* Build superinstructions (HVM_NOFUSE unset) */
+    struct s_ngrams *ng;    /* Opcode n-gram profile (HVM_NGRAMS), or NULL */
+    Block *h[BLOCKHASH];
+};
+typedef struct s_blockcache BC;
+
 struct s_vm {
     CPU c;
-    Memory m;
     int16 b;    /* Break/program end pointer */
+    int8 enc;   /* Code encoding, enum e_encoding */
+    UC *uc;     /* Predecoded program, or NULL */
+    BC *bc;     /* Translated blocks, or NULL */
+    struct s_jit *jit;  /* JIT code arena, or NULL */
+    bool verified;      /* Code passed verify() and has not been written */
+    struct s_prof *prof;    /* Execution profile, or NULL */
+    jmp_buf *trap;      /* Where error() returns to, see tryexecute() */
+    Errorcode status;   /* Code passed to error() through the trap */
+    int64 fuel;         /* Instructions left before SysFuel */
+    struct s_image *img;    /* Owner of uc, bc and jit when shared, or NULL */
+    struct s_starts *starts;    /* Instruction starts, while verified */
+    Memory m;           /* Last, and page-aligned; see virtualmachine() */
 };
 typedef struct s_vm VM;
 
+/*
+ * One bit per code address, set where an instruction of verified code
+ * starts, and at the end of code. Read-only once verify() has made it,
+ * so VMs, snapshots and images share it.
+ */
+struct s_starts {
+    int refs;
+    int16 b;            /* End of the code it was made for */
+    int8 bits[];        /* b / 8 + 1 bytes */
+};
+typedef struct s_starts Starts;
+
+/* Frozen registers and memory that VMs are forked from, see h-snap.c */
+struct s_snap {
+    CPU c;
+    int16 b;
+    int8 enc;
+    bool verified;
+    Starts *starts;     /* Held while verified, or NULL */
+    int fd;             /* Memory image, mapped privately by each fork */
+    int8 *m;            /* The same image, read-only */
+};
+typedef struct s_snap Snap;
+
+/*
+ * Program shared by many VMs, see h-image.c. Attached VMs map its code
+ * pages and use its caches, which are complete and read-only.
+ */
+struct s_image {
+    struct s_vm *vm;    /* Built the caches and owns them */
+    int fd;             /* Code pages, mapped privately by each VM */
+    int refs;           /* Attached VMs and other holders */
+};
+typedef struct s_image Image;
+
+/*
+ * Program file, see h-file.c. All fields are little-endian. Code and
+ * data sit at offsets that are multiples of FILEALIGN, zero-padded to
+ * the next multiple, so the loader can map them instead of copying.
+ */
+#define FILEMAGIC   "HVM\x1a"
+#define FILEVERSION 2       /* Version 1 files, without enc, are still read */
+#define FILEALIGN   4096
+
+struct s_filehdr {
+    char magic[4];      /* FILEMAGIC */
+    int16 version;      /* FILEVERSION */
+    int16 nsect;        /* Data sections following the header */
+    int16 entry;        /* Initial ip, below code */
+    int16 sp;           /* Initial sp */
+    int16 code;         /* Code size; code is loaded at address 0 */
+    int16 enc;          /* Code encoding; 0 (EncVar) in version 1 */
+    int32 codeoff;      /* File offset of the code */
+};
+typedef struct s_filehdr FileHdr;
+
+/* Data section - @len bytes loaded at guest address @addr */
+struct s_section {
+    int16 addr;
+    int16 len;
+    int32 off;          /* File offset */
+};
+typedef struct s_section Section;
+
+/* Verification failure - first offending instruction and why */
+struct s_verror {
+    int16 ip;
+    char why[64];
+};
+typedef struct s_verror VErr;
+
+/* Assembly failure - source line and why */
+struct s_aerr {
+    int32 line;
+    char why[64];
+};
+typedef struct s_aerr AErr;
+
+/* One run of a lockstep batch, see executebatch() */
+struct s_lane {
+    Reg r[4];       /* AX, BX, CX, DX */
+    Reg sp, ip, flags;
+    Errorcode status;   /* Out: as from tryexecute() */
+};
+typedef struct s_lane Lane;
+
 typedef Memory *Stack;
 
 /* ============================================================================
@@ -123,9 +297,9 @@ typedef Memory *Stack;
 #define higher(x)   (!!((x $flags & 0x02) >> 1))
 #define lower(x)    (!!(x $flags & 0x01))
 
-/* Arithmetic flag macros */
-#define zero_flag(x)  (!!((x $flags & 0x10) >> 4))
-#define carry_flag(x) (!!((x $flags & 0x20) >> 5))
+/* Arithmetic flag macros - Z/C may be pending, see evalflags() */
+#define zero_flag(x)  (!!((evalflags(x) & 0x10) >> 4))
+#define carry_flag(x) (!!((evalflags(x) & 0x20) >> 5))
 
 /*
  * Extended FLAGS register layout:
@@ -143,112 +317,671 @@ typedef Memory *Stack;
  * Opcodes and Instructions
  * ========================================================================= */
 
-enum e_opcode {
-    nop  = 0x01,
-    hlt  = 0x02,
-    mov  = 0x08,    /* 0x08 - 0x0f */
-    ste  = 0x10,    /* Set equal flag */
-    cle  = 0x11,    /* Clear equal flag */
-    stg  = 0x12,    /* Set greater-than flag */
-    clg  = 0x13,    /* Clear greater-than flag */
-    sth  = 0x14,    /* Set higher flag */
-    clh  = 0x15,    /* Clear higher flag */
-    stl  = 0x16,    /* Set lower flag */
-    cll  = 0x17,    /* Clear lower flag */
-    push = 0x1a,
-    pop  = 0x1b,
-    /* Arithmetic operations */
-    add  = 0x20,    /* ADD reg, value */
-    sub  = 0x21,    /* SUB reg, value */
-    mul  = 0x22,    /* MUL reg, value */
-    div_op = 0x23,  /* DIV reg, value (div is reserved keyword) */
-    inc  = 0x24,    /* INC reg */
-    dec  = 0x25     /* DEC reg */
-};
+/* Opcode constants, see h-isa.h */
+#define OPCODE(name, op, n, lay, reg, f, mnem) name = (op),
+enum e_opcode { ISA(OPCODE) };
+#undef OPCODE
 typedef enum e_opcode Opcode;
 
-/* Instruction map structure - maps opcodes to instruction sizes */
-struct s_instrmap {
-    Opcode o;
-    int8 s;
+/*
+ * Fused micro-ops - superinstructions written over the first micro-op
+ * of a sequence when a block is translated. They use unassigned opcode
+ * numbers, which decode() never produces. The micro-ops they cover stay
+ * in place behind them, see unfused().
+ */
+enum e_fused {
+    FMovAdd = 0xf0, /* mov r, imm ; add r, imm */
+    FMovSub,        /* mov r, imm ; sub r, imm */
+    FMovMul,        /* mov r, imm ; mul r, imm */
+    FIncN,          /* imm x inc r */
+    FDecN           /* imm x dec r */
+};
+
+/*
+ * Operand layouts - how the bytes following the opcode are decoded
+ * into the two handler arguments
+ */
+enum e_layout {
+    LayBad = 0,     /* Unassigned opcode */
+    LayNone,        /* [op] */
+    LayByte,        /* [op][reg] */
+    LayWord,        /* [op][a1 lo][a1 hi] - imm, or a 16-bit selector */
+    LayRegImm,      /* [op][reg][pad][imm] - 8-bit immediate; 16 in EncWord */
+    LayWordWord,    /* [op][a1 lo][a1 hi][a2 lo][a2 hi] */
+    LayMem          /* [op][regs][pad][off lo][off hi] - see memop() */
+};
+typedef enum e_layout Layout;
+
+/*
+ * Code encodings. EncVar sizes each instruction by its layout, as
+ * above. In EncWord every instruction is one aligned little-endian word
+ * [op][reg][imm lo][imm hi]: the register selector, or 0, and a full
+ * 16-bit immediate, so decoding it is one load and shifts. LayMem
+ * keeps its register byte and puts the offset in the immediate;
+ * LayWordWord has no EncWord form.
+ */
+enum e_encoding {
+    EncVar = 0,
+    EncWord
+};
+
+#define WORDSIZE    4       /* Size of an EncWord instruction */
+
+/* laysize - Size in bytes of an instruction with layout @l */
+#define laysize(l) \
+    ((l) == LayNone ? 1 : (l) == LayByte ? 2 : (l) == LayWord ? 3 : \
+     (l) == LayRegImm ? 4 : (l) == LayWordWord || (l) == LayMem ? 5 : 0)
+
+/*
+ * Register operands. Descriptors of RegOp rows hold the register
+ * itself (RegOp + 0-3), so a register index below 4 is always usable.
+ */
+enum e_regfield {
+    RegOp = 0,      /* Fixed by the opcode, ax first */
+    RegArg = 4,     /* First operand; above 3 faults */
+    RegNone         /* No register */
 };
-typedef struct s_instrmap IM;
 
-/* Instruction structure with flexible array for arguments */
+/*
+ * Memory operands. The register byte of a LayMem instruction holds the
+ * data register in its low nibble and the base register in its high
+ * one; BaseNone makes the offset an absolute address.
+ */
+#define BaseNone    0x0f
+#define memregs(r, base) ((Args)(((base) << 4) | ((r) & 0x0f)))
+
+/* Size and last opcode of each row: mov_size, mov_last, ... */
+#define OPROW(name, op, n, lay, reg, f, mnem) \
+    name##_size = laysize(lay), name##_last = (op) + (n) - 1,
+enum e_oprow { ISA(OPROW) };
+#undef OPROW
+
 typedef int16 Args;
-struct s_instruction {
-    Opcode o;
-    Args a[];   /* 0-2 bytes */
-};
-typedef struct s_instruction Instruction;
-
-/* Static instruction map - defines size of each opcode */
-static IM instrmap[] = {
-    { nop,  0x01 },
-    { hlt,  0x01 },
-    { mov,  0x03 },
-        { 0x09, 0x03 }, { 0x0a, 0x03 }, { 0x0b, 0x03 }, { 0x0c, 0x03 },
-        { 0x0d, 0x03 }, { 0x0e, 0x03 }, { 0x0f, 0x03 },
-    { ste,  0x01 },
-    { stg,  0x01 },
-    { stl,  0x01 },
-    { sth,  0x01 },
-    { cle,  0x01 },
-    { clg,  0x01 },
-    { cll,  0x01 },
-    { clh,  0x01 },
-    { push, 0x03 },
-    { pop,  0x03 },
-    /* Arithmetic operations - 4 bytes for 16-bit immediate values */
-    { add,  0x04 },
-    { sub,  0x04 },
-    { mul,  0x04 },
-    { div_op, 0x04 },
-    { inc,  0x02 },
-    { dec,  0x02 }
-};
-#define IMs (sizeof(instrmap) / sizeof(struct s_instrmap))
+
+/* Label fixup - 16-bit field at @at to receive the address of label @l */
+struct s_fixup {
+    int at;
+    int l;
+};
+typedef struct s_fixup Fixup;
+
+/*
+ * Program builder - encodes instructions straight into a byte buffer,
+ * see h-build.c. Every array grows by doubling, so building costs no
+ * allocation per instruction.
+ */
+struct s_builder {
+    int8 *p;            /* Code */
+    int8 enc;           /* Encoding to emit; EncVar unless set after builder() */
+    int n;              /* Bytes emitted */
+    int cap;            /* Size of p */
+    bool grow;          /* p is ours and may be reallocated */
+    bool fail;          /* Something did not fit; the program is unusable */
+    int *lab;           /* Label addresses, -1 until placed */
+    int nlab, caplab;
+    Fixup *fix;
+    int nfix, capfix;
+};
+typedef struct s_builder Builder;
+
+/*
+ * Handler - one instruction for one register operand, @imm its
+ * immediate; see handlers[] in h-vm.c
+ */
+typedef void (*Handler)(VM*, Args);
+
+/* Opcode flags */
+#define OpEnd       0x01    /* Ends a basic block */
+#define OpStop      0x02    /* Never goes on to the next instruction */
+#define OpJump      0x04    /* Sets vm $ip itself, see execinstr() */
+#define OpTarget    0x08    /* Immediate is a code address */
+
+/* Flags of the control transfers */
+#define OpHalt      (OpEnd | OpStop)
+#define OpBranch    (OpEnd | OpJump | OpTarget)     /* May fall through */
+#define OpGoto      (OpBranch | OpStop)
+#define OpRet       (OpEnd | OpJump | OpStop)
+
+/*
+ * Opcode descriptor - one entry per opcode byte, generated from h-isa.h
+ * at compile time so decode is a single table index. Unassigned opcodes
+ * have s == 0 and l == LayBad.
+ */
+struct s_opdesc {
+    int8 s;     /* Instruction size in bytes */
+    Layout l;   /* Operand layout */
+    int8 r;     /* Register 0-3 for RegOp rows, else RegArg or RegNone */
+    int8 f;     /* Opcode flags */
+    const char *n;  /* Mnemonic */
+};
+typedef const struct s_opdesc OD;
+
+extern OD optable[256];
+
+/*
+ * Execution engine - a complete fetch/decode/dispatch loop. All engines
+ * run the same bytecode with identical results; they are listed in
+ * engines[] so one can be picked by name at run time.
+ */
+struct s_engine {
+    const char *name;
+    void (*run)(VM*);
+};
+typedef struct s_engine Engine;
+
+extern Engine engines[];
+
+/*
+ * Label tables of threaded engines: l_name for every opcode of a row,
+ * l_bad for the rest. The rows override the l_bad range, so users wrap
+ * the declaration in a -Woverride-init diagnostic push/pop.
+ */
+#define OPLABEL(name, op, n, lay, reg, f, mnem) [op ... (op) + (n) - 1] = &&l_##name,
+#define ISAROWS [0 ... 255] = &&l_bad, ISA(OPLABEL)
+#define ISALABELS { ISAROWS }
+
+/* Label table for engines built on h-uops.inc */
+#define UOPROWS ISAROWS \
+        [FMovAdd] = &&l_movadd, [FMovSub] = &&l_movsub, \
+        [FMovMul] = &&l_movmul, [FIncN] = &&l_incn, [FDecN] = &&l_decn,
+#define UOPLABELS { UOPROWS }
+
+/* The same with ld and st going to l_ldfast and l_stfast; see fastload() */
+#define ISAFASTLABELS { ISAROWS [ld] = &&l_ldfast, [st] = &&l_stfast }
+#define UOPFASTLABELS { UOPROWS [ld] = &&l_ldfast, [st] = &&l_stfast }
+
+/* Engine used when none is requested; override with make ENGINE=... */
+#ifndef ENGINE
+  #define ENGINE "switch"
+#endif
 
 /* ============================================================================
  * Function Declarations
  * ========================================================================= */
 
-/* Flag operations */
-void __ste(VM*, Opcode, Args, Args);
-void __stg(VM*, Opcode, Args, Args);
-void __sth(VM*, Opcode, Args, Args);
-void __stl(VM*, Opcode, Args, Args);
-void __cle(VM*, Opcode, Args, Args);
-void __clg(VM*, Opcode, Args, Args);
-void __clh(VM*, Opcode, Args, Args);
-void __cll(VM*, Opcode, Args, Args);
-
-/* Stack operations */
-void __push(VM*, Opcode, Args, Args);
-void __pop(VM*, Opcode, Args, Args);
-
-/* MOV instruction */
-void __mov(VM*, Opcode, Args, Args);
-
-/* Arithmetic operations */
-void __add(VM*, Opcode, Args, Args);
-void __sub(VM*, Opcode, Args, Args);
-void __mul(VM*, Opcode, Args, Args);
-void __div(VM*, Opcode, Args, Args);
-void __inc(VM*, Opcode, Args, Args);
-void __dec(VM*, Opcode, Args, Args);
-
 /* Core VM functions */
 void error(VM*, Errorcode);
-void execinstr(VM*, Program*);
+void freevm(VM*);
+int8 execinstr(VM*, Program*);
 void execute(VM*);
-Program *i(Instruction*);
-Instruction *i0(Opcode);
-Instruction *i1(Opcode, Args);
-Instruction *i2(Opcode, Args, Args);
+void executethreaded(VM*);
+void executeuops(VM*);
+void executeblocks(VM*);
+void decode(VM*, int16, Uop*);
+void predecode(VM*);
+void invalidate(VM*, int16, int16);
+void dropcaches(VM*);
+Block *block(VM*, int16);
+Block *cached(VM*, int16);
+void blockcache(VM*);
+void flushblocks(VM*);
+void freeblocks(VM*);
+void executejit(VM*);
+void jitall(VM*);
+void freejit(VM*);
+bool jitfault(VM*, void*);
+bool verify(VM*, VErr*);
+Starts *holdstarts(Starts*);
+void dropstarts(Starts*);
+void executeverified(VM*);
+void executeprofile(VM*);
+void profreport(VM*);
+void profsignal(void);
+void freeprof(VM*);
+Engine *engine(const char*);
+Errorcode tryexecute(VM*, Engine*);
+Errorcode tryexecutefor(VM*, Engine*, int64);
+bool executebatch(VM*, Lane*, int32);
+Snap *snapshot(VM*);
+VM *forkvm(Snap*);
+bool restore(VM*, Snap*);
+void freesnap(Snap*);
+Image *mkimage(VM*);
+bool attach(VM*, Image*);
+void detach(VM*);
+void own(VM*);
+Image *holdimage(Image*);
+void dropimage(Image*);
+void builder(Builder*, int8*, int);
+int emit(Builder*, Opcode, Args, Args);
+int immof(Builder*, int);
+int label(Builder*);
+void place(Builder*, int);
+void ref(Builder*, int, int);
+bool built(Builder*);
+bool program(VM*, Builder*);
+void freebuilder(Builder*);
+bool assemble(Builder*, FILE*, AErr*);
+int disasm(VM*, int16, char*, int);
+bool loadfile(VM*, const char*);
+bool savefile(VM*, const char*, const Section*, int);
 int8 map(Opcode);
 VM *virtualmachine(void);
-int main(int, char**);
+bool guardpage(void);
+bool wipe(VM*);
+
+/* ============================================================================
+ * Instruction Semantics
+ * ========================================================================= */
+
+/*
+ * Side-effect kernels shared by every execution engine. They assume the
+ * caller has already validated operands; faults are raised by the caller.
+ */
+
+/*
+ * regsel - Map a register selector to a general purpose register
+ * Returns: Pointer to AX/BX/CX/DX, or NULL for an invalid selector
+ */
+static inline Reg *regsel(VM *vm, Args a) {
+    return (a < 4) ? (&vm $ax) + a : (Reg *)0;
+}
+
+/*
+ * evalflags - Fold pending Z/C into FLAGS
+ * Returns: Current FLAGS
+ *
+ * Anything that reads Z or C must go through here (zero_flag() and
+ * carry_flag() do).
+ */
+static inline Reg evalflags(VM *vm) {
+    Lazy *lf = &vm->c.lf;
+
+    if (lf->op == LazyNone)
+        return vm $flags;
+
+    vm $flags &= 0x0F;  /* Clear Z and C flags */
+    if (!(lf->res & 0xFFFF))
+        vm $flags |= 0x10;
+    if ((lf->op == LazyAdd && lf->res > 0xFFFF) ||
+            (lf->op == LazySub && $i lf->res < 0))
+        vm $flags |= 0x20;
+    lf->op = LazyNone;
+
+    return vm $flags;
+}
+
+/*
+ * setarith - Store an arithmetic result and leave Z and C pending
+ * @result: Untruncated result
+ * @op: Rule deriving Z and C from @result
+ */
+static inline void setarith(VM *vm, Reg *reg, int32 result, int8 op) {
+    vm->c.lf.res = result;
+    vm->c.lf.op = op;
+    *reg = $2 (result & 0xFFFF);
+}
+
+static inline void opadd(VM *vm, Reg *reg, int16 v) {
+    setarith(vm, reg, $4 *reg + $4 v, LazyAdd);
+}
+
+static inline void opsub(VM *vm, Reg *reg, int16 v) {
+    setarith(vm, reg, $4 ($i *reg - $i v), LazySub);
+}
+
+static inline void opmul(VM *vm, Reg *reg, int16 v) {
+    setarith(vm, reg, $4 *reg * $4 v, LazyAdd);
+}
+
+/* @v must be non-zero */
+static inline void opdiv(VM *vm, Reg *reg, int16 v) {
+    setarith(vm, reg, $4 (*reg / v), LazyDiv);
+}
+
+static inline void opinc(VM *vm, Reg *reg) {
+    opadd(vm, reg, 1);
+}
+
+static inline void opdec(VM *vm, Reg *reg) {
+    opsub(vm, reg, 1);
+}
+
+/*
+ * unfused - Opcode of the first instruction a micro-op stands for
+ *
+ * For consumers that walk a block one instruction at a time and do not
+ * handle superinstructions themselves.
+ */
+static inline int8 unfused(Uop *u) {
+    switch (u->o) {
+        case FMovAdd ... FMovMul:
+            return mov + u->r;
+        case FIncN:
+            return inc;
+        case FDecN:
+            return dec;
+        default:
+            return u->o;
+    }
+}
+
+/*
+ * opcmp - Flags of @a - @b, which is not kept: E if equal, G if @a is
+ * above @b, and Z and C as sub leaves them
+ */
+static inline void opcmp(VM *vm, int16 a, int16 b) {
+    vm $flags = (vm $flags & 0x03) | ((a == b) ? 0x08 : 0) | ((a > b) ? 0x04 : 0);
+    vm->c.lf.res = $4 ($i a - $i b);
+    vm->c.lf.op = LazySub;
+}
+
+/*
+ * taken - Whether conditional jump @o jumps with the current flags;
+ * true for the other jumps
+ */
+static inline bool taken(VM *vm, int8 o) {
+    switch (o) {
+        case je:  return equal(vm);
+        case jne: return !equal(vm);
+        case jg:  return gt(vm);
+        case jng: return !gt(vm);
+        case jz:  return zero_flag(vm);
+        case jnz: return !zero_flag(vm);
+        case jc:  return carry_flag(vm);
+        case jnc: return !carry_flag(vm);
+        default:  return true;
+    }
+}
+
+/* Flag clear; every clear mask also drops Z and C, pending or not */
+static inline void opclf(VM *vm, int8 mask) {
+    vm->c.lf.op = LazyNone;
+    vm $flags &= mask;
+}
+
+/* Register move honouring the H/L byte-select flags (not both set) */
+static inline void opmov(VM *vm, Reg *reg, Args a) {
+    if (higher(vm))
+        *reg = (((Reg)a << 8) | (*reg & 0xFF));
+    else if (lower(vm))
+        *reg = ((Reg)a | (*reg & 0xFF00));
+    else
+        *reg = (Reg)a;
+}
+
+/*
+ * codewrite - Note a guest store to [addr, addr+len)
+ *
+ * Stores that land in code memory drop the affected micro-ops and the
+ * program's verified mark.
+ */
+static inline void codewrite(VM *vm, int16 addr, int16 len) {
+    if (addr > vm->b)
+        return;
+    vm->verified = false;
+    if (vm->uc || vm->bc)
+        invalidate(vm, addr, len);
+}
+
+/* Stack bounds are checked by the caller */
+static inline void oppush(VM *vm, int16 v) {
+    vm $sp -= 2;
+    *(int16 *)(vm->m + vm $sp) = v;
+    codewrite(vm, vm $sp, 2);
+}
+
+static inline int16 oppop(VM *vm) {
+    int16 v = *(int16 *)(vm->m + vm $sp);
+    vm $sp += 2;
+    return v;
+}
+
+/*
+ * memop - Resolve the operands of a LayMem instruction
+ * @f: Register byte
+ * @addr: The offset; replaced by the effective address
+ * Returns: Selector of the data register, 4 if either field is bad
+ */
+static inline Args memop(VM *vm, Args f, Args *addr) {
+    Args base = f >> 4;
+
+    if ((f & 0x0f) > 3 || (base > 3 && base != BaseNone))
+        return 4;
+    if (base != BaseNone)
+        *addr += (&vm $ax)[base];
+
+    return f & 0x0f;
+}
+
+/* uopaddr - Effective address of LayMem micro-op @u */
+static inline int16 uopaddr(VM *vm, Uop *u) {
+    return (u->base < 4) ? $2 (u->imm + (&vm $ax)[u->base]) : u->imm;
+}
+
+/*
+ * Every 16-bit address is memory, so the only access that can leave it
+ * is a word at 0xffff. opload() and opstore() test for that one;
+ * fastload() and faststore() leave it to the guard page behind memory
+ * (see virtualmachine()) and may only run once guardpage() has been
+ * called. The fast engines pick between them with one label table of
+ * each kind, see ISAFASTLABELS. A guard page fault leaves through error()
+ * from the middle of the access, so the barrier keeps the compiler from
+ * holding back earlier stores to the VM until after it.
+ */
+extern bool guarded;
+
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+static inline int16 opload(VM *vm, int16 addr) {
+    if (__builtin_expect(addr == 0xffff, 0))
+        segfault(vm);
+    return *(int16 *)(vm->m + addr);
+}
+
+static inline void opstore(VM *vm, int16 addr, int16 v) {
+    if (__builtin_expect(addr == 0xffff, 0))
+        segfault(vm);
+    *(int16 *)(vm->m + addr) = v;
+    codewrite(vm, addr, 2);
+}
+
+static inline int16 fastload(VM *vm, int16 addr) {
+    barrier();
+    return *(int16 *)(vm->m + addr);
+}
+
+static inline void faststore(VM *vm, int16 addr, int16 v) {
+    barrier();
+    *(int16 *)(vm->m + addr) = v;
+    codewrite(vm, addr, 2);
+}
+
+/*
+ * pageup - @n rounded up to whole pages
+ */
+static inline size_t pageup(size_t n) {
+    size_t pg = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (n + pg - 1) & ~(pg - 1);
+}
+
+/* ============================================================================
+ * Instruction Encoding
+ * ========================================================================= */
+
+/* decodemem - Split LayMem register byte @f into u->r and u->base */
+static inline void decodemem(Uop *u, Args f) {
+    u->base = f >> 4;
+    u->r = f & 0x0f;
+    if (u->r > 3 || (u->base > 3 && u->base != BaseNone))
+        u->r = 0xff;
+}
+
+/*
+ * decodeop - Decode the instruction at @p into @u, all but u->next
+ *
+ * Undefined opcodes decode to u->o == 0. u->r is the register, 0xff for
+ * a bad selector, or 0 if the instruction has none; u->imm is the
+ * immediate, or a push/pop selector as written. LayMem instructions
+ * also set u->base, and take both fields as bad if either is.
+ */
+static inline void decodeop(const Program *p, Uop *u) {
+    Args sel;
+    OD *d;
+
+    d = &optable[*p];
+    u->o = d->s ? *p : 0;   /* Keep fused micro-op numbers unreachable */
+    u->imm = 0;
+    sel = 0;
+    switch (d->l) {
+        case LayByte:
+            sel = *(p+1);
+            break;
+
+        case LayWord:
+        case LayWordWord:
+            u->imm = (Args)((*(p+2) << 8) | *(p+1));
+            sel = u->imm;
+            break;
+
+        case LayRegImm:
+            sel = *(p+1);
+            u->imm = *(p+3);
+            break;
+
+        case LayMem:
+            u->imm = (Args)((*(p+4) << 8) | *(p+3));
+            sel = *(p+1);
+            break;
+
+        default:
+            break;
+    }
+    u->base = BaseNone;
+    if (d->l == LayMem)
+        decodemem(u, sel);
+    else if (d->r == RegArg)
+        u->r = (sel < 4) ? (int8)sel : 0xff;
+    else
+        u->r = (d->r < RegArg) ? d->r : 0;
+}
+
+/*
+ * encodeop - Encode @op at @p
+ * @a1: Register selector, or the immediate of a mov or jump
+ * @a2: Immediate of a LayRegImm instruction
+ * Returns: Instruction size, or 0 for an undefined opcode
+ *
+ * Arguments are laid out little-endian after the opcode and cut to the
+ * instruction's size, which gives each layout its encoding: inc r is
+ * [inc][r], mov is [op][imm lo][imm hi], add r, imm is [add][r][0][imm]
+ * and a load is [ld][memregs()][0][off lo][off hi].
+ */
+static inline int8 encodeop(int8 *p, Opcode op, Args a1, Args a2) {
+    int8 enc[5], s;
+
+    s = optable[(int8)op].s;
+    enc[0] = (int8)op;
+    enc[1] = (int8)a1;
+    enc[2] = (int8)(a1 >> 8);
+    enc[3] = (int8)a2;
+    enc[4] = (int8)(a2 >> 8);
+    copy(p, enc, s);
+
+    return s;
+}
+
+/*
+ * decodeword - decodeop() for an EncWord instruction
+ *
+ * Fields a layout does not use are read as they are; encodeword()
+ * leaves them zero.
+ */
+static inline void decodeword(const Program *p, Uop *u) {
+    int32 w, sel;
+    OD *d;
+
+    copy($1 &w, (int8 *)p, WORDSIZE);
+    d = &optable[w & 0xff];
+    sel = (w >> 8) & 0xff;
+    u->o = d->s ? (int8)w : 0;
+    u->imm = (Args)(w >> 16);
+    u->base = BaseNone;
+    if (d->l == LayMem)
+        decodemem(u, sel);
+    else if (d->r == RegArg)
+        u->r = (sel < 4) ? (int8)sel : 0xff;
+    else
+        u->r = (d->r < RegArg) ? d->r : 0;
+}
+
+/*
+ * encodeword - encodeop() in EncWord
+ * Returns: WORDSIZE, or 0 for an opcode with no EncWord form
+ *
+ * The selector goes in the register field, saturated to 0xff so it
+ * stays invalid; the immediate is @a2 for LayRegImm and LayMem, else
+ * @a1 unless @a1 was the selector.
+ */
+static inline int8 encodeword(int8 *p, Opcode op, Args a1, Args a2) {
+    Args reg, imm;
+    OD *d;
+
+    d = &optable[(int8)op];
+    if (!d->s || d->l == LayWordWord)
+        return 0;
+    reg = (d->r == RegArg) ? ((a1 > 0xff) ? 0xff : a1) : 0;
+    imm = (d->l == LayRegImm || d->l == LayMem) ? a2 : (d->r == RegArg) ? 0 : a1;
+    p[0] = (int8)op;
+    p[1] = (int8)reg;
+    p[2] = (int8)imm;
+    p[3] = (int8)(imm >> 8);
+
+    return WORDSIZE;
+}
+
+/*
+ * isize - Size of an instruction with opcode @o in @vm's encoding
+ * Returns: 0 for an undefined opcode, as map()
+ */
+static inline int8 isize(VM *vm, int8 o) {
+    return (vm->enc == EncWord && optable[o].s) ? WORDSIZE : optable[o].s;
+}
+
+/* ============================================================================
+ * Instruction Budget
+ * ========================================================================= */
+
+#define FUELMAX     (~0ULL)     /* No budget */
+
+/*
+ * burn - Charge one instruction to the budget
+ *
+ * Called before the instruction at vm $ip runs, so a VM stopped with
+ * SysFuel resumes from vm $ip.
+ */
+static inline void burn(VM *vm) {
+    if (__builtin_expect(!vm->fuel, 0))
+        error(vm, SysFuel);
+    vm->fuel--;
+}
+
+/* ============================================================================
+ * Block Chaining
+ * ========================================================================= */
+
+/*
+ * A block has two successor slots: chain for leaving at its end, jump
+ * for the target of the last jump out of it. The jump slot is a cache,
+ * as where a ret or a taken branch goes can change from one exit to the
+ * next, so both are checked against the address actually reached.
+ */
 
+/* chained - The successor linked to @blk for an exit to @ip, or NULL */
+static inline Block *chained(Block *blk, int16 ip) {
+    Block *to;
+
+    to = (ip == blk->end) ? blk->chain : blk->jump;
+    return (to && to->ip == ip) ? to : (Block *)0;
+}
+
+/* linkblock - Link @to to @blk as the successor for exits to to->ip */
+static inline void linkblock(Block *blk, Block *to) {
+    if (to->ip == blk->end)
+        blk->chain = to;
+    else
+        blk->jump = to;
+}
 
 #endif /* H_VM_H */
@@ -0,0 +1,156 @@
+/*
+ * hvm.h - H-VM Embedding API
+ *
+ * Public interface of libhvm. A VM is created once, loaded with a
+ * program and run any number of times; hlt and guest faults come back
+ * as status codes, and nothing in this API prints or exits.
+ *
+ *   HVM *h = hvmnew();
+ *   if (hvmload(h, code, len, &err) == HvmOk)
+ *       while (more) {
+ *           status = hvmrun(h, 0);
+ *           hvmregs(h, &regs);
+ *           hvmreset(h);
+ *       }
+ *   hvmfree(h);
+ *
+ * For batches, a pool runs jobs on one worker thread per core and hands
+ * back results as they finish:
+ *
+ *   HVMPool *p = hvmpoolnew(0);
+ *   for (each program)
+ *       hvmsubmit(p, &job);
+ *   while (hvmcollect(p, &result, 1))
+ *       use(result.tag, result.status, &result.regs);
+ *   hvmpoolfree(p);
+ *
+ * hvmrunfor() stops a run after a number of instructions and can be
+ * called again to continue it. A scheduler uses that to interleave VMs
+ * on the calling thread in fixed quanta, highest priority first.
+ *
+ * A VM prepared once can be captured with hvmsnapshot() and forked any
+ * number of times; forks share memory copy-on-write:
+ *
+ *   HVMSnap *s = hvmsnapshot(h);
+ *   HVM *child = hvmfork(s);        // hvmreset(child) goes back to s
+ *
+ * A program loaded into many VMs can be prepared once as an image; each
+ * VM then shares its code pages and compiled code:
+ *
+ *   HVMImage *img = hvmimage(code, len, &err);
+ *   hvmloadimage(h, img);           // instead of hvmload()
+ *
+ * hvmassemble() loads a program from assembly text instead of bytecode:
+ *
+ *   hvmassemble(h, "mov ax, 5\nhlt\n", 14, &err);
+ *
+ * hvmbatch() runs one loaded program for many sets of inputs at once,
+ * sixteen to a group in SIMD lanes:
+ *
+ *   hvmbatch(h, regs, status, n);   // regs[k] in, results out
+ *
+ * hvmguard() installs a SIGSEGV handler that turns a guest access past
+ * the end of memory into HvmSegv, so loads and stores can skip their
+ * bounds check. It is off by default; call it again after installing
+ * a SIGSEGV handler of your own. Faults it does not recognise go to the
+ * handler that was installed before it.
+ */
+
+#ifndef HVM_H
+#define HVM_H
+
+#include <stddef.h>
+
+/* libhvm exports these and nothing else */
+#if defined(__GNUC__)
+  #define HVMAPI __attribute__((visibility("default")))
+#else
+  #define HVMAPI
+#endif
+
+typedef struct s_hvm HVM;
+typedef struct s_hvmimage HVMImage;
+
+/* Status codes; the guest ones match the VM's error codes */
+#define HvmOk       0x00    /* Load succeeded */
+#define HvmHalt     0x01    /* Guest executed hlt */
+#define HvmNoMem    0x02    /* Host allocation failed */
+#define HvmSegv     0x04    /* Guest segmentation fault */
+#define HvmInstr    0x08    /* Guest illegal instruction */
+#define HvmRejected 0x10    /* Program failed verification, or none loaded */
+#define HvmEngine   0x20    /* Unknown engine name */
+#define HvmFuel     0x40    /* Instruction budget ran out; run again to resume */
+
+/* Register file */
+struct s_hvmregs {
+    unsigned short ax, bx, cx, dx;
+    unsigned short sp, ip;
+    unsigned short flags;
+};
+typedef struct s_hvmregs HVMRegs;
+
+/* Why hvmload() rejected a program */
+struct s_hvmerror {
+    unsigned short ip;  /* Offset of the offending instruction */
+    char why[64];
+};
+typedef struct s_hvmerror HVMError;
+
+/* Pool job */
+struct s_hvmjob {
+    const void *code;       /* Program; must stay valid until collected */
+    size_t len;
+    const HVMRegs *regs;    /* Initial registers, or NULL for the load state */
+    const char *engine;     /* Engine name, or NULL for the default */
+    void *tag;              /* Handed back with the result */
+    unsigned long long budget;  /* Most instructions to run, or 0 for no limit */
+    HVMImage *image;    /* Program to run instead of code; must stay valid */
+};
+typedef struct s_hvmjob HVMJob;
+
+/* Pool result */
+struct s_hvmresult {
+    void *tag;
+    int status;     /* As from hvmrun(), or hvmload() if that failed */
+    HVMRegs regs;   /* Final registers */
+    HVMError err;   /* Why the program was rejected */
+};
+typedef struct s_hvmresult HVMResult;
+
+typedef struct s_hvmsnap HVMSnap;
+typedef struct s_hvmpool HVMPool;
+typedef struct s_hvmsched HVMSched;
+
+HVMAPI HVM *hvmnew(void);
+HVMAPI int hvmload(HVM*, const void*, size_t, HVMError*);
+HVMAPI int hvmassemble(HVM*, const char*, size_t, HVMError*);
+HVMAPI int hvmrun(HVM*, const char*);
+HVMAPI int hvmrunfor(HVM*, const char*, unsigned long long);
+HVMAPI int hvmbatch(HVM*, HVMRegs*, int*, size_t);
+HVMAPI void hvmregs(HVM*, HVMRegs*);
+HVMAPI void hvmsetregs(HVM*, const HVMRegs*);
+HVMAPI const unsigned char *hvmmemory(HVM*);
+HVMAPI void hvmreset(HVM*);
+HVMAPI void hvmfree(HVM*);
+HVMAPI const char *hvmstrerror(int);
+HVMAPI int hvmguard(void);
+
+HVMAPI HVMSnap *hvmsnapshot(HVM*);
+HVMAPI HVM *hvmfork(HVMSnap*);
+HVMAPI void hvmsnapfree(HVMSnap*);
+
+HVMAPI HVMImage *hvmimage(const void*, size_t, HVMError*);
+HVMAPI int hvmloadimage(HVM*, HVMImage*);
+HVMAPI void hvmimagefree(HVMImage*);
+
+HVMAPI HVMPool *hvmpoolnew(int);
+HVMAPI int hvmsubmit(HVMPool*, const HVMJob*);
+HVMAPI int hvmcollect(HVMPool*, HVMResult*, int);
+HVMAPI void hvmpoolfree(HVMPool*);
+
+HVMAPI HVMSched *hvmschednew(unsigned long long);
+HVMAPI int hvmspawn(HVMSched*, HVM*, const char*, int, void*);
+HVMAPI int hvmschedrun(HVMSched*, HVMResult*);
+HVMAPI void hvmschedfree(HVMSched*);
+
+#endif /* HVM_H */